@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+# See LICENSE file for copyright and license details.
+
+"""Compares cold and warm page loads for each cache model.
+
+    bench/cache.py [-n ROUNDS] [-m MODEL]... [-a ASSETS] [-s KIB] [CREAM]
+
+Serves a page with ASSETS scripts, style sheets and images of KIB KiB
+each from a local HTTP server, with a lifetime of an hour. Per round and
+model, one instance loads the page with an empty disk cache (cold),
+then opens it again in a second tab (revisit, memory cache), and a new
+instance on the same disk cache loads it once more (restart, disk
+cache). The page reports its load time, the server counts the requests
+for assets it got. Needs a display, use xvfb-run on headless machines.
+"""
+
+import argparse
+import http.server
+import os
+import queue
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PAGE = """<!DOCTYPE html>
+<html><head><title>cache bench</title>
+{links}
+</head><body>
+{images}
+<script>
+window.addEventListener("load", function () {{
+    setTimeout(function () {{
+        var nav = performance.getEntriesByType("navigation")[0];
+        fetch("/done?ms=" + nav.loadEventStart, {{cache: "no-store"}});
+    }}, 0);
+}});
+</script>
+</body></html>
+"""
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def end_headers(self):
+        if self.path.startswith("/assets/"):
+            self.send_header("Cache-Control", "max-age=3600")
+        else:
+            self.send_header("Cache-Control", "no-cache")
+        super().end_headers()
+
+    def do_GET(self):
+        srv = self.server
+        if self.path.startswith("/done?ms="):
+            self.send_response(204)
+            self.end_headers()
+            srv.done.put(float(self.path.split("=", 1)[1]))
+            return
+        if self.path.startswith("/assets/"):
+            with srv.lock:
+                srv.assets += 1
+        super().do_GET()
+
+
+def make_corpus(root, assets, kib):
+    os.mkdir(os.path.join(root, "assets"))
+    blob = "/*" + "x" * (kib * 1024 - 4) + "*/"
+    links, images = [], []
+    for i in range(assets):
+        kind = ("js", "css", "svg")[i % 3]
+        name = f"assets/a{i}.{kind}"
+        with open(os.path.join(root, name), "w") as f:
+            if kind == "svg":
+                f.write('<svg xmlns="http://www.w3.org/2000/svg" width="8" '
+                        f'height="8"><!--{"x" * (kib * 1024)}--></svg>')
+                images.append(f'<img src="/{name}">')
+            else:
+                f.write(blob)
+                if kind == "js":
+                    links.append(f'<script src="/{name}"></script>')
+                else:
+                    links.append(f'<link rel="stylesheet" href="/{name}">')
+    with open(os.path.join(root, "index.html"), "w") as f:
+        f.write(PAGE.format(links="\n".join(links), images="\n".join(images)))
+
+
+def wait_for_socket(path, proc, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if os.path.exists(path):
+            return True
+        if proc.poll() is not None:
+            return False
+        time.sleep(0.05)
+    return False
+
+
+class Server:
+    def __init__(self, root):
+        handler = lambda *a, **kw: Handler(*a, directory=root, **kw)
+        self.httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), handler)
+        self.httpd.done = queue.Queue()
+        self.httpd.lock = threading.Lock()
+        self.httpd.assets = 0
+        self.uri = f"http://127.0.0.1:{self.httpd.server_address[1]}/"
+        threading.Thread(target=self.httpd.serve_forever, daemon=True).start()
+
+    def reset(self):
+        with self.httpd.lock:
+            self.httpd.assets = 0
+
+    def load(self, timeout):
+        """Load time reported by the page, and asset requests since reset()."""
+        try:
+            ms = self.httpd.done.get(timeout=timeout)
+        except queue.Empty:
+            sys.exit("cache: page did not report its load time")
+        with self.httpd.lock:
+            return ms, self.httpd.assets
+
+
+def run_round(args, srv, model, runtime):
+    cache = tempfile.mkdtemp(prefix="cream-bench-cache-")
+    env = dict(os.environ, XDG_RUNTIME_DIR=runtime, XDG_CACHE_HOME=cache,
+               CREAM_SOCKET_SUFFIX="bench", CREAM_CACHE_MODEL=model,
+               CREAM_DISK_CACHE_DIR=cache)
+    env.pop("CREAM_HISTORY_FILE", None)
+    sock = os.path.join(runtime, "cream.sock-bench")
+    res = {}
+    try:
+        for phase in ("cold", "restart"):
+            srv.reset()
+            proc = subprocess.Popen([args.cream, srv.uri], env=env,
+                                    stdout=subprocess.DEVNULL,
+                                    stderr=subprocess.DEVNULL)
+            try:
+                if not wait_for_socket(sock, proc, 30):
+                    sys.exit("cache: instance did not come up")
+                res[phase] = srv.load(args.timeout)
+                if phase == "cold":
+                    srv.reset()
+                    subprocess.run([args.cream, srv.uri], env=env, check=True,
+                                   stdout=subprocess.DEVNULL)
+                    res["revisit"] = srv.load(args.timeout)
+                    # Let the network process write the cache entries.
+                    time.sleep(args.settle)
+            finally:
+                proc.terminate()
+                proc.wait()
+                try:
+                    os.unlink(sock)
+                except FileNotFoundError:
+                    pass
+    finally:
+        shutil.rmtree(cache, ignore_errors=True)
+    return res
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-n", "--rounds", type=int, default=5)
+    ap.add_argument("-m", "--model", action="append",
+                    choices=("viewer", "browser", "custom"))
+    ap.add_argument("-a", "--assets", type=int, default=30)
+    ap.add_argument("-s", "--size", type=int, default=64,
+                    help="size of each asset, in KiB")
+    ap.add_argument("--settle", type=float, default=1.0,
+                    help="seconds to wait before a restart")
+    ap.add_argument("--timeout", type=float, default=30.0)
+    ap.add_argument("cream", nargs="?", default="./cream")
+    args = ap.parse_args()
+
+    root = tempfile.mkdtemp(prefix="cream-bench-www-")
+    runtime = tempfile.mkdtemp(prefix="cream-bench-")
+    try:
+        make_corpus(root, args.assets, args.size)
+        srv = Server(root)
+        for model in args.model or ("viewer", "browser"):
+            rounds = [run_round(args, srv, model, runtime)
+                      for _ in range(args.rounds)]
+            line = f"cache model={model} rounds={len(rounds)}"
+            for phase in ("cold", "revisit", "restart"):
+                ms = statistics.median(r[phase][0] for r in rounds)
+                reqs = statistics.median(r[phase][1] for r in rounds)
+                line += f" {phase}_ms={ms:.1f} {phase}_requests={reqs:g}"
+            print(line, flush=True)
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+        shutil.rmtree(runtime, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# See LICENSE file for copyright and license details.
+
+"""Measures how long "cream URI" takes when an instance is already
+running, from exec to exit.
+
+    bench/forward.py [-n RUNS] [-t TARGET_MS] [CREAM]
+
+Starts a primary instance on a private socket, then runs "CREAM -l"
+against it RUNS times. Listing tabs takes the same path as handing over
+URIs, without opening hundreds of tabs. Needs a display, use xvfb-run
+on headless machines. Exits with status 1 if the median is above
+TARGET_MS.
+"""
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def wait_for_socket(path, proc, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if os.path.exists(path):
+            return True
+        if proc.poll() is not None:
+            return False
+        time.sleep(0.05)
+    return False
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-n", "--runs", type=int, default=200)
+    ap.add_argument("-t", "--target", type=float, default=5.0,
+                    help="median to stay below, in milliseconds")
+    ap.add_argument("cream", nargs="?", default="./cream")
+    args = ap.parse_args()
+
+    profile = tempfile.mkdtemp(prefix="cream-bench-profile-")
+    runtime = os.path.join(profile, "runtime")
+    os.mkdir(runtime, 0o700)
+    env = dict(os.environ, XDG_RUNTIME_DIR=runtime,
+               XDG_CACHE_HOME=os.path.join(profile, "cache"),
+               XDG_CONFIG_HOME=os.path.join(profile, "config"),
+               XDG_DATA_HOME=os.path.join(profile, "data"),
+               CREAM_SOCKET_SUFFIX="bench")
+    for name in ("CREAM_HISTORY_FILE", "CREAM_SESSION_FILE",
+                 "CREAM_DISK_CACHE_DIR", "CREAM_PAGELOAD_FILE"):
+        env.pop(name, None)
+    sock = os.path.join(runtime, "cream.sock-bench")
+
+    primary = subprocess.Popen([args.cream, "about:blank"], env=env,
+                               stdout=subprocess.DEVNULL)
+    try:
+        if not wait_for_socket(sock, primary, 30):
+            sys.exit("forward: primary instance did not come up")
+
+        times = []
+        for _ in range(args.runs):
+            t0 = time.perf_counter_ns()
+            subprocess.run([args.cream, "-l"], env=env, check=True,
+                           stdout=subprocess.DEVNULL)
+            times.append((time.perf_counter_ns() - t0) / 1e6)
+    finally:
+        primary.terminate()
+        primary.wait()
+        shutil.rmtree(profile, ignore_errors=True)
+
+    times.sort()
+    median = statistics.median(times)
+    p95 = times[int(len(times) * 0.95) - 1]
+    print(f"forward runs={len(times)} median_ms={median:.2f} "
+          f"p95_ms={p95:.2f} max_ms={times[-1]:.2f} target_ms={args.target}")
+
+    sys.exit(0 if median <= args.target else 1)
+
+
+if __name__ == "__main__":
+    main()
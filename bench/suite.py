@@ -0,0 +1,490 @@
+#!/usr/bin/env python3
+# See LICENSE file for copyright and license details.
+
+"""Measures startup, tabs, page loads, hints, find and memory against limits.
+
+    bench/suite.py [-n ROUNDS] [-m METRIC]... [-l LIMITS] [-j FILE] [CREAM]
+
+Serves a generated page corpus from a local HTTP server. Every instance
+gets a profile of its own and traces to it (CREAM_TRACE). Per round:
+
+    cold_start_ms   exec to the load event of a small page
+    new_tab_ms      "open" on the control socket to the commit of the
+                    small page in the new tab (from the trace), a few
+                    times, with time in between for a spare tab to be ready
+    new_tab_burst_ms
+                    the same, a few times in a row, which mostly finds no
+                    spare tab ready
+    page_load_ms    load event of an article with style sheets, scripts
+                    and images, with an empty cache (navigation timing)
+    hints_ms        follow key to the labels being drawn, on a page with
+                    20000 links, a few times (measured by the page)
+    find_ms         search for a word in a 2 MB page until all matches
+                    are counted, a few times (the "find" trace spans),
+                    typed with xdotool, skipped without it
+    tab_mib         memory (PSS) of cream and all its processes, per tab
+                    of the article, over 10 tabs
+
+Prints one line per metric with the median and 90th percentile of its
+samples and its limit from LIMITS, bench/limits by default. -j writes
+the same as JSON. Exits with status 1 if a median is above its limit.
+Needs a display, use xvfb-run on headless machines; "make bench" does.
+"""
+
+import argparse
+import http.server
+import json
+import math
+import os
+import queue
+import random
+import shutil
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+METRICS = ("cold_start_ms", "new_tab_ms", "new_tab_burst_ms", "page_load_ms",
+           "hints_ms", "find_ms", "tab_mib")
+
+REPORT = """<script>
+function report(what, values) {
+    fetch("/report?what=" + what + "&v=" + values.join(","), {cache: "no-store"});
+}
+window.addEventListener("load", function () {
+    setTimeout(function () {
+        var nav = performance.getEntriesByType("navigation")[0];
+        report("load", [nav.loadEventStart]);
+    }, 0);
+});
+</script>
+"""
+
+PAGE = """<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>{title}</title>
+{head}
+</head><body>
+{body}
+</body></html>
+"""
+
+# The hints script listens for the follow key on the document, and the
+# Escape key on its input box. Drawn is after the next frame.
+HINTS = """<script>
+window.addEventListener("load", function () {
+    var params = new URLSearchParams(location.search);
+    var key = params.get("key"), rounds = +params.get("rounds"), times = [];
+
+    function round() {
+        var t0 = performance.now();
+        document.dispatchEvent(new KeyboardEvent("keyup", {key: key}));
+        requestAnimationFrame(function () {
+            setTimeout(function () {
+                var box = document.querySelector("input[lariza_input_box=yes]");
+                if (box === null) {
+                    report("hints", []);
+                    return;
+                }
+                times.push(performance.now() - t0);
+                box.dispatchEvent(new KeyboardEvent("keydown", {key: "Escape"}));
+                if (times.length < rounds)
+                    setTimeout(round, 100);
+                else
+                    report("hints", times);
+            }, 0);
+        });
+    }
+    setTimeout(round, 500);
+});
+</script>
+"""
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def end_headers(self):
+        if self.path.startswith("/assets/"):
+            self.send_header("Cache-Control", "max-age=3600")
+        else:
+            self.send_header("Cache-Control", "no-cache")
+        super().end_headers()
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        if url.path == "/report":
+            q = urllib.parse.parse_qs(url.query)
+            values = [float(v) for v in q.get("v", [""])[0].split(",") if v]
+            self.send_response(204)
+            self.end_headers()
+            self.server.reports.put((q["what"][0], values))
+            return
+        super().do_GET()
+
+
+def words(rng, n):
+    return " ".join("".join(rng.choice("etaoinshrdlucmfwyp")
+                            for _ in range(rng.randint(2, 9)))
+                    for _ in range(n))
+
+
+def make_corpus(root, needle):
+    rng = random.Random(1)
+
+    def page(name, title, head="", body=""):
+        with open(os.path.join(root, name), "w") as f:
+            f.write(PAGE.format(title=title, head=head + REPORT, body=body))
+
+    page("blank.html", "blank bench")
+
+    os.mkdir(os.path.join(root, "assets"))
+    head, images = [], []
+    for i in range(4):
+        with open(os.path.join(root, "assets", f"a{i}.css"), "w") as f:
+            f.write("".join(f".c{i}-{j} {{ margin: {j % 7}px; color: #{j:06x}; }}\n"
+                            for j in range(2000)))
+        with open(os.path.join(root, "assets", f"a{i}.js"), "w") as f:
+            f.write(f"var a{i} = [" + ",".join(str(j) for j in range(20000)) +
+                    f"];\nvar s{i} = a{i}.reduce(function (x, y) {{ return x + y; }}, 0);\n")
+        head.append(f'<link rel="stylesheet" href="/assets/a{i}.css">')
+        head.append(f'<script src="/assets/a{i}.js"></script>')
+    for i in range(8):
+        with open(os.path.join(root, "assets", f"i{i}.svg"), "w") as f:
+            f.write('<svg xmlns="http://www.w3.org/2000/svg" width="320" height="160">' +
+                    "".join(f'<circle cx="{rng.randint(0, 320)}" cy="{rng.randint(0, 160)}" '
+                            f'r="{rng.randint(2, 20)}" fill="#{rng.randint(0, 0xffffff):06x}"/>'
+                            for _ in range(300)) + "</svg>")
+        images.append(f'<img src="/assets/i{i}.svg" width="320" height="160">')
+    body = "".join(f"<h2>{words(rng, 4)}</h2>\n" + (images[i // 8] if i % 8 == 0 else "") +
+                   "".join(f"<p>{words(rng, 80)}</p>\n" for _ in range(3))
+                   for i in range(64))
+    page("article.html", "article bench", "\n".join(head), body)
+
+    page("hints.html", "hints bench", HINTS,
+         "\n".join(f'<a href="/blank.html?{i}">{i}</a>' for i in range(20000)))
+
+    paragraphs = []
+    for i in range(4000):
+        p = words(rng, 80).split()
+        if i % 4 == 0:
+            p[rng.randrange(len(p))] = needle
+        paragraphs.append(f"<p>{' '.join(p)}</p>")
+    page("find.html", "find bench", body="\n".join(paragraphs))
+
+
+def wait_for_socket(path, proc, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if os.path.exists(path):
+            return True
+        if proc.poll() is not None:
+            return False
+        time.sleep(0.05)
+    return False
+
+
+class Server:
+    def __init__(self, root):
+        handler = lambda *a, **kw: Handler(*a, directory=root, **kw)
+        self.httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), handler)
+        self.httpd.reports = queue.Queue()
+        self.uri = f"http://127.0.0.1:{self.httpd.server_address[1]}/"
+        threading.Thread(target=self.httpd.serve_forever, daemon=True).start()
+
+    def reset(self):
+        while not self.httpd.reports.empty():
+            self.httpd.reports.get()
+
+    def wait(self, what, timeout):
+        """Values of the next report of what, others are dropped."""
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                kind, values = self.httpd.reports.get(
+                    timeout=max(deadline - time.monotonic(), 0))
+            except queue.Empty:
+                sys.exit(f"suite: no {what} report from the page")
+            if kind == what:
+                return values
+
+
+class Instance:
+    """A cream with a fresh profile, tracing into it."""
+
+    def __init__(self, args, uri):
+        self.dir = tempfile.mkdtemp(prefix="cream-bench-profile-")
+        runtime = os.path.join(self.dir, "runtime")
+        os.mkdir(runtime, 0o700)
+        env = dict(os.environ, XDG_RUNTIME_DIR=runtime,
+                   XDG_CACHE_HOME=os.path.join(self.dir, "cache"),
+                   XDG_CONFIG_HOME=os.path.join(self.dir, "config"),
+                   XDG_DATA_HOME=os.path.join(self.dir, "data"),
+                   CREAM_SOCKET_SUFFIX="bench",
+                   CREAM_TRACE=os.path.join(self.dir, "trace.json"))
+        for name in ("CREAM_HISTORY_FILE", "CREAM_SESSION_FILE",
+                     "CREAM_DISK_CACHE_DIR", "CREAM_PAGELOAD_FILE"):
+            env.pop(name, None)
+        self.sock = os.path.join(runtime, "cream.sock-bench")
+        self.started = time.monotonic()
+        self.proc = subprocess.Popen([args.cream, uri], env=env,
+                                     stdout=subprocess.DEVNULL,
+                                     stderr=subprocess.DEVNULL)
+        if not wait_for_socket(self.sock, self.proc, 30):
+            self.close()
+            sys.exit("suite: instance did not come up")
+
+    def open(self, uri):
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as s:
+            s.connect(self.sock)
+            s.sendall(f"open\n{uri}\n".encode())
+            if not s.recv(4096).startswith(b"ok"):
+                sys.exit("suite: could not open a tab")
+
+    def pss(self):
+        """Memory of cream and all processes below it, in bytes."""
+        parents = {}
+        for name in os.listdir("/proc"):
+            if not name.isdigit():
+                continue
+            try:
+                with open(f"/proc/{name}/stat") as f:
+                    # "pid (comm) state ppid ...", comm may contain anything.
+                    parents[int(name)] = int(f.read().rsplit(")", 1)[1].split()[1])
+            except (OSError, IndexError, ValueError):
+                pass
+
+        total = 0
+        for pid in parents:
+            ppid, depth = pid, 0
+            while ppid != self.proc.pid and ppid in parents and depth < 32:
+                ppid, depth = parents[ppid], depth + 1
+            if ppid != self.proc.pid:
+                continue
+            try:
+                with open(f"/proc/{pid}/smaps_rollup") as f:
+                    for line in f:
+                        if line.startswith("Pss:"):
+                            total += int(line.split()[1]) * 1024
+            except OSError:
+                pass
+        return total
+
+    def close(self):
+        """Ends cream, which writes its trace, and returns the events."""
+        self.proc.terminate()
+        self.proc.wait()
+        try:
+            with open(os.path.join(self.dir, "trace.json")) as f:
+                events = json.load(f)["traceEvents"]
+        except (OSError, ValueError, KeyError):
+            events = []
+        shutil.rmtree(self.dir, ignore_errors=True)
+        return events
+
+
+def spans(events, name):
+    """Durations in ms of the async spans called name, begin to end."""
+    begun, res = {}, []
+    for e in sorted(events, key=lambda e: e.get("ts", 0)):
+        if e.get("name") != name:
+            continue
+        if e["ph"] == "b":
+            begun[e["id"]] = e["ts"]
+        elif e["ph"] == "e" and e["id"] in begun:
+            res.append((e["ts"] - begun.pop(e["id"])) / 1000)
+    return res
+
+
+def tab_commits(events, prefix):
+    """Durations in ms from each "open" on the control socket of a URI
+    starting with prefix to the commit of its navigation."""
+    opened, navs, res = {}, {}, []
+    for e in sorted(events, key=lambda e: e.get("ts", 0)):
+        name, arg = e.get("name"), e.get("args", {}).get("arg") or ""
+        if name == "control" and e["ph"] == "X" and arg.startswith("open"):
+            for uri in arg.splitlines()[1:]:
+                if uri.startswith(prefix):
+                    opened[uri] = e["ts"]
+        elif name == "navigation" and e["ph"] == "b" and arg in opened:
+            navs[e["id"]] = arg
+        elif name == "committed" and e["ph"] == "b" and e["id"] in navs:
+            res.append((e["ts"] - opened.pop(navs.pop(e["id"]))) / 1000)
+    return res
+
+
+def measure_tabs(args, srv, res):
+    srv.reset()
+    inst = Instance(args, srv.uri + "blank.html")
+    try:
+        srv.wait("load", args.timeout)
+        res["cold_start_ms"].append((time.monotonic() - inst.started) * 1000)
+
+        for i in range(args.tabs):
+            time.sleep(args.tab_gap)
+            srv.reset()
+            inst.open(f"{srv.uri}blank.html?gap{i}")
+            srv.wait("load", args.timeout)
+        for i in range(args.tabs):
+            srv.reset()
+            inst.open(f"{srv.uri}blank.html?burst{i}")
+            srv.wait("load", args.timeout)
+    finally:
+        events = inst.close()
+    for metric, kind in (("new_tab_ms", "gap"), ("new_tab_burst_ms", "burst")):
+        times = tab_commits(events, f"{srv.uri}blank.html?{kind}")
+        if len(times) < args.tabs:
+            sys.exit(f"suite: {len(times)} of {args.tabs} new tabs in the trace")
+        res[metric] += times
+
+
+def measure_page_load(args, srv, res):
+    srv.reset()
+    inst = Instance(args, srv.uri + "article.html")
+    try:
+        res["page_load_ms"] += srv.wait("load", args.timeout)
+    finally:
+        inst.close()
+
+
+def measure_hints(args, srv, res):
+    srv.reset()
+    inst = Instance(args, f"{srv.uri}hints.html?key={args.hint_key}&rounds={args.tabs}")
+    try:
+        times = srv.wait("hints", args.timeout)
+        if not times:
+            sys.exit("suite: no hint labels, is cream built with ENABLE_HINTS?")
+        res["hints_ms"] += times
+    finally:
+        inst.close()
+
+
+def measure_find(args, srv, res):
+    srv.reset()
+    inst = Instance(args, srv.uri + "find.html")
+    try:
+        srv.wait("load", args.timeout)
+        win = subprocess.run(["xdotool", "search", "--sync", "--onlyvisible",
+                              "--name", "^find bench"], check=True,
+                             capture_output=True, text=True).stdout.split()[0]
+        for _ in range(args.tabs):
+            # Alt+K puts ":/" into the location bar, Return searches.
+            subprocess.run(["xdotool", "windowfocus", "--sync", win,
+                            "key", "alt+k"], check=True)
+            subprocess.run(["xdotool", "type", "--delay", "0", args.needle], check=True)
+            subprocess.run(["xdotool", "key", "Return"], check=True)
+            time.sleep(args.find_gap)
+    finally:
+        events = inst.close()
+    times = spans(events, "find")
+    if len(times) < args.tabs:
+        sys.exit(f"suite: {len(times)} of {args.tabs} searches in the trace")
+    res["find_ms"] += times
+
+
+def measure_memory(args, srv, res):
+    srv.reset()
+    inst = Instance(args, srv.uri + "article.html")
+    try:
+        srv.wait("load", args.timeout)
+        time.sleep(args.settle)
+        base = inst.pss()
+        for i in range(10):
+            srv.reset()
+            inst.open(f"{srv.uri}article.html?{i}")
+            srv.wait("load", args.timeout)
+        time.sleep(args.settle)
+        res["tab_mib"].append((inst.pss() - base) / 10 / 2**20)
+    finally:
+        inst.close()
+
+
+def read_limits(path):
+    limits = {}
+    with open(path) as f:
+        for line in f:
+            line = line.split("#", 1)[0].split()
+            if line:
+                limits[line[0]] = float(line[1])
+    return limits
+
+
+def percentile(values, pct):
+    """Nearest rank, like cream-pageload."""
+    values = sorted(values)
+    return values[max(math.ceil(len(values) * pct / 100) - 1, 0)]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-n", "--rounds", type=int, default=5)
+    ap.add_argument("-m", "--metric", action="append", choices=METRICS)
+    ap.add_argument("-l", "--limits",
+                    default=os.path.join(os.path.dirname(__file__), "limits"))
+    ap.add_argument("-j", "--json", help="write the results to this file")
+    ap.add_argument("--tabs", type=int, default=5,
+                    help="samples per round of new_tab_ms, new_tab_burst_ms, "
+                    "hints_ms and find_ms")
+    ap.add_argument("--hint-key", default="f", help="HINT_FOLLOW_KEY of config.h")
+    ap.add_argument("--needle", default="cremebrulee")
+    ap.add_argument("--tab-gap", type=float, default=3.0,
+                    help="seconds to leave before each new tab of new_tab_ms")
+    ap.add_argument("--find-gap", type=float, default=1.0,
+                    help="seconds to leave each search")
+    ap.add_argument("--settle", type=float, default=2.0,
+                    help="seconds to wait before measuring memory")
+    ap.add_argument("--timeout", type=float, default=60.0)
+    ap.add_argument("cream", nargs="?", default="./cream")
+    args = ap.parse_args()
+
+    metrics = args.metric or METRICS
+    limits = read_limits(args.limits)
+    if "find_ms" in metrics and shutil.which("xdotool") is None:
+        print("suite metric=find_ms skipped=no-xdotool", flush=True)
+        metrics = [m for m in metrics if m != "find_ms"]
+
+    steps = [(measure_tabs, ("cold_start_ms", "new_tab_ms", "new_tab_burst_ms")),
+             (measure_page_load, ("page_load_ms",)),
+             (measure_hints, ("hints_ms",)),
+             (measure_find, ("find_ms",)),
+             (measure_memory, ("tab_mib",))]
+
+    root = tempfile.mkdtemp(prefix="cream-bench-www-")
+    res = {m: [] for m in METRICS}
+    try:
+        make_corpus(root, args.needle)
+        srv = Server(root)
+        for _ in range(args.rounds):
+            for step, produces in steps:
+                if any(m in metrics for m in produces):
+                    step(args, srv, res)
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+    out, ok = {}, True
+    for m in metrics:
+        values = res[m]
+        r = out[m] = {"samples": len(values),
+                      "median": statistics.median(values),
+                      "p90": percentile(values, 90),
+                      "limit": limits.get(m)}
+        r["ok"] = r["limit"] is None or r["median"] <= r["limit"]
+        ok = ok and r["ok"]
+        print(f"suite metric={m} samples={r['samples']} median={r['median']:.2f} "
+              f"p90={r['p90']:.2f} limit={r['limit'] if r['limit'] is not None else '-'} "
+              f"ok={'yes' if r['ok'] else 'no'}", flush=True)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(out, f, indent=2)
+            f.write("\n")
+
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
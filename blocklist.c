@@ -0,0 +1,267 @@
+/* See LICENSE file for copyright and license details. */
+
+/* cream-blocklist: builds the memory-mapped domain table used by cream
+ * and we_blocklist.so from hosts files or plain domain lists.
+ *
+ *     cream-blocklist [-o OUTPUT] [FILE]...
+ *
+ * Reads stdin if no files are given. The output is replaced atomically,
+ * so it's safe to run this while cream is running. Running instances
+ * keep using the old table until they are restarted. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+
+struct buffer {
+    char *data;
+    size_t len, size;
+};
+
+static void
+die(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void
+buffer_append(struct buffer *b, const char *data, size_t len)
+{
+    if (b->len + len > b->size)
+    {
+        b->size = (b->len + len) * 2;
+        if ((b->data = realloc(b->data, b->size)) == NULL)
+            die(NAME"-blocklist: realloc");
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static int
+is_address(const char *s)
+{
+    /* "0.0.0.0", "127.0.0.1", "::1", "::" and friends. */
+    if (strchr(s, ':') != NULL)
+        return 1;
+    for (; *s != 0; s++)
+        if (!isdigit((unsigned char)*s) && *s != '.')
+            return 0;
+    return 1;
+}
+
+static int
+is_domain(char *s)
+{
+    static const char *reserved[] = {
+        "localhost", "localhost.localdomain", "local", "broadcasthost",
+        "ip6-localhost", "ip6-loopback", "0.0.0.0",
+    };
+    size_t i;
+    char *p;
+
+    for (p = s; *p != 0; p++)
+    {
+        *p = tolower((unsigned char)*p);
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-' && *p != '_')
+            return 0;
+    }
+    if (p > s && p[-1] == '.')
+        *--p = 0;
+
+    if (s[0] == 0 || s[0] == '.' || strchr(s, '.') == NULL)
+        return 0;
+
+    for (i = 0; i < sizeof reserved / sizeof reserved[0]; i++)
+        if (strcmp(s, reserved[i]) == 0)
+            return 0;
+
+    return 1;
+}
+
+/* Accepts hosts files ("0.0.0.0 a.com b.com"), plain domain lists and
+ * domain-only adblock rules ("||a.com^"). Every domain is stored NUL
+ * terminated in names. */
+static void
+parse(FILE *fp, struct buffer *names, size_t *count)
+{
+    char *line = NULL, *tok, *save, *hash;
+    size_t cap = 0, len;
+    int first;
+
+    while (getline(&line, &cap, fp) != -1)
+    {
+        if ((hash = strchr(line, '#')) != NULL)
+            *hash = 0;
+        if (line[0] == '!' || line[0] == '[')
+            continue;
+
+        first = 1;
+        for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+             tok = strtok_r(NULL, " \t\r\n", &save), first = 0)
+        {
+            if (first && is_address(tok))
+                continue;
+
+            if (strncmp(tok, "||", 2) == 0)
+            {
+                tok += 2;
+                len = strlen(tok);
+                if (len > 0 && tok[len - 1] == '^')
+                    tok[len - 1] = 0;
+            }
+
+            if (!is_domain(tok))
+                continue;
+
+            buffer_append(names, tok, strlen(tok) + 1);
+            (*count)++;
+        }
+    }
+
+    free(line);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct blocklist_header hdr;
+    struct blocklist_slot *slots;
+    struct buffer names = { 0 }, pool = { 0 };
+    const char *cache = NULL, *home = NULL;
+    char *output = NULL, *tmp, *name;
+    size_t count = 0, nslots, len, i;
+    uint64_t h;
+    uint32_t mask, fp32;
+    FILE *fp;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: "NAME"-blocklist [-o OUTPUT] [FILE]...\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (output == NULL)
+    {
+        /* Same default as the browser: $XDG_CACHE_HOME/cream/blocklist */
+        if ((cache = getenv("XDG_CACHE_HOME")) != NULL && cache[0] == '/')
+            len = snprintf(NULL, 0, "%s/"NAME, cache);
+        else if ((home = getenv("HOME")) != NULL)
+            len = snprintf(NULL, 0, "%s/.cache/"NAME, home);
+        else
+        {
+            fprintf(stderr, NAME"-blocklist: No output given and $HOME not set\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((output = malloc(len + sizeof "/blocklist")) == NULL)
+            die(NAME"-blocklist: malloc");
+        if (cache != NULL && cache[0] == '/')
+            snprintf(output, len + 1, "%s/"NAME, cache);
+        else
+            snprintf(output, len + 1, "%s/.cache/"NAME, home);
+        if (mkdir(output, 0700) == -1 && errno != EEXIST)
+            die(output);
+        strcat(output, "/blocklist");
+    }
+
+    if (optind >= argc)
+        parse(stdin, &names, &count);
+    for (i = optind; i < (size_t)argc; i++)
+    {
+        if ((fp = fopen(argv[i], "r")) == NULL)
+            die(argv[i]);
+        parse(fp, &names, &count);
+        fclose(fp);
+    }
+
+    /* At most half full, so probe sequences stay short. */
+    for (nslots = 16; nslots < count * 2; nslots *= 2)
+        ;
+    if (nslots > UINT32_MAX)
+    {
+        fprintf(stderr, NAME"-blocklist: Too many domains\n");
+        exit(EXIT_FAILURE);
+    }
+    mask = nslots - 1;
+
+    if ((slots = calloc(nslots, sizeof *slots)) == NULL)
+        die(NAME"-blocklist: calloc");
+
+    buffer_append(&pool, "", 1);  // Offset 0 means "empty slot"
+    memset(&hdr, 0, sizeof hdr);
+
+    for (name = names.data; name < names.data + names.len; name += len + 1)
+    {
+        len = strlen(name);
+        h = blocklist_hash(name, len);
+        fp32 = h >> 32;
+
+        for (i = h & mask; slots[i].name != 0; i = (i + 1) & mask)
+            if (slots[i].hash == fp32 && strcmp(pool.data + slots[i].name, name) == 0)
+                break;
+        if (slots[i].name != 0)
+            continue;  // Duplicate
+
+        if (pool.len > UINT32_MAX)
+        {
+            fprintf(stderr, NAME"-blocklist: String pool too large\n");
+            exit(EXIT_FAILURE);
+        }
+        slots[i].hash = fp32;
+        slots[i].name = pool.len;
+        buffer_append(&pool, name, len + 1);
+        hdr.nentries++;
+    }
+
+    memcpy(hdr.magic, BLOCKLIST_MAGIC, sizeof hdr.magic);
+    hdr.nslots = nslots;
+    hdr.strings = sizeof hdr + nslots * sizeof *slots;
+    hdr.size = hdr.strings + pool.len;
+
+    if ((tmp = malloc(strlen(output) + sizeof ".XXXXXX")) == NULL)
+        die(NAME"-blocklist: malloc");
+    sprintf(tmp, "%s.XXXXXX", output);
+    if ((fd = mkstemp(tmp)) == -1)
+        die(tmp);
+    if ((fp = fdopen(fd, "w")) == NULL)
+        die(tmp);
+
+    if (fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+        fwrite(slots, sizeof *slots, nslots, fp) != nslots ||
+        fwrite(pool.data, 1, pool.len, fp) != pool.len ||
+        fflush(fp) != 0 || fsync(fd) != 0)
+    {
+        unlink(tmp);
+        die(tmp);
+    }
+    fclose(fp);
+
+    if (chmod(tmp, 0644) == -1 || rename(tmp, output) == -1)
+    {
+        unlink(tmp);
+        die(output);
+    }
+
+    fprintf(stderr, NAME"-blocklist: %u domains written to %s\n", hdr.nentries, output);
+
+    free(tmp);
+    free(slots);
+    free(names.data);
+    free(pool.data);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Domain blocklist as a prebuilt, memory-mapped hash table.
+ *
+ * The table is built by cream-blocklist from hosts files and is used
+ * as-is by the browser (navigations) and by we_blocklist.so (all other
+ * requests), so it must not need any parsing when it is loaded.
+ *
+ * Layout:
+ *
+ *     header | slots[nslots] | string pool
+ *
+ * Slots use open addressing with linear probing. Each holds a 32 bit
+ * fingerprint of the domain and its offset in the string pool, where
+ * the domain is stored NUL terminated. Offset 0 marks an empty slot,
+ * the pool thus starts with a padding byte.
+ *
+ * Domains are hashed back to front. While hashing a host name, we pass
+ * the start of each of its parent domains and get their hashes for
+ * free, so checking "a.b.example.com" against "example.com" costs a
+ * single pass over the string plus one probe per label. */
+
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCKLIST_MAGIC "CRMBLK01"
+#define BLOCKLIST_MAX_LABELS 32
+
+struct blocklist_header {
+    char magic[8];
+    uint32_t nslots;    // Power of two
+    uint32_t nentries;
+    uint64_t strings;   // Offset of the string pool
+    uint64_t size;      // Size of the whole file
+};
+
+struct blocklist_slot {
+    uint32_t hash;
+    uint32_t name;      // Offset in the string pool, 0 if empty
+};
+
+struct blocklist {
+    void *map;
+    size_t size;
+    const struct blocklist_slot *slots;
+    const char *strings;
+    uint64_t nstrings;  // Size of the string pool
+    uint32_t mask;
+};
+
+/* FNV-1a, fed from the last byte to the first. */
+#define BLOCKLIST_HASH_INIT UINT64_C(0xcbf29ce484222325)
+#define BLOCKLIST_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * UINT64_C(0x100000001b3))
+
+static inline uint64_t
+blocklist_hash(const char *s, size_t len)
+{
+    uint64_t h = BLOCKLIST_HASH_INIT;
+
+    while (len > 0)
+        h = BLOCKLIST_HASH_STEP(h, s[--len]);
+
+    return h;
+}
+
+static inline int
+blocklist_open(struct blocklist *bl, const char *path)
+{
+    const struct blocklist_header *hdr;
+    struct stat st;
+    int fd;
+
+    memset(bl, 0, sizeof *bl);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof *hdr)
+    {
+        close(fd);
+        return -1;
+    }
+
+    bl->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bl->map == MAP_FAILED)
+    {
+        bl->map = NULL;
+        return -1;
+    }
+    bl->size = st.st_size;
+
+    hdr = bl->map;
+    if (memcmp(hdr->magic, BLOCKLIST_MAGIC, sizeof hdr->magic) != 0 ||
+        hdr->size != bl->size || hdr->nslots == 0 ||
+        (hdr->nslots & (hdr->nslots - 1)) != 0 || hdr->nentries >= hdr->nslots ||
+        sizeof *hdr + (uint64_t)hdr->nslots * sizeof *bl->slots != hdr->strings ||
+        hdr->strings >= hdr->size ||
+        ((const char *)bl->map)[hdr->size - 1] != 0)
+    {
+        munmap(bl->map, bl->size);
+        memset(bl, 0, sizeof *bl);
+        return -1;
+    }
+
+    bl->slots = (const struct blocklist_slot *)(hdr + 1);
+    bl->strings = (const char *)bl->map + hdr->strings;
+    bl->nstrings = hdr->size - hdr->strings;
+    bl->mask = hdr->nslots - 1;
+
+    /* Lookups are scattered all over the table. */
+    madvise(bl->map, bl->size, MADV_RANDOM);
+
+    return 0;
+}
+
+static inline void
+blocklist_close(struct blocklist *bl)
+{
+    if (bl->map != NULL)
+        munmap(bl->map, bl->size);
+    memset(bl, 0, sizeof *bl);
+}
+
+/* The header promises a free slot, but the slots themselves are only
+ * checked as they are probed: a damaged table must neither keep us
+ * probing forever nor point outside the string pool. As the pool ends
+ * with a NUL, no string in it runs past the mapping. */
+static inline int
+blocklist_contains(const struct blocklist *bl, const char *name, size_t len,
+                   uint64_t hash)
+{
+    const struct blocklist_slot *slot;
+    uint32_t i, n, fp = hash >> 32;
+
+    for (i = hash & bl->mask, n = 0; bl->slots[i].name != 0 && n <= bl->mask;
+         i = (i + 1) & bl->mask, n++)
+    {
+        slot = &bl->slots[i];
+        if (slot->name >= bl->nstrings)
+            return 0;
+        if (slot->hash == fp &&
+            strncmp(bl->strings + slot->name, name, len) == 0 &&
+            bl->strings[slot->name + len] == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Is the host or one of its parent domains listed? The host must be in
+ * lower case, which is what WebKit hands out. */
+static inline int
+blocklist_match_host(const struct blocklist *bl, const char *host, size_t len)
+{
+    uint64_t h = BLOCKLIST_HASH_INIT;
+    size_t i = len;
+
+    if (bl->map == NULL || len == 0)
+        return 0;
+
+    while (i > 0)
+    {
+        h = BLOCKLIST_HASH_STEP(h, host[--i]);
+        if (i == 0 || host[i - 1] == '.')
+            if (blocklist_contains(bl, host + i, len - i, h))
+                return 1;
+    }
+
+    return 0;
+}
+
+/* Extracts the host from a URI without allocating. Anything without an
+ * authority ("about:", "data:", ...) is never blocked. */
+static inline int
+blocklist_match_uri(const struct blocklist *bl, const char *uri)
+{
+    const char *host, *end, *p;
+
+    if (bl->map == NULL || uri == NULL)
+        return 0;
+
+    host = strstr(uri, "://");
+    if (host == NULL)
+        return 0;
+    host += 3;
+
+    end = host + strcspn(host, "/?#");
+    for (p = host; p < end; p++)
+        if (*p == '@')
+            host = p + 1;
+
+    if (*host == '[')
+        return 0;  // IPv6 literal
+
+    for (p = host; p < end && *p != ':'; p++)
+        ;
+    if (p > host && p[-1] == '.')
+        p--;  // "example.com." is example.com
+
+    return blocklist_match_host(bl, host, p - host);
+}
+
+#endif // BLOCKLIST_H
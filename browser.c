@@ -1,4 +1,5 @@
 // Standard C libraries
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,14 +7,24 @@
 
 // POSIX system headers
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
 
 // GTK and related libraries
 #include <gtk/gtk.h>
 #include <gtk/gtkx.h>
 #include <gdk/gdkkeysyms.h>
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <glib-unix.h>
 
 // WebKit and JavaScript libraries
 #include <webkit2/webkit2.h>
@@ -24,11 +35,150 @@
 
 // Local configuration
 #include "config.h"
+#include "blocklist.h"
+#include "history.h"
+#include "pageload.h"
 
 // Client Management
 void client_destroy(GtkWidget *, gpointer);
 WebKitWebView *client_new(const gchar *, WebKitWebView *, gboolean, gboolean);
+struct Client *client_create(WebKitWebView *);
 WebKitWebView *client_new_request(WebKitWebView *, WebKitNavigationAction *, gpointer);
+void client_web_view_new(struct Client *, WebKitWebView *);
+void client_web_view_connect(struct Client *);
+void client_defer(struct Client *, gchar *);
+void client_load_pending(struct Client *);
+gboolean client_load_next_pending(gpointer);
+gboolean client_can_hibernate(struct Client *);
+void client_hibernate(struct Client *);
+gboolean hibernate_check(gpointer);
+void hibernate_measure_thread(GTask *, gpointer, gpointer, GCancellable *);
+void hibernate_measured(GObject *, GAsyncResult *, gpointer);
+struct Client *hibernate_candidate(void);
+guint64 web_process_rss(guint *);
+gboolean hibernate_measuring = FALSE;
+
+// Memory pressure, see memory_pressure_setup()
+enum { PRESSURE_NONE, PRESSURE_CLEAR_CACHE, PRESSURE_FREEZE, PRESSURE_DISCARD };
+
+gchar *pressure_file = NULL;   // PSI file, memory.pressure of our cgroup if possible
+gchar *pressure_cgroup = NULL; // cgroup v2 directory, for memory.current and memory.max
+gint pressure_level = PRESSURE_NONE;
+guint pressure_timer = 0;
+
+void memory_pressure_setup(void);
+gboolean memory_pressure_event(gint, GIOCondition, gpointer);
+gboolean memory_pressure_poll(gpointer);
+gboolean memory_pressure_check(gpointer);
+gint memory_pressure_level(void);
+gboolean cgroup_memory(guint64 *, guint64 *);
+
+// Disk cache, see disk_cache_setup()
+struct DiskCacheSite {
+    guint64 size;   // As of the last fetch, 0 if not fetched yet
+    gint64 used;    // Seconds since the epoch
+};
+
+WebKitWebContext *web_context = NULL;
+WebKitSettings *web_settings = NULL;            // Shared by all tabs
+WebKitUserContentManager *user_content = NULL;  // Shared by all tabs
+GHashTable *disk_cache_sites = NULL;  // Website data name -> struct DiskCacheSite
+gboolean disk_cache_busy = FALSE, disk_cache_dirty = FALSE;
+
+void disk_cache_setup(void);
+gboolean disk_cache_check(gpointer);
+void disk_cache_fetched(GObject *, GAsyncResult *, gpointer);
+gint disk_cache_lru_cmp(gconstpointer, gconstpointer);
+void disk_cache_resource(WebKitWebView *, WebKitWebResource *, WebKitURIRequest *, gpointer);
+struct DiskCacheSite *disk_cache_site(const gchar *);
+gchar *disk_cache_lru_file(void);
+void disk_cache_finish(void);
+
+// Page load statistics, see pageload_setup()
+struct PageLoad {
+    gint64 start, redirect, commit, paint, finish;  // Monotonic, 0: not yet
+    gint64 time;        // Seconds since the epoch, of the start
+    guint64 bytes;
+    guint gen;          // Counts the navigations of the web view
+    gboolean failed;
+};
+
+struct PageLoadHost {
+    GArray *samples;    // struct pageload_record, at most PAGELOAD_SAMPLES
+    guint next;         // Oldest sample, once there are PAGELOAD_SAMPLES
+};
+
+GHashTable *pageload_hosts = NULL;  // Host -> struct PageLoadHost
+int pageload_fd = -1;
+guint pageload_records = 0, pageload_kept = 0;  // In the file, and of them in pageload_hosts
+
+void pageload_setup(void);
+void pageload_add(const gchar *, const struct pageload_record *);
+struct PageLoad *pageload_get(WebKitWebView *);
+void pageload_changed(WebKitWebView *, WebKitLoadEvent);
+gboolean pageload_failed(WebKitWebView *, WebKitLoadEvent, gchar *, GError *, gpointer);
+void pageload_resource(WebKitWebView *, WebKitWebResource *, WebKitURIRequest *, gpointer);
+void pageload_resource_finished(WebKitWebResource *, gpointer);
+void pageload_record(WebKitWebView *, struct PageLoad *);
+int pageload_compact(void);
+void pageload_host_free(gpointer);
+void pageload_finish(void);
+
+// Spare clients, see spare_refill()
+GQueue spare_clients = G_QUEUE_INIT;
+guint spare_timer = 0;
+WebKitWebViewSessionState *spare_empty_state = NULL;
+
+void spare_schedule(void);
+gboolean spare_refill(gpointer);
+void spare_block(struct Client *, gboolean);
+void spare_warmed(WebKitWebView *, WebKitLoadEvent, gpointer);
+struct Client *spare_take(void);
+void spare_free(struct Client *);
+void spare_drop(void);
+guint64 memory_available(void);
+
+// Background tabs, see client_defer()
+GQueue pending_clients = G_QUEUE_INIT;
+guint pending_timer = 0;
+
+// The cream:stats page, see stats_request()
+enum { STATS_TABS, STATS_LATENCY, STATS_PROCESSES, STATS_DATA, STATS_DOWNLOADS,
+       STATS_PAGELOAD, STATS_SECTIONS };
+
+struct StatsPage {
+    GSocketConnection *conn;            // Our end, WebKit reads the other one
+    GString *section[STATS_SECTIONS];   // Not written yet
+    gboolean done[STATS_SECTIONS];
+    guint current;                      // First section not done being written
+    GString *writing;                   // Handed to the output stream
+    gboolean busy, failed;
+    gint refs;
+    gint64 probe_due;                   // STATS_LATENCY
+    guint probes;
+    gint64 latency[STATS_LATENCY_PROBES];
+    guint64 rss, self_rss;              // STATS_PROCESSES
+    guint processes;
+    GPtrArray *hosts;                   // STATS_PAGELOAD
+    guint next_host;
+};
+
+GQueue active_downloads = G_QUEUE_INIT;
+
+void stats_request(WebKitURISchemeRequest *, gpointer);
+void stats_unref(struct StatsPage *);
+void stats_done(struct StatsPage *, gint);
+void stats_flush(struct StatsPage *);
+void stats_written(GObject *, GAsyncResult *, gpointer);
+void stats_tabs(struct StatsPage *);
+gboolean stats_probe(gpointer);
+void stats_processes_thread(GTask *, gpointer, gpointer, GCancellable *);
+void stats_processes(GObject *, GAsyncResult *, gpointer);
+void stats_data(GObject *, GAsyncResult *, gpointer);
+void stats_downloads(struct StatsPage *);
+gboolean stats_pageload(gpointer);
+gint stats_host_cmp(gconstpointer, gconstpointer);
+void stats_percentiles(GString *, struct PageLoadHost *, gint);
 
 // UI and Window Management
 void mainwindow_setup(void);
@@ -46,7 +196,6 @@ gboolean key_tablabel(GtkWidget *, GdkEvent *, gpointer);
 gboolean key_web_view(GtkWidget *, GdkEvent *, gpointer);
 void hover_web_view(WebKitWebView *, WebKitHitTestResult *, guint, gpointer);
 void icon_location(GtkEntry *, GtkEntryIconPosition, GdkEvent *, gpointer);
-gboolean cleanup_resources(gpointer user_data);
 
 // WebKit Callbacks
 void changed_download_progress(GObject *, GParamSpec *, gpointer);
@@ -57,6 +206,7 @@ void changed_uri(GObject *, GParamSpec *, gpointer);
 gboolean crashed_web_view(WebKitWebView *, gpointer);
 gboolean decide_policy(WebKitWebView *, WebKitPolicyDecision *, WebKitPolicyDecisionType, gpointer);
 void web_view_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event, gpointer user_data);
+gboolean web_view_first_draw(GtkWidget *, cairo_t *, gpointer);
 
 // Download Handling
 gboolean download_handle(WebKitDownload *, gchar *, gpointer);
@@ -66,40 +216,347 @@ void downloadmanager_cancel(GtkToolButton *, gpointer);
 // Navigation and Tab Management
 gboolean goto_tab(struct Client *c, const gchar *arg);
 void search(gpointer, gint);
+void search_found(WebKitFindController *, guint, gpointer);
+void search_finished(WebKitFindController *, gpointer);
 
 // Initialization and Configuration
 void cooperation_setup(void);
+gboolean cooperation_address(struct sockaddr_un *);
+int cooperation_lock(void);
+void cooperation_forward(int, char **);
+int cooperation_hand_over(gboolean, gboolean, int, char **);
+void cooperation_finish(void);
 void grab_environment_configuration(void);
 void init_default_web_context(void);
 void trust_user_certs(WebKitWebContext *);
 
 // Utility Functions
 gchar *ensure_uri_scheme(const gchar *);
+gboolean uri_is_bare_host(const gchar *);
 void grab_feeds_finished(GObject *, GAsyncResult *, gpointer);
-void inject_hints_script(WebKitWebView *web_view);
+WebKitUserScript *hints_user_script(void);
 gboolean quit_if_nothing_active(void);
-gboolean remote_msg(GIOChannel *, GIOCondition, gpointer);
 void run_user_scripts(WebKitWebView *);
+void run_user_script_finished(GObject *, GAsyncResult *, gpointer);
 void show_web_view(WebKitWebView *, gpointer);
 ssize_t write_full(int, char *, size_t);
 
-// Reopen Closed Tab Stuff
+// Cooperative instances, see cooperation_setup()
+gchar *cooperative_socket_path = NULL;
+struct stat cooperative_socket_stat;
+
+gboolean control_accept(gint, GIOCondition, gpointer);
+gboolean control_read(gint, GIOCondition, gpointer);
+void control_handle(gchar *, GString *);
+gboolean control_open(gchar **, gint, gboolean);
+gboolean control_send(const gchar *);
+
+// Logging
+#define log_at(level, ...) \
+    do { if ((level) >= LOG_LEVEL_COMPILED) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+gchar log_ring[LOG_RING_LINES][LOG_LINE_MAX];
+gint log_next = 0;
+
+void log_setup(void);
+void log_write(gint, const gchar *, ...) G_GNUC_PRINTF(2, 3);
+void log_dump(int);
+gboolean log_dump_requested(gpointer);
+void log_crashed(int);
+
+// Tracing, see trace_add()
+#define trace_on() G_UNLIKELY(trace_file != NULL)
+#define trace_begin() (trace_on() ? g_get_monotonic_time() : 0)
+#define trace_end(name, start, arg) \
+    do { if ((start) != 0) trace_add('X', (name), (start), 0, (arg)); } while (0)
+#define trace_instant(name, arg) \
+    do { if (trace_on()) trace_add('i', (name), 0, 0, (arg)); } while (0)
+#define trace_async(phase, name, id, arg) \
+    do { if (trace_on()) trace_add((phase), (name), 0, (id), (arg)); } while (0)
+
+enum { TRACE_PHASE_NONE, TRACE_PHASE_PROVISIONAL, TRACE_PHASE_COMMITTED };
+
+struct TraceEvent {
+    const gchar *name;  // A literal, not copied
+    gchar *arg;
+    gint64 ts, dur;     // Microseconds, dur of spans only
+    gsize id;           // Async events only
+    gchar phase;        // 'X': span, 'i': instant, 'b', 'n', 'e': async begin, instant, end
+};
+
+struct TraceBuffer {
+    struct TraceBuffer *next;
+    gint tid;
+    gchar name[16];
+    gint len;           // Events that trace_write() may read
+    guint dropped;
+    struct TraceEvent events[TRACE_EVENTS_MAX];
+};
+
+struct TraceBuffer *trace_buffers = NULL;  // One per thread, newest first
+GPrivate trace_buffer_key = G_PRIVATE_INIT(NULL);
+gint trace_threads = 0;
+gsize trace_next_id = 0;  // For async events that have no object to name them
+
+void trace_add(gchar, const gchar *, gint64, gsize, const gchar *);
+void trace_navigation_end(struct Client *);
+void trace_json_string(FILE *, const gchar *);
+gboolean trace_quit(gpointer);
+void trace_write(void);
+
+// Session journal, see session_setup()
+#define SESSION_MAGIC "CRMSES01"
+
+enum {
+    SESSION_RECORD_TAB = 'T',
+    SESSION_RECORD_ORDER = 'O',
+    SESSION_RECORD_FOCUS = 'F',
+};
+enum { SESSION_PAGES_CHANGED, SESSION_PAGE_ADDED, SESSION_PAGE_SWITCHED };
+
+struct SessionHeader {
+    guint32 id;
+    guint8 type;
+    guint8 pad[3];
+    guint32 len;        // Length of the payload
+};
+
+struct SessionTab {
+    gchar *uri;
+    GBytes *state;      // NULL if the tab never loaded
+};
+
+struct Session {
+    GHashTable *tabs;   // ID -> struct SessionTab
+    GArray *order;      // IDs of the open tabs, in order
+    guint32 focus;
+    guint32 next_id;    // Higher than any ID in the journal
+};
+
+int session_fd = -1;
+gsize session_size = 0, session_compacted = 0;
+guint32 session_next_id = 0;
+guint session_timer = 0;
+gboolean session_order_dirty = FALSE, session_focus_dirty = FALSE;
+struct Client *session_focused = NULL;
+GByteArray *session_backlog = NULL;  // Records held back while compacting
+
+gboolean session_setup(void);
+gboolean session_read(struct Session *);
+void session_tab_free(struct SessionTab *);
+void session_free(struct Session *);
+int session_compact(struct Session *);
+void session_compact_thread(GTask *, gpointer, gpointer, GCancellable *);
+void session_compact_finished(GObject *, GAsyncResult *, gpointer);
+void session_write(GByteArray *);
+void session_append_header(GByteArray *, guint32, guint8, gsize);
+void session_append_tab(GByteArray *, guint32, const gchar *, GBytes *);
+void session_pages_changed(GtkNotebook *, GtkWidget *, guint, gpointer);
+void session_tab_changed(struct Client *);
+gboolean session_flush(gpointer);
+void session_finish(void);
+
+// History, see history.h
+#define HISTORY_COMPACT_MIN 10000  // Compact once this many records are obsolete
+
+struct HistoryEntry {
+    struct HistoryEntry *next;
+    gchar *uri;
+    gchar *title;  // NULL for visits
+    gint64 time;
+};
+
+struct HistoryURI {
+    gchar *uri;
+    gchar *title;
+    guint32 id;
+    guint32 visits;
+    gint64 last;
+};
+
+struct HistoryLog {
+    guint64 size;
+    guint64 dev, ino;
+};
+
+struct HistoryEntry *history_queue = NULL;  // Newest first, see history_push()
+GThread *history_thread = NULL;
+gint history_stop = 0;
+int history_wake[2] = { -1, -1 };
+gchar *history_last = NULL;
+
+/* Owned by the writer thread. */
+GHashTable *history_uris = NULL;  // URI -> struct HistoryURI
+GPtrArray *history_ids = NULL;    // ID -> struct HistoryURI
+guint history_dead = 0;           // Records that compaction would drop
+
+void history_setup(void);
+void history_add(const gchar *);
+void history_title(const gchar *, const gchar *);
+void history_push(const gchar *, const gchar *);
+void history_finish(void);
+gpointer history_writer(gpointer);
+int history_load(void);
+int history_compact(int);
+struct HistoryURI *history_lookup(const gchar *, gsize, GString *);
+void history_append_record(GString *, guint32, guint8, gconstpointer, gsize,
+                           const gchar *, gsize);
+gboolean history_loaded(gpointer);
+
+// History index, used for location bar completion
+#define HISTORY_INDEX_MAGIC "CRMHIX02"
+#define HISTORY_INDEX_TEXT_MAX 128        // Only this much of a URI is indexed
+#define HISTORY_INDEX_TAIL_MAX (4 << 20)  // Rebuild if more is not indexed
+#define HISTORY_COMPLETION_MAX 10
+#define HISTORY_QUERY_TRIGRAMS 4        // Posting lists intersected per query
+
+struct HistoryIndexHeader {
+    char magic[8];
+    guint64 dev, ino;  // History log this index was built from
+    guint64 covered;   // Bytes of it that are indexed
+    guint32 nids;      // IDs in those bytes, see ranks
+    guint32 nurls, ntrigrams;
+    guint32 pad;
+    guint64 strings;   // Offset of the string pool
+    guint64 size;      // Size of the whole file
+};
+
+struct HistoryIndexURL {
+    guint32 name;      // Offset in the string pool
+    guint32 visits;
+    gint64 last;       // Time of the last visit
+};
+
+struct HistoryIndexTrigram {
+    guint32 trigram;
+    guint32 count;     // Number of URIs containing it
+    guint64 postings;  // Offset of their IDs, ascending, as varint deltas
+};
+
+struct HistoryIndex {
+    void *map;
+    size_t size;
+    const struct HistoryIndexHeader *hdr;
+    const struct HistoryIndexURL *urls;
+    const struct HistoryIndexTrigram *trigrams;
+    const guint32 *ranks;  // Log ID -> index ID
+    const gchar *strings;
+};
+
+struct HistoryDelta {
+    gchar *uri;
+    guint visits_file;     // Visits in the part of the log not yet indexed
+    guint visits_session;  // Visits since startup
+    gint64 last;
+};
+
+struct HistoryCursor {
+    const guchar *p;
+    guint32 left;
+    guint32 id;
+    gboolean started;
+};
+
+struct HistoryMatch {
+    const gchar *uri;
+    guint32 id;
+    guint visits;
+    gint64 last;
+};
+
+struct HistoryPostings {
+    GByteArray *bytes;
+    guint32 count;
+    guint32 prev;
+};
+
+struct HistoryIndex history_index;
+GHashTable *history_delta = NULL;       // URI -> struct HistoryDelta
+GPtrArray *history_delta_list = NULL;
+gboolean history_index_building = FALSE;
+GtkListStore *history_completions = NULL;
+
+void history_index_setup(struct HistoryLog *);
+gchar *history_index_path(void);
+gboolean history_index_open(struct HistoryIndex *, const gchar *, struct HistoryLog *);
+void history_index_close(struct HistoryIndex *);
+void history_index_rebuild(struct HistoryLog *);
+void history_index_build_thread(GTask *, gpointer, gpointer, GCancellable *);
+void history_index_build_finished(GObject *, GAsyncResult *, gpointer);
+guint history_index_trigrams(const gchar *, gsize, guint32 *);
+gint history_index_compare_u32(gconstpointer, gconstpointer);
+gint history_index_compare_trigrams(gconstpointer, gconstpointer);
+gint history_index_compare_matches(gconstpointer, gconstpointer);
+gboolean history_cursor_next(struct HistoryCursor *);
+gboolean history_contains(const gchar *, const gchar *);
+void history_delta_add(const gchar *, gsize, gboolean, gint64);
+guint history_complete(const gchar *, struct HistoryMatch *);
+void location_changed(GtkEditable *, gpointer);
+gboolean location_completion_match(GtkEntryCompletion *, const gchar *, GtkTreeIter *, gpointer);
+gboolean location_completion_selected(GtkEntryCompletion *, GtkTreeModel *, GtkTreeIter *, gpointer);
+
+// Adblock
+#define ADBLOCK_CONVERTER_VERSION 1
+#define ADBLOCK_MAX_RULES 150000  // WebKit refuses to compile larger lists
+
+struct AdblockSource {
+    gchar *identifier;  // Filter store key, derived from the list contents
+    GString *contents;  // All list files, concatenated
+    GPtrArray *cosmetic_generic;  // Selectors hidden on all sites
+    GHashTable *cosmetic_hide;    // Hostname -> selectors hidden there
+    GHashTable *cosmetic_unhide;  // Hostname -> selectors not hidden there
+};
+
+WebKitUserContentFilterStore *adblock_store = NULL;
+WebKitUserContentFilter *adblock_filter = NULL;
+
+// Domain blocklist, see blocklist.h
+struct blocklist blocklist;
+
+void adblock_setup(void);
+gint adblock_compare_names(gconstpointer, gconstpointer);
+void adblock_read_thread(GTask *, gpointer, gpointer, GCancellable *);
+void adblock_read_finished(GObject *, GAsyncResult *, gpointer);
+void adblock_filter_loaded(GObject *, GAsyncResult *, gpointer);
+void adblock_convert_thread(GTask *, gpointer, gpointer, GCancellable *);
+void adblock_convert_finished(GObject *, GAsyncResult *, gpointer);
+void adblock_filter_saved(GObject *, GAsyncResult *, gpointer);
+void adblock_filter_ready(WebKitUserContentFilter *);
+void adblock_prune(GObject *, GAsyncResult *, gpointer);
+void adblock_source_free(gpointer);
+gchar *adblock_convert(gchar *);
+gboolean adblock_convert_line(gchar *, GString *, GString *);
+gboolean adblock_parse_domains(gchar *, GString *, GString *);
+gboolean adblock_pattern_to_regex(const gchar *, GString *);
+void cosmetic_add(GHashTable *, const gchar *, const gchar *);
+void cosmetic_add_sheets(struct AdblockSource *);
+GHashTable *cosmetic_by_selector(GHashTable *);
+void cosmetic_group(GHashTable *, const gchar *, GPtrArray *, GHashTable *);
+gchar **cosmetic_patterns(const gchar *);
+void cosmetic_parse_line(gchar *, struct AdblockSource *);
+gboolean cosmetic_selector_valid(const gchar *);
+void json_append_string(GString *, const gchar *);
+gchar *uri_get_host(const gchar *);
+
+// Reopen Closed Tab Stuff, see closed_tab_push()
 #define MAX_CLOSED_TABS 10
-GQueue *closed_tabs;
 
-gboolean reopen_closed_tab(struct Client *c, const gchar *arg) {
-    (void)c;
-    (void)arg;
-    if (!g_queue_is_empty(closed_tabs)) {
-        gchar *uri = g_queue_pop_head(closed_tabs);
-        if (uri) {
-            client_new(uri, NULL, TRUE, TRUE);
-            g_free(uri);
-            return TRUE;
-        }
-    }
-    return FALSE;
-}
+struct ClosedTab {
+    gchar *uri;
+    GBytes *session;     // Serialized session state, if the tab had loaded
+    GtkWidget *web_view; // The web view itself, during the grace period
+};
+
+GQueue *closed_tabs;  // Most recently closed first
+guint closed_tab_timer = 0;
+
+void closed_tab_push(struct Client *);
+gboolean closed_tab_expire(gpointer);
+void closed_tab_free(gpointer);
 
 // Main Window Structure
 struct MainWindow
@@ -121,124 +578,342 @@ client_destroy(GtkWidget *widget, gpointer data)
 {
     struct Client *c = (struct Client *)data;
     gint idx;
-    const gchar *uri;
 
     g_signal_handlers_disconnect_by_func(G_OBJECT(c->web_view),
                                          changed_load_progress, c);
+    trace_navigation_end(c);
 
     idx = gtk_notebook_page_num(GTK_NOTEBOOK(mw.notebook), c->vbox);
     if (idx == -1)
-        fprintf(stderr, NAME": Tab index was -1, bamboozled\n");
+        log_warn("Tab index was -1, bamboozled");
     else {
-        // Save the URI of the closed tab
-        uri = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
-        if (uri) {
-            g_queue_push_head(closed_tabs, g_strdup(uri));
-            if (g_queue_get_length(closed_tabs) > MAX_CLOSED_TABS) {
-                g_free(g_queue_pop_tail(closed_tabs));
-            }
-        }
+        closed_tab_push(c);
         gtk_notebook_remove_page(GTK_NOTEBOOK(mw.notebook), idx);
     }
 
+    if (session_focused == c)
+        session_focused = NULL;
+
+    g_queue_remove(&pending_clients, c);
+    g_free(c->pending_uri);
+    if (c->session != NULL)
+        g_bytes_unref(c->session);
     free(c);
     clients--;
 
     quit_if_nothing_active();
 }
 
+/* Closed tabs keep their URI and session state, so reopening one
+ * brings back its back/forward list, scroll positions and form input.
+ * The most recently closed tab keeps its very web view for
+ * CLOSED_TAB_GRACE_S seconds, muted and detached from the window.
+ * Reopening it within that time just puts it back, without loading
+ * anything. */
+void
+closed_tab_push(struct Client *c)
+{
+    WebKitWebViewSessionState *state;
+    WebKitWebView *wv = WEBKIT_WEB_VIEW(c->web_view);
+    struct ClosedTab *t;
+    const gchar *uri;
+
+    uri = c->pending_uri != NULL ? c->pending_uri : webkit_web_view_get_uri(wv);
+    if (uri == NULL || uri[0] == 0)
+        return;
+
+    t = g_new0(struct ClosedTab, 1);
+    t->uri = g_strdup(uri);
+    if (c->pending_uri != NULL)
+        t->session = c->session != NULL ? g_bytes_ref(c->session) : NULL;
+    else
+    {
+        state = webkit_web_view_get_session_state(wv);
+        t->session = webkit_web_view_session_state_serialize(state);
+        webkit_web_view_session_state_unref(state);
+    }
+
+    if (closed_tab_timer != 0)
+    {
+        g_source_remove(closed_tab_timer);
+        closed_tab_expire(NULL);
+    }
+
+    /* A tab that never loaded has nothing to keep, and neither do we
+     * while memory is short. */
+    if (CLOSED_TAB_GRACE_S > 0 && c->pending_uri == NULL &&
+        pressure_level < PRESSURE_FREEZE)
+    {
+        g_signal_handlers_disconnect_by_data(c->web_view, c);
+        t->web_view = g_object_ref(c->web_view);
+        gtk_container_remove(GTK_CONTAINER(c->vbox), c->web_view);
+        webkit_web_view_set_is_muted(wv, TRUE);
+        closed_tab_timer = g_timeout_add_seconds(CLOSED_TAB_GRACE_S,
+                                                 closed_tab_expire, NULL);
+    }
+
+    g_queue_push_head(closed_tabs, t);
+    if (g_queue_get_length(closed_tabs) > MAX_CLOSED_TABS)
+        closed_tab_free(g_queue_pop_tail(closed_tabs));
+}
+
+/* Ends the grace period of the most recently closed tab. */
+gboolean
+closed_tab_expire(gpointer data)
+{
+    struct ClosedTab *t = g_queue_peek_head(closed_tabs);
+
+    closed_tab_timer = 0;
+    if (t != NULL && t->web_view != NULL)
+    {
+        gtk_widget_destroy(t->web_view);
+        g_object_unref(t->web_view);
+        t->web_view = NULL;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+closed_tab_free(gpointer data)
+{
+    struct ClosedTab *t = (struct ClosedTab *)data;
+
+    if (t->web_view != NULL)
+    {
+        gtk_widget_destroy(t->web_view);
+        g_object_unref(t->web_view);
+    }
+    if (t->session != NULL)
+        g_bytes_unref(t->session);
+    g_free(t->uri);
+    g_free(t);
+}
+
+gboolean
+reopen_closed_tab(struct Client *c, const gchar *arg)
+{
+    struct ClosedTab *t;
+    struct Client *r;
+    WebKitWebView *wv;
+
+    if ((t = g_queue_pop_head(closed_tabs)) == NULL)
+        return FALSE;
+
+    wv = client_new(NULL, NULL, TRUE, TRUE);
+    r = g_object_get_data(G_OBJECT(gtk_widget_get_parent(GTK_WIDGET(wv))),
+                          "lariza-client");
+
+    if (t->web_view != NULL)
+    {
+        g_source_remove(closed_tab_timer);
+        closed_tab_timer = 0;
+
+        /* Swap the fresh web view, which hasn't loaded anything yet, for
+         * the old one, which the box holds from now on. */
+        g_signal_handlers_disconnect_by_data(r->web_view, r);
+        gtk_widget_destroy(r->web_view);
+        r->web_view = t->web_view;
+        t->web_view = NULL;
+        client_web_view_connect(r);
+        gtk_box_pack_start(GTK_BOX(r->vbox), r->web_view, TRUE, TRUE, 0);
+        gtk_container_set_focus_child(GTK_CONTAINER(r->vbox), r->web_view);
+        gtk_widget_show(r->web_view);
+        g_object_unref(r->web_view);
+        webkit_web_view_set_is_muted(WEBKIT_WEB_VIEW(r->web_view), FALSE);
+
+        gtk_entry_set_text(GTK_ENTRY(r->location), t->uri);
+        changed_title(G_OBJECT(r->web_view), NULL, r);
+        changed_favicon(G_OBJECT(r->web_view), NULL, r);
+    }
+    else
+    {
+        /* Loaded like a hibernated tab. */
+        r->pending_uri = t->uri;
+        r->session = t->session;
+        t->uri = NULL;
+        t->session = NULL;
+        client_load_pending(r);
+    }
+
+    closed_tab_free(t);
+
+    return TRUE;
+}
+
 WebKitWebView *
 client_new(const gchar *uri, WebKitWebView *related_wv, gboolean show,
            gboolean focus_tab)
 {
     struct Client *c;
+    gint64 t0 = trace_begin();
     gchar *f;
-    GtkWidget *evbox, *tabbox;
-    WebKitWebContext *wc;
-    WebKitSettings *settings;
 
-    if (uri != NULL && cooperative_instances && !cooperative_alone)
+    /* A related web view shares its opener's web process, so it can't
+     * be a spare. */
+    if (related_wv != NULL || (c = spare_take()) == NULL)
+        c = client_create(related_wv);
+    spare_schedule();
+
+    c->focus_new_tab = focus_tab;
+    c->last_active = g_get_monotonic_time();
+    c->tab_id = session_next_id++;
+
+    gtk_notebook_insert_page(GTK_NOTEBOOK(mw.notebook), c->vbox, c->tab,
+                             gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook)) + 1);
+    gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(mw.notebook), c->vbox, TRUE);
+    g_object_unref(c->vbox);
+    g_object_unref(c->tab);
+
+    if (show)
+        show_web_view(NULL, c);
+    else
+        g_signal_connect(G_OBJECT(c->web_view), "ready-to-show",
+                         G_CALLBACK(show_web_view), c);
+
+    if (uri != NULL && (f = ensure_uri_scheme(uri)) != NULL)
     {
-        f = ensure_uri_scheme(uri);
-        if (write_full(cooperative_pipe_fp, f, strlen(f)) <= 0 ||
-            write_full(cooperative_pipe_fp, "\n", 1) <= 0)
+        if (!focus_tab && background_tab_delay >= 0)
+            client_defer(c, f);
+        else
         {
-            fprintf(stderr, NAME": Could not write command '%s'\n", f);
+            webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), f);
+            g_free(f);
         }
-        g_free(f);
-        return NULL;
     }
 
+    clients++;
+    trace_end("client_new", t0, uri);
+
+    return WEBKIT_WEB_VIEW(c->web_view);
+}
+
+/* Builds a client with its web view and widgets, which are not part of
+ * the window yet. The caller holds a reference on c->vbox and c->tab. */
+struct Client *
+client_create(WebKitWebView *related_wv)
+{
+    struct Client *c;
+    GtkWidget *tabbox;
+    GtkEntryCompletion *completion;
+
     c = g_slice_new0(struct Client);
     if (!c)
     {
-        fprintf(stderr, NAME": fatal: memory allocation failed\n");
+        log_error("fatal: memory allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    c->focus_new_tab = focus_tab;
+    client_web_view_new(c, related_wv);
+
+    c->location = gtk_entry_new();
+    g_signal_connect(G_OBJECT(c->location), "key-press-event",
+                     G_CALLBACK(key_location), c);
+    if (history_completions != NULL)
+    {
+        /* Must run before the completion's own handler. */
+        g_signal_connect(G_OBJECT(c->location), "changed",
+                         G_CALLBACK(location_changed), c);
+        completion = gtk_entry_completion_new();
+        gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(history_completions));
+        gtk_entry_completion_set_text_column(completion, 0);
+        gtk_entry_completion_set_minimum_key_length(completion, 3);
+        gtk_entry_completion_set_match_func(completion, location_completion_match,
+                                            NULL, NULL);
+        g_signal_connect(G_OBJECT(completion), "match-selected",
+                         G_CALLBACK(location_completion_selected), c);
+        gtk_entry_set_completion(GTK_ENTRY(c->location), completion);
+        g_object_unref(completion);
+    }
+    g_signal_connect(G_OBJECT(c->location), "icon-release",
+                     G_CALLBACK(icon_location), c);
+    gtk_entry_set_icon_from_icon_name(GTK_ENTRY(c->location),
+                                      GTK_ENTRY_ICON_PRIMARY,
+                                      NULL);
+
+    c->vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    g_object_set_data(G_OBJECT(c->vbox), "lariza-client", c);
+    gtk_box_pack_start(GTK_BOX(c->vbox), c->location, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
+    gtk_container_set_focus_child(GTK_CONTAINER(c->vbox), c->web_view);
+
+    c->tabicon = gtk_image_new_from_icon_name("text-html", GTK_ICON_SIZE_SMALL_TOOLBAR);
+
+    c->tablabel = gtk_label_new(NAME);
+    gtk_label_set_ellipsize(GTK_LABEL(c->tablabel), PANGO_ELLIPSIZE_END);
+    gtk_label_set_width_chars(GTK_LABEL(c->tablabel), tab_width_chars);
+    gtk_widget_set_has_tooltip(c->tablabel, !disable_tooltips);
+
+    tabbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL,
+                         5 * gtk_widget_get_scale_factor(mw.win));
+    gtk_box_pack_start(GTK_BOX(tabbox), c->tabicon, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(tabbox), c->tablabel, TRUE, TRUE, 0);
+
+    c->tab = gtk_event_box_new();
+    gtk_container_add(GTK_CONTAINER(c->tab), tabbox);
+    g_signal_connect(G_OBJECT(c->tab), "button-release-event",
+                     G_CALLBACK(key_tablabel), c);
+
+    gtk_widget_add_events(c->tab, GDK_SCROLL_MASK);
+    g_signal_connect(G_OBJECT(c->tab), "scroll-event",
+                     G_CALLBACK(key_tablabel), c);
+
+    g_object_set_data(G_OBJECT(c->tab), "lariza-tab-label", c->tablabel);
+
+    gtk_widget_show_all(c->tab);
+    g_object_ref_sink(c->vbox);
+    g_object_ref_sink(c->tab);
+
+    return c;
+}
+
+/* Creates the web view of c, which also happens when a hibernated tab
+ * is restored. All tabs share one WebKitSettings and one user content
+ * manager, see init_default_web_context(). Related views get them from
+ * the view they are related to. */
+void
+client_web_view_new(struct Client *c, WebKitWebView *related_wv)
+{
+    gint64 t0 = trace_begin();
 
     if (related_wv == NULL)
-        c->web_view = GTK_WIDGET(webkit_web_view_new());
+        c->web_view = GTK_WIDGET(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+                                              "web-context", web_context,
+                                              "settings", web_settings,
+                                              "user-content-manager", user_content,
+                                              NULL));
     else
         c->web_view = GTK_WIDGET(webkit_web_view_new_with_related_view(related_wv));
 
-    if (accepted_language[0] != NULL)
+    webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), global_zoom);
+    g_signal_connect(G_OBJECT(c->web_view), "create",
+                     G_CALLBACK(client_new_request), NULL);
+    g_signal_connect(G_OBJECT(c->web_view), "decide-policy",
+                     G_CALLBACK(decide_policy), NULL);
+    g_signal_connect(G_OBJECT(c->web_view), "resource-load-started",
+                     G_CALLBACK(disk_cache_resource), NULL);
+    if (pageload_hosts != NULL)
     {
-        wc = webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view));
-        webkit_web_context_set_preferred_languages(wc, accepted_language);
+        g_signal_connect(G_OBJECT(c->web_view), "resource-load-started",
+                         G_CALLBACK(pageload_resource), NULL);
+        g_signal_connect(G_OBJECT(c->web_view), "load-failed",
+                         G_CALLBACK(pageload_failed), NULL);
     }
+    client_web_view_connect(c);
 
-    settings = webkit_web_view_get_settings(WEBKIT_WEB_VIEW(c->web_view));
-    
-    if (user_agent != NULL) {
-        webkit_settings_set_user_agent(settings, user_agent);
+    if (disable_tab_thumbnails) {
+        webkit_web_view_set_background_color(WEBKIT_WEB_VIEW(c->web_view), &(GdkRGBA){0, 0, 0, 0});
     }
 
-    // Apply WebKit settings
-    webkit_settings_set_enable_javascript(settings, enable_javascript);
-    webkit_settings_set_auto_load_images(settings, enable_images);
-    webkit_settings_set_enable_webgl(settings, enable_webgl);
-    webkit_settings_set_hardware_acceleration_policy(settings, 
-        enable_hardware_acceleration ? WEBKIT_HARDWARE_ACCELERATION_POLICY_ALWAYS : WEBKIT_HARDWARE_ACCELERATION_POLICY_NEVER);
-
-    // Apply additional WebKit settings
-    webkit_settings_set_enable_page_cache(settings, enable_page_cache);
-    webkit_settings_set_enable_developer_extras(settings, enable_developer_extras);
-    webkit_settings_set_enable_fullscreen(settings, enable_fullscreen);
-    webkit_settings_set_enable_dns_prefetching(settings, enable_dns_prefetching);
-    webkit_settings_set_enable_hyperlink_auditing(settings, enable_hyperlink_auditing);
-    webkit_settings_set_media_playback_requires_user_gesture(settings, !enable_media_stream);
-    webkit_settings_set_print_backgrounds(settings, print_backgrounds);
- 
-    // Font Settings   
-    webkit_settings_set_default_charset(settings, default_charset);
-    webkit_settings_set_default_font_family(settings, sans_serif_font_family);
-    webkit_settings_set_serif_font_family(settings, serif_font_family);
-    webkit_settings_set_monospace_font_family(settings, monospace_font_family);
-    webkit_settings_set_minimum_font_size(settings, minimum_font_size);
-    webkit_settings_set_default_font_size(settings, default_font_size);
-    webkit_settings_set_default_monospace_font_size(settings, default_monospace_font_size);
-
-    webkit_settings_set_javascript_can_open_windows_automatically(settings, javascript_can_open_windows);
-    webkit_settings_set_enable_webrtc(settings, enable_webrtc);
-    webkit_settings_set_enable_mediasource(settings, enable_mediasource);
-    webkit_settings_set_enable_javascript_markup(settings, enable_javascript_markup);
-    webkit_settings_set_enable_resizable_text_areas(settings, enable_resizable_text_areas);
-    webkit_settings_set_enable_html5_local_storage(settings, enable_html5_local_storage);
+    trace_end("web_view_new", t0, NULL);
+}
 
-    // Apply new performance and resource usage settings
-    webkit_settings_set_enable_site_specific_quirks(settings, enable_site_specific_quirks);
-    webkit_settings_set_enable_write_console_messages_to_stdout(settings, enable_write_console_messages_to_stdout);
-    webkit_settings_set_enable_media_capabilities(settings, enable_media_capabilities);
-    webkit_settings_set_enable_encrypted_media(settings, enable_encrypted_media);
-
-    // Set spell checking languages on the WebKit context
-    WebKitWebContext *context = webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view));
-    webkit_web_context_set_spell_checking_languages(context, spell_checking_languages);
-    webkit_web_context_set_spell_checking_enabled(context, enable_spell_checking);
-    
-    webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), global_zoom);
+/* Connects the signals of the web view that refer to c. A web view
+ * that is handed to another client gets them again, see
+ * reopen_closed_tab(). */
+void
+client_web_view_connect(struct Client *c)
+{
     g_signal_connect_after(G_OBJECT(c->web_view), "notify::favicon",
                      G_CALLBACK(changed_favicon), c);
     g_signal_connect_after(G_OBJECT(c->web_view), "notify::title",
@@ -247,12 +922,8 @@ client_new(const gchar *uri, WebKitWebView *related_wv, gboolean show,
                      G_CALLBACK(changed_uri), c);
     g_signal_connect(G_OBJECT(c->web_view), "notify::estimated-load-progress",
                      G_CALLBACK(changed_load_progress), c);
-    g_signal_connect(G_OBJECT(c->web_view), "create",
-                     G_CALLBACK(client_new_request), NULL);
     g_signal_connect(G_OBJECT(c->web_view), "close",
                      G_CALLBACK(client_destroy), c);
-    g_signal_connect(G_OBJECT(c->web_view), "decide-policy",
-                     G_CALLBACK(decide_policy), NULL);
     g_signal_connect(G_OBJECT(c->web_view), "key-press-event",
                      G_CALLBACK(key_web_view), c);
     g_signal_connect(G_OBJECT(c->web_view), "button-release-event",
@@ -265,215 +936,1856 @@ client_new(const gchar *uri, WebKitWebView *related_wv, gboolean show,
                      G_CALLBACK(crashed_web_view), c);
     g_signal_connect(G_OBJECT(c->web_view), "load-changed",
                      G_CALLBACK(web_view_load_changed), c);
+}
 
-    webkit_settings_set_enable_smooth_scrolling(settings, !disable_smooth_scrolling);
+WebKitWebView *
+client_new_request(WebKitWebView *web_view,
+                   WebKitNavigationAction *navigation_action, gpointer data)
+{
+    return client_new(NULL, web_view, FALSE, FALSE);
+}
 
-    c->location = gtk_entry_new();
-    g_signal_connect(G_OBJECT(c->location), "key-press-event",
-                     G_CALLBACK(key_location), c);
-    g_signal_connect(G_OBJECT(c->location), "icon-release",
-                     G_CALLBACK(icon_location), c);
-    gtk_entry_set_icon_from_icon_name(GTK_ENTRY(c->location),
-                                      GTK_ENTRY_ICON_PRIMARY,
-                                      NULL);
+/* Background tabs only get a label until they are first activated, or
+ * until background_tab_delay has passed. Opening a bunch of links at
+ * once then doesn't start as many web processes and page loads at
+ * once. Takes ownership of uri. */
+void
+client_defer(struct Client *c, gchar *uri)
+{
+    c->pending_uri = uri;
+    gtk_entry_set_text(GTK_ENTRY(c->location), uri);
+    gtk_label_set_text(GTK_LABEL(c->tablabel), uri);
+    gtk_widget_set_tooltip_text(c->tablabel, uri);
+
+    /* The first tab of a window is never in the background. */
+    if (gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook)) ==
+        gtk_notebook_page_num(GTK_NOTEBOOK(mw.notebook), c->vbox))
+    {
+        client_load_pending(c);
+        return;
+    }
 
-    c->vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-    gtk_box_pack_start(GTK_BOX(c->vbox), c->location, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
-    gtk_container_set_focus_child(GTK_CONTAINER(c->vbox), c->web_view);
+    g_queue_push_tail(&pending_clients, c);
+    if (background_tab_delay > 0 && pending_timer == 0)
+        pending_timer = g_timeout_add_seconds(background_tab_delay,
+                                              client_load_next_pending, NULL);
+}
 
-    c->tabicon = gtk_image_new_from_icon_name("text-html", GTK_ICON_SIZE_SMALL_TOOLBAR);
+void
+client_load_pending(struct Client *c)
+{
+    WebKitWebViewSessionState *state;
+    WebKitBackForwardListItem *item;
+    WebKitWebView *wv = WEBKIT_WEB_VIEW(c->web_view);
+    gchar *uri = c->pending_uri;
 
-    c->tablabel = gtk_label_new(NAME);
-    gtk_label_set_ellipsize(GTK_LABEL(c->tablabel), PANGO_ELLIPSIZE_END);
-    gtk_label_set_width_chars(GTK_LABEL(c->tablabel), tab_width_chars);
-    gtk_widget_set_has_tooltip(c->tablabel, !disable_tooltips);
+    if (uri == NULL)
+        return;
 
-    tabbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL,
-                         5 * gtk_widget_get_scale_factor(mw.win));
-    gtk_box_pack_start(GTK_BOX(tabbox), c->tabicon, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(tabbox), c->tablabel, TRUE, TRUE, 0);
+    c->pending_uri = NULL;
+    g_queue_remove(&pending_clients, c);
 
-    evbox = gtk_event_box_new();
-    gtk_container_add(GTK_CONTAINER(evbox), tabbox);
-    g_signal_connect(G_OBJECT(evbox), "button-release-event",
-                     G_CALLBACK(key_tablabel), c);
+    /* A hibernated tab gets its back/forward list back. Only the current
+     * item is loaded, as if the user had gone there. */
+    if (c->session != NULL)
+    {
+        state = webkit_web_view_session_state_new(c->session);
+        g_bytes_unref(c->session);
+        c->session = NULL;
+        if (state != NULL)
+        {
+            webkit_web_view_restore_session_state(wv, state);
+            webkit_web_view_session_state_unref(state);
+            item = webkit_back_forward_list_get_current_item(
+                webkit_web_view_get_back_forward_list(wv));
+            if (item != NULL)
+            {
+                webkit_web_view_go_to_back_forward_list_item(wv, item);
+                g_free(uri);
+                return;
+            }
+        }
+        log_warn("Could not restore session of '%s'", uri);
+    }
 
-    gtk_widget_add_events(evbox, GDK_SCROLL_MASK);
-    g_signal_connect(G_OBJECT(evbox), "scroll-event",
-                     G_CALLBACK(key_tablabel), c);
+    webkit_web_view_load_uri(wv, uri);
+    g_free(uri);
+}
 
-    g_object_set_data(G_OBJECT(evbox), "lariza-tab-label", c->tablabel);
+/* A hibernated tab keeps its label, icon and location bar, and the
+ * serialized session state of its web view. The web view itself is
+ * replaced by a fresh one that has never loaded anything, so it doesn't
+ * have a web process. Switching to the tab restores the session through
+ * client_load_pending(). Whatever wasn't part of the session, such as
+ * form input and scripts' state, is lost. */
+gboolean
+client_can_hibernate(struct Client *c)
+{
+    WebKitWebView *wv = WEBKIT_WEB_VIEW(c->web_view);
 
-    gtk_widget_show_all(evbox);
+    return c->pending_uri == NULL && webkit_web_view_get_uri(wv) != NULL &&
+           !webkit_web_view_is_loading(wv) && !webkit_web_view_is_playing_audio(wv);
+}
 
-    gtk_notebook_insert_page(GTK_NOTEBOOK(mw.notebook), c->vbox, evbox,
-                             gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook)) + 1);
-    gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(mw.notebook), c->vbox, TRUE);
+void
+client_hibernate(struct Client *c)
+{
+    WebKitWebViewSessionState *state;
+    WebKitWebView *wv = WEBKIT_WEB_VIEW(c->web_view);
 
-    if (disable_tab_thumbnails) {
-        webkit_web_view_set_background_color(WEBKIT_WEB_VIEW(c->web_view), &(GdkRGBA){0, 0, 0, 0});
-    }
+    state = webkit_web_view_get_session_state(wv);
+    c->session = webkit_web_view_session_state_serialize(state);
+    webkit_web_view_session_state_unref(state);
+    c->pending_uri = g_strdup(webkit_web_view_get_uri(wv));
 
-    if (show)
-        show_web_view(NULL, c);
-    else
-        g_signal_connect(G_OBJECT(c->web_view), "ready-to-show",
-                         G_CALLBACK(show_web_view), c);
+    log_debug("Hibernating '%s'", c->pending_uri);
+    trace_instant("hibernate", c->pending_uri);
+
+    g_free(c->feed_html);
+    c->feed_html = NULL;
+    g_free(c->hover_uri);
+    c->hover_uri = NULL;
+    gtk_entry_set_icon_from_icon_name(GTK_ENTRY(c->location),
+                                      GTK_ENTRY_ICON_PRIMARY, NULL);
+
+    /* Keep the label and icon as they are. */
+    trace_navigation_end(c);
+    g_signal_handlers_disconnect_by_data(c->web_view, c);
+    gtk_widget_destroy(c->web_view);
+
+    client_web_view_new(c, NULL);
+    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
+    gtk_container_set_focus_child(GTK_CONTAINER(c->vbox), c->web_view);
+    gtk_widget_show(c->web_view);
+}
+
+/* Hibernates tabs that weren't looked at for hibernate_after minutes.
+ * While the web processes use more than the budget, the least recently
+ * used tab goes too, one per check, so the freed memory shows up in the
+ * next measurement. Measuring walks /proc, which is done in a thread. */
+gboolean
+hibernate_check(gpointer data)
+{
+    struct Client *c;
+    GtkWidget *page;
+    GTask *task;
+    gint64 now = g_get_monotonic_time();
+    gint i, current;
 
-    if (uri != NULL)
+    current = gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook));
+    for (i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook)); i++)
     {
-        f = ensure_uri_scheme(uri);
-        webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), f);
-        g_free(f);
+        page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+        c = g_object_get_data(G_OBJECT(page), "lariza-client");
+        if (i == current)
+            c->last_active = now;
+        else if (hibernate_after > 0 && client_can_hibernate(c) &&
+                 now - c->last_active > (gint64)hibernate_after * 60 * G_USEC_PER_SEC)
+            client_hibernate(c);
     }
 
-    clients++;
+    if (hibernate_budget_mb > 0 && !hibernate_measuring && hibernate_candidate() != NULL)
+    {
+        hibernate_measuring = TRUE;
+        task = g_task_new(NULL, NULL, hibernate_measured, NULL);
+        g_task_run_in_thread(task, hibernate_measure_thread);
+        g_object_unref(task);
+    }
 
-    return WEBKIT_WEB_VIEW(c->web_view);
+    return G_SOURCE_CONTINUE;
 }
 
-WebKitWebView *
-client_new_request(WebKitWebView *web_view,
-                   WebKitNavigationAction *navigation_action, gpointer data)
+void
+hibernate_measure_thread(GTask *task, gpointer source, gpointer data,
+                         GCancellable *cancellable)
 {
-    return client_new(NULL, web_view, FALSE, FALSE);
+    g_task_return_int(task, web_process_rss(NULL));
 }
 
+/* Tabs may have come and gone meanwhile, the candidate is picked now. */
 void
-web_view_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event, gpointer user_data)
+hibernate_measured(GObject *source, GAsyncResult *result, gpointer data)
+{
+    struct Client *c;
+    guint64 rss;
+
+    hibernate_measuring = FALSE;
+    rss = g_task_propagate_int(G_TASK(result), NULL);
+    if (rss > (guint64)hibernate_budget_mb << 20 && (c = hibernate_candidate()) != NULL)
+        client_hibernate(c);
+}
+
+/* The least recently used tab that can be hibernated, if any. */
+struct Client *
+hibernate_candidate(void)
 {
-    if (load_event == WEBKIT_LOAD_FINISHED) {
-        fprintf(stderr, "Page load finished, injecting hints script\n");
-        inject_hints_script(web_view);
+    struct Client *c, *lru = NULL;
+    GtkWidget *page;
+    gint i, current;
+
+    current = gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook));
+    for (i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook)); i++)
+    {
+        page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+        c = g_object_get_data(G_OBJECT(page), "lariza-client");
+        if (i != current && client_can_hibernate(c) &&
+            (lru == NULL || c->last_active < lru->last_active))
+            lru = c;
     }
+
+    return lru;
 }
 
-void inject_hints_script(WebKitWebView *web_view)
+/* Memory used by all processes below us, which are the web and network
+ * processes, and how many there are if processes isn't NULL. Linux only,
+ * 0 elsewhere. Safe to call from any thread. */
+guint64
+web_process_rss(guint *processes)
 {
-    if (ENABLE_HINTS) {
-        fprintf(stderr, "Injecting hints script\n");
-        const char *hints_script = 
-        "// Anonymous function to get private namespace.\n"
-        "(function() {\n"
-        "    console.log('[hints] Script injected and executing');\n"
-        "\n"
-        "    var charset = \"sdfghjklertzuivbn\".split(\"\");\n"
-        "    var key_follow = \"f\";\n"
-        "    var key_follow_new_win = \"F\";\n"
-        "\n"
-        "    function update_highlights_or_abort()\n"
-        "    {\n"
-        "        console.log('[hints] update_highlights_or_abort called');\n"
-        "        var submatch;\n"
-        "        var col_sel, col_unsel;\n"
-        "        var longest_id = 0;\n"
-        "\n"
-        "        if (document.lariza_hints.state === \"follow_new\")\n"
-        "        {\n"
-        "            col_unsel = \"#DAFFAD\";\n"
-        "            col_sel = \"#FF5D00\";\n"
-        "        }\n"
-        "        else\n"
-        "        {\n"
-        "            col_unsel = \"#A7FFF5\";\n"
-        "            col_sel = \"#33FF00\";\n"
-        "        }\n"
+    GHashTable *parents;
+    GArray *pids;
+    GDir *proc;
+    const gchar *name, *p;
+    gchar *path, *contents;
+    guint64 total = 0, n;
+    gint pid, ppid, self = getpid();
+    guint i, depth;
+
+    if (processes != NULL)
+        *processes = 0;
+    if ((proc = g_dir_open("/proc", 0, NULL)) == NULL)
+        return 0;
+
+    parents = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pids = g_array_new(FALSE, FALSE, sizeof (gint));
+    while ((name = g_dir_read_name(proc)) != NULL)
+    {
+        if ((pid = atoi(name)) <= 0)
+            continue;
+
+        /* "pid (comm) state ppid ...", where comm may contain anything. */
+        path = g_strdup_printf("/proc/%d/stat", pid);
+        if (g_file_get_contents(path, &contents, NULL, NULL))
+        {
+            if ((p = strrchr(contents, ')')) != NULL &&
+                sscanf(p + 1, " %*c %d", &ppid) == 1)
+            {
+                g_hash_table_insert(parents, GINT_TO_POINTER(pid), GINT_TO_POINTER(ppid));
+                g_array_append_val(pids, pid);
+            }
+            g_free(contents);
+        }
+        g_free(path);
+    }
+    g_dir_close(proc);
+
+    for (i = 0; i < pids->len; i++)
+    {
+        pid = g_array_index(pids, gint, i);
+        for (ppid = pid, depth = 0; ppid > 1 && ppid != self && depth < 16; depth++)
+            ppid = GPOINTER_TO_INT(g_hash_table_lookup(parents, GINT_TO_POINTER(ppid)));
+        if (ppid != self || pid == self)
+            continue;
+        if (processes != NULL)
+            (*processes)++;
+
+        /* Web processes share a lot of pages, which RSS counts for each
+         * of them. PSS splits them up. */
+        path = g_strdup_printf("/proc/%d/smaps_rollup", pid);
+        if (g_file_get_contents(path, &contents, NULL, NULL))
+        {
+            if ((p = strstr(contents, "\nPss:")) != NULL &&
+                sscanf(p + 5, "%"G_GUINT64_FORMAT, &n) == 1)
+                total += n << 10;  // kB
+            g_free(contents);
+        }
+        else
+        {
+            g_free(path);
+            path = g_strdup_printf("/proc/%d/statm", pid);
+            if (g_file_get_contents(path, &contents, NULL, NULL))
+            {
+                if (sscanf(contents, "%*u %"G_GUINT64_FORMAT, &n) == 1)
+                    total += n * sysconf(_SC_PAGESIZE);
+                g_free(contents);
+            }
+        }
+        g_free(path);
+    }
+
+    g_array_free(pids, TRUE);
+    g_hash_table_destroy(parents);
+
+    return total;
+}
+
+/* WebKit sizes its disk cache by the free disk space and knows nothing
+ * about which sites we care for. Every DISK_CACHE_CHECK_S seconds, we
+ * fetch the size of the cache per site (WebKit's website data name,
+ * usually the registrable domain) and, while it exceeds the budget,
+ * remove the sites used least recently until it is down to
+ * DISK_CACHE_LOW_WATER_PCT of the budget. When a site was used is
+ * recorded for every resource loaded from it and kept in a file, so
+ * a restart doesn't make all sites look equally old. */
+void
+disk_cache_setup(void)
+{
+    struct DiskCacheSite *site;
+    gchar *p, *contents, **lines, *name;
+    gint64 used;
+    gint i;
+
+    disk_cache_sites = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    p = g_build_filename(g_get_user_cache_dir(), NAME, NULL);
+    g_mkdir_with_parents(p, 0700);
+    g_free(p);
+
+    p = disk_cache_lru_file();
+    if (g_file_get_contents(p, &contents, NULL, NULL))
+    {
+        lines = g_strsplit(contents, "\n", -1);
+        for (i = 0; lines[i] != NULL; i++)
+        {
+            used = g_ascii_strtoll(lines[i], &name, 10);
+            if (name == lines[i] || *name != ' ' || *++name == 0)
+                continue;
+            site = g_new0(struct DiskCacheSite, 1);
+            site->used = used;
+            g_hash_table_replace(disk_cache_sites, g_strdup(name), site);
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    g_free(p);
+
+    g_timeout_add_seconds(DISK_CACHE_CHECK_S, disk_cache_check, NULL);
+}
+
+gboolean
+disk_cache_check(gpointer data)
+{
+    if (!disk_cache_busy)
+    {
+        disk_cache_busy = TRUE;
+        webkit_website_data_manager_fetch(
+            webkit_web_context_get_website_data_manager(web_context),
+            WEBKIT_WEBSITE_DATA_DISK_CACHE, NULL, disk_cache_fetched, NULL);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+disk_cache_fetched(GObject *dm, GAsyncResult *result, gpointer data)
+{
+    struct DiskCacheSite *site;
+    GHashTable *sites;
+    GList *all, *l, *evict = NULL;
+    GError *err = NULL;
+    const gchar *name;
+    guint64 total = 0, low_water;
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    disk_cache_busy = FALSE;
+    all = webkit_website_data_manager_fetch_finish(WEBKIT_WEBSITE_DATA_MANAGER(dm),
+                                                   result, &err);
+    if (err != NULL)
+    {
+        log_warn("Could not fetch the disk cache sites: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    /* Sites WebKit dropped on its own are forgotten, sites that are new
+     * count as used now. */
+    sites = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    for (l = all; l != NULL; l = l->next)
+    {
+        name = webkit_website_data_get_name(l->data);
+        if (!g_hash_table_steal_extended(disk_cache_sites, name, NULL, (gpointer *)&site))
+        {
+            site = g_new0(struct DiskCacheSite, 1);
+            site->used = now;
+            disk_cache_dirty = TRUE;
+        }
+        site->size = webkit_website_data_get_size(l->data, WEBKIT_WEBSITE_DATA_DISK_CACHE);
+        total += site->size;
+        g_hash_table_insert(sites, g_strdup(name), site);
+    }
+    if (g_hash_table_size(disk_cache_sites) > 0)
+        disk_cache_dirty = TRUE;
+    g_hash_table_destroy(disk_cache_sites);
+    disk_cache_sites = sites;
+
+    if (disk_cache_budget_mb > 0 && total > (guint64)disk_cache_budget_mb << 20)
+    {
+        low_water = ((guint64)disk_cache_budget_mb << 20) / 100 * DISK_CACHE_LOW_WATER_PCT;
+        all = g_list_sort(all, disk_cache_lru_cmp);
+        for (l = all; l != NULL && total > low_water; l = l->next)
+        {
+            name = webkit_website_data_get_name(l->data);
+            site = g_hash_table_lookup(disk_cache_sites, name);
+            total -= site->size;
+            evict = g_list_prepend(evict, l->data);
+            g_hash_table_remove(disk_cache_sites, name);
+        }
+        log_info("Evicting %u sites from the disk cache, %"G_GUINT64_FORMAT" MiB left",
+                 g_list_length(evict), total >> 20);
+        webkit_website_data_manager_remove(WEBKIT_WEBSITE_DATA_MANAGER(dm),
+                                           WEBKIT_WEBSITE_DATA_DISK_CACHE, evict,
+                                           NULL, NULL, NULL);
+        g_list_free(evict);
+        disk_cache_dirty = TRUE;
+    }
+    g_list_free_full(all, (GDestroyNotify)webkit_website_data_unref);
+
+    log_debug("Disk cache: %"G_GUINT64_FORMAT" MiB in %u sites",
+              total >> 20, g_hash_table_size(disk_cache_sites));
+
+    if (disk_cache_dirty)
+        disk_cache_finish();
+}
+
+/* Least recently used first. */
+gint
+disk_cache_lru_cmp(gconstpointer a, gconstpointer b)
+{
+    struct DiskCacheSite *sa, *sb;
+
+    sa = g_hash_table_lookup(disk_cache_sites, webkit_website_data_get_name((WebKitWebsiteData *)a));
+    sb = g_hash_table_lookup(disk_cache_sites, webkit_website_data_get_name((WebKitWebsiteData *)b));
+
+    return sa->used < sb->used ? -1 : sa->used > sb->used;
+}
+
+/* Marks the site a request goes to as used. */
+void
+disk_cache_resource(WebKitWebView *web_view, WebKitWebResource *resource,
+                    WebKitURIRequest *request, gpointer data)
+{
+    struct DiskCacheSite *site;
+    gchar *host;
+
+    if ((host = uri_get_host(webkit_uri_request_get_uri(request))) == NULL)
+        return;
+
+    if ((site = disk_cache_site(host)) != NULL)
+    {
+        site->used = g_get_real_time() / G_USEC_PER_SEC;
+        disk_cache_dirty = TRUE;
+    }
+
+    g_free(host);
+}
+
+/* The site of host, "www.example.org" belongs to "example.org". */
+struct DiskCacheSite *
+disk_cache_site(const gchar *host)
+{
+    struct DiskCacheSite *site;
+
+    while (host != NULL)
+    {
+        if ((site = g_hash_table_lookup(disk_cache_sites, host)) != NULL)
+            return site;
+        if ((host = strchr(host, '.')) != NULL)
+            host++;
+    }
+
+    return NULL;
+}
+
+gchar *
+disk_cache_lru_file(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), NAME, "disk-cache-lru", NULL);
+}
+
+/* Writes when the sites were used, "SECONDS NAME" per line. */
+void
+disk_cache_finish(void)
+{
+    GHashTableIter iter;
+    struct DiskCacheSite *site;
+    GString *out;
+    GError *err = NULL;
+    gchar *name, *p;
+
+    if (disk_cache_sites == NULL || !disk_cache_dirty)
+        return;
+
+    out = g_string_new(NULL);
+    g_hash_table_iter_init(&iter, disk_cache_sites);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&name, (gpointer *)&site))
+        g_string_append_printf(out, "%"G_GINT64_FORMAT" %s\n", site->used, name);
+
+    p = disk_cache_lru_file();
+    if (!g_file_set_contents(p, out->str, out->len, &err))
+    {
+        log_warn("Could not write '%s': %s", p, err->message);
+        g_error_free(err);
+    }
+    else
+        disk_cache_dirty = FALSE;
+    g_free(p);
+    g_string_free(out, TRUE);
+}
+
+/* The timings of each navigation are kept per host: when the last
+ * redirect happened, when the page committed, was first drawn and
+ * finished loading, and how many bytes it loaded, by Content-Length.
+ * The last PAGELOAD_SAMPLES navigations of a host are in memory, for
+ * percentiles. All of them are appended to pageload_file, if set, which is
+ * compacted to those on start and exit once it has grown to twice
+ * that. See pageload.h for the format. */
+void
+pageload_setup(void)
+{
+    struct pageload_record r;
+    const gchar *p, *end, *next, *host;
+    gchar *data = NULL, *dir, *h;
+    gsize len = 0, magic = strlen(PAGELOAD_MAGIC);
+    GError *err = NULL;
+
+    if (pageload_file[0] == 0)
+        return;
+
+    if (!g_file_get_contents(pageload_file, &data, &len, &err) &&
+        !g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+        log_error("Could not read '%s': %s", pageload_file, err->message);
+        g_error_free(err);
+        return;
+    }
+    g_clear_error(&err);
+
+    if (len > 0 && (len < magic || memcmp(data, PAGELOAD_MAGIC, magic) != 0))
+    {
+        log_error("'%s' is not a page load file, not recording page loads",
+                  pageload_file);
+        g_free(data);
+        return;
+    }
+
+    pageload_hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           pageload_host_free);
+
+    end = data + len;
+    for (p = data + magic; p < end && (next = pageload_record_next(p, end, &r, &host)) != NULL;
+         p = next)
+    {
+        h = g_strndup(host, r.host_len);
+        pageload_add(h, &r);
+        g_free(h);
+        pageload_records++;
+    }
+    if (len > 0 && p < end)
+        log_warn("'%s' is damaged at offset %lu, dropping the rest", pageload_file,
+                 (unsigned long)(p - data));
+    g_free(data);
+
+    /* A damaged tail is dropped by compacting, too. */
+    if (len == 0 || p < end ||
+        (pageload_records > PAGELOAD_COMPACT_MIN && pageload_records > 2 * pageload_kept))
+    {
+        dir = g_path_get_dirname(pageload_file);
+        g_mkdir_with_parents(dir, 0700);
+        g_free(dir);
+        pageload_fd = pageload_compact();
+    }
+    else
+    {
+        pageload_fd = open(pageload_file, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (pageload_fd == -1)
+            log_error("Could not open '%s': %s", pageload_file, g_strerror(errno));
+    }
+}
+
+void
+pageload_add(const gchar *host, const struct pageload_record *r)
+{
+    struct PageLoadHost *ph;
+
+    ph = g_hash_table_lookup(pageload_hosts, host);
+    if (ph == NULL)
+    {
+        ph = g_new0(struct PageLoadHost, 1);
+        ph->samples = g_array_new(FALSE, FALSE, sizeof *r);
+        g_hash_table_insert(pageload_hosts, g_strdup(host), ph);
+    }
+
+    if (ph->samples->len < PAGELOAD_SAMPLES)
+    {
+        g_array_append_vals(ph->samples, r, 1);
+        pageload_kept++;
+    }
+    else
+    {
+        g_array_index(ph->samples, struct pageload_record, ph->next) = *r;
+        ph->next = (ph->next + 1) % PAGELOAD_SAMPLES;
+    }
+}
+
+/* The state of the current navigation lives with the web view, so it
+ * follows the view when a closed tab is reopened. */
+struct PageLoad *
+pageload_get(WebKitWebView *web_view)
+{
+    struct PageLoad *l;
+
+    l = g_object_get_data(G_OBJECT(web_view), "cream-pageload");
+    if (l == NULL)
+    {
+        l = g_new0(struct PageLoad, 1);
+        g_object_set_data_full(G_OBJECT(web_view), "cream-pageload", l, g_free);
+    }
+
+    return l;
+}
+
+void
+pageload_changed(WebKitWebView *web_view, WebKitLoadEvent load_event)
+{
+    struct PageLoad *l = pageload_get(web_view);
+    gint64 now = g_get_monotonic_time();
+
+    switch (load_event)
+    {
+        case WEBKIT_LOAD_STARTED:
+            l->gen++;
+            l->start = now;
+            l->redirect = l->commit = l->paint = l->finish = 0;
+            l->time = g_get_real_time() / G_USEC_PER_SEC;
+            l->bytes = 0;
+            l->failed = FALSE;
+            break;
+        case WEBKIT_LOAD_REDIRECTED:
+            l->redirect = now;
+            break;
+        case WEBKIT_LOAD_COMMITTED:
+            l->commit = now;
+            break;
+        case WEBKIT_LOAD_FINISHED:
+            l->finish = now;
+            if (l->start != 0 && !l->failed)
+                pageload_record(web_view, l);
+            l->start = 0;
+            break;
+    }
+}
+
+/* Failed loads finish as well, but are not recorded. */
+gboolean
+pageload_failed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+                gchar *uri, GError *error, gpointer data)
+{
+    pageload_get(web_view)->failed = TRUE;
+    return FALSE;
+}
+
+void
+pageload_resource(WebKitWebView *web_view, WebKitWebResource *resource,
+                  WebKitURIRequest *request, gpointer data)
+{
+    struct PageLoad *l = pageload_get(web_view);
+
+    if (l->start == 0)
+        return;
+
+    g_object_set_data(G_OBJECT(resource), "cream-pageload-gen", GUINT_TO_POINTER(l->gen));
+    g_signal_connect_object(G_OBJECT(resource), "finished",
+                            G_CALLBACK(pageload_resource_finished), web_view, 0);
+}
+
+void
+pageload_resource_finished(WebKitWebResource *resource, gpointer data)
+{
+    struct PageLoad *l = pageload_get(WEBKIT_WEB_VIEW(data));
+    WebKitURIResponse *response;
+    guint gen;
+
+    gen = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(resource), "cream-pageload-gen"));
+    if (l->start == 0 || gen != l->gen)
+        return;
+
+    response = webkit_web_resource_get_response(resource);
+    if (response != NULL)
+        l->bytes += webkit_uri_response_get_content_length(response);
+}
+
+void
+pageload_record(WebKitWebView *web_view, struct PageLoad *l)
+{
+    struct pageload_record r;
+    gint64 *at[PAGELOAD_METRICS] = { &l->redirect, &l->commit, &l->paint, &l->finish };
+    GByteArray *buf;
+    gchar *host;
+    gint i;
+
+    host = uri_get_host(webkit_web_view_get_uri(web_view));
+    if (host == NULL || strlen(host) > PAGELOAD_HOST_MAX)
+    {
+        g_free(host);
+        return;
+    }
+
+    memset(&r, 0, sizeof r);
+    r.time = l->time;
+    r.bytes = l->bytes;
+    r.host_len = strlen(host);
+    for (i = 0; i < PAGELOAD_METRICS; i++)
+        r.ms[i] = *at[i] != 0 ? (guint32)((*at[i] - l->start) / 1000) : PAGELOAD_NONE;
+
+    pageload_add(host, &r);
+
+    if (pageload_fd != -1)
+    {
+        buf = g_byte_array_sized_new(sizeof r + r.host_len);
+        g_byte_array_append(buf, (const guint8 *)&r, sizeof r);
+        g_byte_array_append(buf, (const guint8 *)host, r.host_len);
+        if (write_full(pageload_fd, (gchar *)buf->data, buf->len) == (ssize_t)buf->len)
+            pageload_records++;
+        g_byte_array_free(buf, TRUE);
+    }
+
+    log_debug("Page load: %s, commit %u ms, finish %u ms, %"G_GUINT64_FORMAT" KiB",
+              host, r.ms[PAGELOAD_COMMIT], r.ms[PAGELOAD_FINISH], r.bytes >> 10);
+    g_free(host);
+}
+
+/* Rewrites the file with the samples in memory, oldest first per host.
+ * Returns the new file, opened for appending, or -1. */
+int
+pageload_compact(void)
+{
+    GHashTableIter iter;
+    struct PageLoadHost *ph;
+    struct pageload_record *r;
+    GByteArray *buf;
+    gchar *host, *tmp;
+    guint i;
+    int out;
+
+    buf = g_byte_array_new();
+    g_byte_array_append(buf, (const guint8 *)PAGELOAD_MAGIC, strlen(PAGELOAD_MAGIC));
+    g_hash_table_iter_init(&iter, pageload_hosts);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&host, (gpointer *)&ph))
+    {
+        for (i = 0; i < ph->samples->len; i++)
+        {
+            r = &g_array_index(ph->samples, struct pageload_record,
+                               (ph->next + i) % ph->samples->len);
+            g_byte_array_append(buf, (const guint8 *)r, sizeof *r);
+            g_byte_array_append(buf, (const guint8 *)host, r->host_len);
+        }
+    }
+
+    tmp = g_strconcat(pageload_file, ".XXXXXX", NULL);
+    out = g_mkstemp(tmp);
+    if (out == -1 || write_full(out, (gchar *)buf->data, buf->len) != (ssize_t)buf->len ||
+        rename(tmp, pageload_file) == -1)
+    {
+        log_error("Could not compact '%s': %s", pageload_file, g_strerror(errno));
+        if (out != -1)
+        {
+            close(out);
+            unlink(tmp);
+        }
+        out = -1;
+    }
+    else
+        pageload_records = pageload_kept;
+
+    g_free(tmp);
+    g_byte_array_free(buf, TRUE);
+
+    return out;
+}
+
+void
+pageload_host_free(gpointer data)
+{
+    struct PageLoadHost *ph = (struct PageLoadHost *)data;
+
+    g_array_free(ph->samples, TRUE);
+    g_free(ph);
+}
+
+void
+pageload_finish(void)
+{
+    int fd;
+
+    if (pageload_fd == -1)
+        return;
+
+    if (pageload_records > PAGELOAD_COMPACT_MIN && pageload_records > 2 * pageload_kept &&
+        (fd = pageload_compact()) != -1)
+        close(fd);
+    close(pageload_fd);
+    pageload_fd = -1;
+}
+
+/* cream:stats shows what we are up to, for when something misbehaves.
+ * The page is made in the main loop, each section as soon as its data
+ * is there, and streamed to WebKit through a socket pair, so nothing
+ * ever waits for WebKit to read it. Sections are written in order,
+ * whatever order they are done in. Every part of the page still being
+ * made or written holds a reference to it, the last one closes the
+ * socket, which ends the page. */
+void
+stats_request(WebKitURISchemeRequest *request, gpointer data)
+{
+    struct StatsPage *page;
+    GInputStream *in;
+    GSocket *sock;
+    GHashTableIter iter;
+    GError *err = NULL;
+    GTask *task;
+    gpointer host;
+    int sv[2];
+    gint i;
+
+    if (strcmp(webkit_uri_scheme_request_get_path(request), "stats") != 0)
+    {
+        err = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No such page: %s",
+                          webkit_uri_scheme_request_get_uri(request));
+        webkit_uri_scheme_request_finish_error(request, err);
+        g_error_free(err);
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        err = g_error_new(G_IO_ERROR, g_io_error_from_errno(errno),
+                          "socketpair: %s", g_strerror(errno));
+        webkit_uri_scheme_request_finish_error(request, err);
+        g_error_free(err);
+        return;
+    }
+    /* GSocket sends with MSG_NOSIGNAL, so WebKit going away before the
+     * page is done is an error, not a SIGPIPE. */
+    if ((sock = g_socket_new_from_fd(sv[1], &err)) == NULL)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        webkit_uri_scheme_request_finish_error(request, err);
+        g_error_free(err);
+        return;
+    }
+
+    page = g_new0(struct StatsPage, 1);
+    page->refs = 1;
+    page->conn = g_socket_connection_factory_create_connection(sock);
+    g_object_unref(sock);
+    for (i = 0; i < STATS_SECTIONS; i++)
+        page->section[i] = g_string_new(NULL);
+    page->writing = g_string_new(NULL);
+
+    in = g_unix_input_stream_new(sv[0], TRUE);
+    webkit_uri_scheme_request_finish(request, in, -1, "text/html");
+    g_object_unref(in);
+
+    stats_tabs(page);
+    stats_downloads(page);
+
+    page->refs++;
+    page->probe_due = g_get_monotonic_time() + STATS_LATENCY_INTERVAL_MS * 1000;
+    g_timeout_add(STATS_LATENCY_INTERVAL_MS, stats_probe, page);
+
+    /* Reading /proc for every process takes a while. */
+    page->refs++;
+    task = g_task_new(NULL, NULL, stats_processes, page);
+    g_task_set_task_data(task, page, NULL);
+    g_task_run_in_thread(task, stats_processes_thread);
+    g_object_unref(task);
+
+    page->refs++;
+    webkit_website_data_manager_fetch(
+        webkit_web_context_get_website_data_manager(web_context),
+        WEBKIT_WEBSITE_DATA_ALL, NULL, stats_data, page);
+
+    if (pageload_hosts != NULL)
+    {
+        page->hosts = g_ptr_array_new_with_free_func(g_free);
+        g_hash_table_iter_init(&iter, pageload_hosts);
+        while (g_hash_table_iter_next(&iter, &host, NULL))
+            g_ptr_array_add(page->hosts, g_strdup(host));
+        g_ptr_array_sort(page->hosts, stats_host_cmp);
+    }
+    page->refs++;
+    g_idle_add(stats_pageload, page);
+
+    stats_unref(page);
+}
+
+void
+stats_unref(struct StatsPage *page)
+{
+    gint i;
+
+    if (--page->refs > 0)
+        return;
+
+    g_io_stream_close(G_IO_STREAM(page->conn), NULL, NULL);
+    g_object_unref(page->conn);
+    for (i = 0; i < STATS_SECTIONS; i++)
+        g_string_free(page->section[i], TRUE);
+    g_string_free(page->writing, TRUE);
+    if (page->hosts != NULL)
+        g_ptr_array_free(page->hosts, TRUE);
+    g_free(page);
+}
+
+void
+stats_done(struct StatsPage *page, gint section)
+{
+    page->done[section] = TRUE;
+    stats_flush(page);
+}
+
+/* Hands whatever can be written to the output stream, unless it is
+ * still busy with the last of it. */
+void
+stats_flush(struct StatsPage *page)
+{
+    GString *s;
+
+    if (page->busy || page->failed)
+        return;
+
+    g_string_truncate(page->writing, 0);
+    for (; page->current < STATS_SECTIONS; page->current++)
+    {
+        s = page->section[page->current];
+        g_string_append_len(page->writing, s->str, s->len);
+        g_string_truncate(s, 0);
+        if (!page->done[page->current])
+            break;
+    }
+    if (page->writing->len == 0)
+        return;
+
+    page->busy = TRUE;
+    page->refs++;
+    g_output_stream_write_all_async(g_io_stream_get_output_stream(G_IO_STREAM(page->conn)),
+                                    page->writing->str, page->writing->len,
+                                    G_PRIORITY_DEFAULT, NULL, stats_written, page);
+}
+
+void
+stats_written(GObject *stream, GAsyncResult *result, gpointer data)
+{
+    struct StatsPage *page = (struct StatsPage *)data;
+    GError *err = NULL;
+
+    /* The tab was closed or went elsewhere. The rest is made anyway,
+     * but not written. */
+    if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(stream), result, NULL, &err))
+    {
+        log_debug("Could not write "NAME":stats: %s", err->message);
+        g_error_free(err);
+        page->failed = TRUE;
+    }
+
+    page->busy = FALSE;
+    stats_flush(page);
+    stats_unref(page);
+}
+
+void
+stats_tabs(struct StatsPage *page)
+{
+    static const gchar *pressure[] = { "none", "clearing caches", "background tabs frozen",
+                                       "hibernating tabs" };
+    GString *s = page->section[STATS_TABS];
+    GDateTime *now;
+    GtkWidget *tab;
+    struct Client *c;
+    gchar *when;
+    gint i, n, loading = 0, unloaded = 0;
+
+    now = g_date_time_new_now_local();
+    when = g_date_time_format(now, "%F %T");
+    g_date_time_unref(now);
+
+    g_string_append(s,
+        "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+        "<title>"NAME":stats</title><style>"
+        "body { font-family: sans-serif; margin: 2em; }"
+        "table { border-collapse: collapse; margin-bottom: 1em; }"
+        "th, td { padding: 0.2em 1em 0.2em 0; text-align: left; }"
+        "td { font-variant-numeric: tabular-nums; }"
+        "</style></head><body>\n");
+    g_string_append_printf(s, "<h1>"NAME" "VERSION"</h1>\n<p>Process %d, as of %s.</p>\n",
+                           (gint)getpid(), when);
+    g_free(when);
+
+    n = gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook));
+    for (i = 0; i < n; i++)
+    {
+        tab = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+        c = g_object_get_data(G_OBJECT(tab), "lariza-client");
+        if (c->pending_uri != NULL)
+            unloaded++;
+        else if (webkit_web_view_is_loading(WEBKIT_WEB_VIEW(c->web_view)))
+            loading++;
+    }
+
+    g_string_append_printf(s,
+        "<h2>Tabs</h2>\n<table>\n"
+        "<tr><th>Open</th><td>%d</td></tr>\n"
+        "<tr><th>Loading</th><td>%d</td></tr>\n"
+        "<tr><th>Not loaded (background or hibernated)</th><td>%d</td></tr>\n"
+        "<tr><th>Waiting to load in the background</th><td>%u</td></tr>\n"
+        "<tr><th>Spare</th><td>%u</td></tr>\n"
+        "<tr><th>Clients, including spares</th><td>%d</td></tr>\n"
+        "<tr><th>Closed, can be reopened</th><td>%u</td></tr>\n"
+        "<tr><th>Memory pressure</th><td>%s</td></tr>\n"
+        "</table>\n",
+        n, loading, unloaded, g_queue_get_length(&pending_clients),
+        g_queue_get_length(&spare_clients), clients, g_queue_get_length(closed_tabs),
+        pressure[pressure_level]);
+
+    stats_done(page, STATS_TABS);
+}
+
+/* How late the main loop dispatches a timeout, which is how long input
+ * would have to wait as well. */
+gboolean
+stats_probe(gpointer data)
+{
+    struct StatsPage *page = (struct StatsPage *)data;
+    GString *s = page->section[STATS_LATENCY];
+    uint64_t late[STATS_LATENCY_PROBES];
+    gint64 now = g_get_monotonic_time();
+
+    page->latency[page->probes++] = MAX(now - page->probe_due, 0);
+    if (page->probes < STATS_LATENCY_PROBES)
+    {
+        page->probe_due = now + STATS_LATENCY_INTERVAL_MS * 1000;
+        g_timeout_add(STATS_LATENCY_INTERVAL_MS, stats_probe, page);
+        return G_SOURCE_REMOVE;
+    }
+
+    memcpy(late, page->latency, sizeof late);
+    g_string_append_printf(s,
+        "<h2>Main loop latency</h2>\n<table>\n"
+        "<tr><th>Median</th><td>%.1f ms</td></tr>\n"
+        "<tr><th>90th percentile</th><td>%.1f ms</td></tr>\n"
+        "<tr><th>Maximum</th><td>%.1f ms</td></tr>\n"
+        "</table>\n<p>Of %d timeouts, %d ms apart.</p>\n",
+        pageload_percentile(late, STATS_LATENCY_PROBES, 50) / 1000.0,
+        pageload_percentile(late, STATS_LATENCY_PROBES, 90) / 1000.0,
+        pageload_percentile(late, STATS_LATENCY_PROBES, 100) / 1000.0,
+        STATS_LATENCY_PROBES, STATS_LATENCY_INTERVAL_MS);
+
+    stats_done(page, STATS_LATENCY);
+    stats_unref(page);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+stats_processes_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+    struct StatsPage *page = (struct StatsPage *)data;
+    gchar *contents;
+    guint64 pages;
+
+    page->rss = web_process_rss(&page->processes);
+    if (g_file_get_contents("/proc/self/statm", &contents, NULL, NULL))
+    {
+        if (sscanf(contents, "%*u %"G_GUINT64_FORMAT, &pages) == 1)
+            page->self_rss = pages * sysconf(_SC_PAGESIZE);
+        g_free(contents);
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+void
+stats_processes(GObject *source, GAsyncResult *result, gpointer data)
+{
+    struct StatsPage *page = (struct StatsPage *)data;
+
+    g_string_append_printf(page->section[STATS_PROCESSES],
+        "<h2>Processes</h2>\n<table>\n"
+        "<tr><th>Web and network processes</th><td>%u</td></tr>\n"
+        "<tr><th>Their memory (PSS)</th><td>%"G_GUINT64_FORMAT" MiB</td></tr>\n"
+        "<tr><th>Our memory (RSS)</th><td>%"G_GUINT64_FORMAT" MiB</td></tr>\n"
+        "</table>\n",
+        page->processes, page->rss >> 20, page->self_rss >> 20);
+
+    stats_done(page, STATS_PROCESSES);
+    stats_unref(page);
+}
+
+/* WebKit only knows the size of the disk cache, of the other kinds of
+ * website data just which sites have some. */
+void
+stats_data(GObject *dm, GAsyncResult *result, gpointer data)
+{
+    static const struct { WebKitWebsiteDataTypes type; const gchar *name; } types[] = {
+        { WEBKIT_WEBSITE_DATA_COOKIES, "Cookies" },
+        { WEBKIT_WEBSITE_DATA_LOCAL_STORAGE, "Local storage" },
+        { WEBKIT_WEBSITE_DATA_SESSION_STORAGE, "Session storage" },
+        { WEBKIT_WEBSITE_DATA_INDEXEDDB_DATABASES, "IndexedDB" },
+        { WEBKIT_WEBSITE_DATA_SERVICE_WORKER_REGISTRATIONS, "Service workers" },
+        { WEBKIT_WEBSITE_DATA_DOM_CACHE, "DOM cache" },
+        { WEBKIT_WEBSITE_DATA_HSTS_CACHE, "HSTS" },
+    };
+    struct StatsPage *page = (struct StatsPage *)data;
+    GString *s = page->section[STATS_DATA];
+    GList *all, *l;
+    GError *err = NULL;
+    guint64 size = 0;
+    guint cached = 0, sites[G_N_ELEMENTS(types)] = { 0 }, i;
+
+    g_string_append(s, "<h2>Caches and website data</h2>\n");
+
+    all = webkit_website_data_manager_fetch_finish(WEBKIT_WEBSITE_DATA_MANAGER(dm),
+                                                   result, &err);
+    if (err != NULL)
+    {
+        g_string_append_printf(s, "<p>Could not fetch website data: %s</p>\n", err->message);
+        g_error_free(err);
+        stats_done(page, STATS_DATA);
+        stats_unref(page);
+        return;
+    }
+
+    for (l = all; l != NULL; l = l->next)
+    {
+        if (webkit_website_data_get_types(l->data) & WEBKIT_WEBSITE_DATA_DISK_CACHE)
+        {
+            cached++;
+            size += webkit_website_data_get_size(l->data, WEBKIT_WEBSITE_DATA_DISK_CACHE);
+        }
+        for (i = 0; i < G_N_ELEMENTS(types); i++)
+            if (webkit_website_data_get_types(l->data) & types[i].type)
+                sites[i]++;
+    }
+    g_list_free_full(all, (GDestroyNotify)webkit_website_data_unref);
+
+    g_string_append_printf(s,
+        "<table>\n"
+        "<tr><th>Disk cache</th><td>%"G_GUINT64_FORMAT" MiB of %d MiB, %u sites</td></tr>\n",
+        size >> 20, disk_cache_budget_mb, cached);
+    for (i = 0; i < G_N_ELEMENTS(types); i++)
+        g_string_append_printf(s, "<tr><th>%s</th><td>%u sites</td></tr>\n",
+                               types[i].name, sites[i]);
+    g_string_append(s, "</table>\n");
+
+    stats_done(page, STATS_DATA);
+    stats_unref(page);
+}
+
+void
+stats_downloads(struct StatsPage *page)
+{
+    GString *s = page->section[STATS_DOWNLOADS];
+    WebKitDownload *download;
+    GList *l;
+    gchar *path, *name, *esc;
+    guint64 received;
+    gdouble elapsed, rate, total = 0;
+
+    g_string_append(s, "<h2>Downloads</h2>\n");
+    if (g_queue_is_empty(&active_downloads))
+    {
+        g_string_append(s, "<p>None running.</p>\n");
+        stats_done(page, STATS_DOWNLOADS);
+        return;
+    }
+
+    g_string_append(s, "<table>\n<tr><th>File</th><th>Received</th><th>Done</th>"
+                       "<th>Rate</th></tr>\n");
+    for (l = active_downloads.head; l != NULL; l = l->next)
+    {
+        download = WEBKIT_DOWNLOAD(l->data);
+        received = webkit_download_get_received_data_length(download);
+        elapsed = webkit_download_get_elapsed_time(download);
+        rate = elapsed > 0 ? received / elapsed : 0;
+        total += rate;
+
+        path = g_filename_from_uri(webkit_download_get_destination(download), NULL, NULL);
+        name = path != NULL ? g_path_get_basename(path) : g_strdup("?");
+        esc = g_markup_escape_text(name, -1);
+        g_string_append_printf(s, "<tr><td>%s</td><td>%.1f MiB</td><td>%.0f%%</td>"
+                                  "<td>%.0f KiB/s</td></tr>\n",
+                               esc, received / 1048576.0,
+                               webkit_download_get_estimated_progress(download) * 100,
+                               rate / 1024);
+        g_free(esc);
+        g_free(name);
+        g_free(path);
+    }
+    g_string_append_printf(s, "<tr><th>All</th><td></td><td></td><td>%.0f KiB/s</td></tr>\n"
+                              "</table>\n", total / 1024);
+
+    stats_done(page, STATS_DOWNLOADS);
+}
+
+/* There can be any number of hosts, so the table is made a few rows at
+ * a time. */
+gboolean
+stats_pageload(gpointer data)
+{
+    struct StatsPage *page = (struct StatsPage *)data;
+    GString *s = page->section[STATS_PAGELOAD];
+    struct PageLoadHost *h;
+    const gchar *host;
+    gchar *esc;
+    gint m;
+    guint n;
+
+    if (page->hosts == NULL || page->hosts->len == 0)
+    {
+        g_string_append(s, "<h2>Page loads</h2>\n");
+        if (page->hosts == NULL)
+            g_string_append(s, "<p>Not recorded, see "NAME_UPPERCASE"_PAGELOAD_FILE.</p>\n");
+        else
+            g_string_append(s, "<p>None yet.</p>\n");
+        goto done;
+    }
+
+    if (page->next_host == 0)
+        g_string_append(s,
+            "<h2>Page loads</h2>\n<p>Median / 90th percentile in ms since the navigation "
+            "started, of the last "G_STRINGIFY(PAGELOAD_SAMPLES)" navigations per host.</p>\n"
+            "<table>\n<tr><th>Host</th><th>Loads</th><th>Redirect</th><th>Commit</th>"
+            "<th>Paint</th><th>Finish</th><th>KiB</th></tr>\n");
+
+    for (n = 0; n < STATS_HOSTS_PER_BATCH && page->next_host < page->hosts->len;
+         n++, page->next_host++)
+    {
+        host = g_ptr_array_index(page->hosts, page->next_host);
+        if ((h = g_hash_table_lookup(pageload_hosts, host)) == NULL)
+            continue;
+
+        esc = g_markup_escape_text(host, -1);
+        g_string_append_printf(s, "<tr><td>%s</td><td>%u</td>", esc, h->samples->len);
+        g_free(esc);
+        for (m = 0; m <= PAGELOAD_METRICS; m++)
+            stats_percentiles(s, h, m);
+        g_string_append(s, "</tr>\n");
+    }
+
+    if (page->next_host < page->hosts->len)
+    {
+        stats_flush(page);
+        return G_SOURCE_CONTINUE;
+    }
+    g_string_append(s, "</table>\n");
+
+done:
+    g_string_append(s, "</body></html>\n");
+    stats_done(page, STATS_PAGELOAD);
+    stats_unref(page);
+
+    return G_SOURCE_REMOVE;
+}
+
+gint
+stats_host_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+/* One cell with the median and 90th percentile of metric, like
+ * cream-pageload prints them. */
+void
+stats_percentiles(GString *s, struct PageLoadHost *h, gint metric)
+{
+    struct pageload_record *r;
+    uint64_t values[PAGELOAD_SAMPLES];
+    guint i, n = 0;
+
+    for (i = 0; i < h->samples->len; i++)
+    {
+        r = &g_array_index(h->samples, struct pageload_record, i);
+        if (metric == PAGELOAD_METRICS)
+            values[n++] = r->bytes >> 10;
+        else if (r->ms[metric] != PAGELOAD_NONE)
+            values[n++] = r->ms[metric];
+    }
+
+    if (n == 0)
+        g_string_append(s, "<td>-</td>");
+    else
+        g_string_append_printf(s, "<td>%"G_GUINT64_FORMAT" / %"G_GUINT64_FORMAT"</td>",
+                               (guint64)pageload_percentile(values, n, 50),
+                               (guint64)pageload_percentile(values, n, 90));
+}
+
+/* New tabs come from a pool of spare clients, whose web view, settings,
+ * signals and widgets are all set up. Each spare loads about:blank, so
+ * its web process is running by the time it is taken; WebKit reuses a
+ * process that has shown nothing else for the first real navigation.
+ * All handlers but spare_warmed() are blocked meanwhile, so that load
+ * never reaches the session, history or statistics. Only spares done
+ * loading are taken, and the blank page is then dropped from the
+ * back/forward list by restoring the state of a view that never loaded
+ * anything. Spares are made at low
+ * priority, one per SPARE_REFILL_INTERVAL_MS, after a tab was opened.
+ * There are at most spare_tabs of them, and one less for every
+ * SPARE_HEADROOM_MB of memory missing, and none under memory pressure. */
+void
+spare_schedule(void)
+{
+    if (spare_tabs > 0 && spare_timer == 0)
+        spare_timer = g_timeout_add_full(G_PRIORITY_LOW, SPARE_REFILL_INTERVAL_MS,
+                                         spare_refill, NULL, NULL);
+}
+
+gboolean
+spare_refill(gpointer data)
+{
+    struct Client *c;
+    guint wanted;
+
+    wanted = MIN((guint64)spare_tabs,
+                 memory_available() / ((guint64)SPARE_HEADROOM_MB << 20));
+    if (pressure_level == PRESSURE_NONE && g_queue_get_length(&spare_clients) < wanted)
+    {
+        c = client_create(NULL);
+        if (spare_empty_state == NULL)
+            spare_empty_state = webkit_web_view_get_session_state(WEBKIT_WEB_VIEW(c->web_view));
+        spare_block(c, TRUE);
+        g_signal_connect(G_OBJECT(c->web_view), "load-changed",
+                         G_CALLBACK(spare_warmed), c);
+        webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), "about:blank");
+        g_queue_push_tail(&spare_clients, c);
+    }
+
+    if (pressure_level == PRESSURE_NONE && g_queue_get_length(&spare_clients) < wanted)
+        return G_SOURCE_CONTINUE;
+
+    spare_timer = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Blocks or unblocks the handlers client_web_view_new() connected,
+ * those of the client and those without data. */
+void
+spare_block(struct Client *c, gboolean block)
+{
+    GCallback shared[] = {
+        G_CALLBACK(client_new_request), G_CALLBACK(decide_policy),
+        G_CALLBACK(disk_cache_resource), G_CALLBACK(pageload_resource),
+        G_CALLBACK(pageload_failed),
+    };
+    gsize i;
+
+    if (block)
+        g_signal_handlers_block_by_data(c->web_view, c);
+    else
+        g_signal_handlers_unblock_by_data(c->web_view, c);
+    for (i = 0; i < G_N_ELEMENTS(shared); i++)
+    {
+        if (block)
+            g_signal_handlers_block_by_func(c->web_view, shared[i], NULL);
+        else
+            g_signal_handlers_unblock_by_func(c->web_view, shared[i], NULL);
+    }
+}
+
+void
+spare_warmed(WebKitWebView *web_view, WebKitLoadEvent load_event, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (load_event == WEBKIT_LOAD_FINISHED)
+    {
+        g_signal_handlers_disconnect_by_func(c->web_view, spare_warmed, c);
+        spare_block(c, FALSE);
+    }
+}
+
+/* Returns the first spare if it is done loading, with an empty
+ * back/forward list, or NULL. */
+struct Client *
+spare_take(void)
+{
+    struct Client *c;
+    WebKitWebView *wv;
+    guint len;
+
+    if ((c = g_queue_peek_head(&spare_clients)) == NULL ||
+        g_signal_handler_find(c->web_view, G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA,
+                              0, 0, NULL, spare_warmed, c) != 0)
+        return NULL;
+
+    g_queue_pop_head(&spare_clients);
+    wv = WEBKIT_WEB_VIEW(c->web_view);
+    webkit_web_view_restore_session_state(wv, spare_empty_state);
+    len = webkit_back_forward_list_get_length(webkit_web_view_get_back_forward_list(wv));
+    if (len != 0)
+    {
+        log_warn("Spare tab kept %u back/forward entries, not using it", len);
+        spare_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void
+spare_free(struct Client *c)
+{
+    gtk_widget_destroy(c->vbox);
+    g_object_unref(c->vbox);
+    gtk_widget_destroy(c->tab);
+    g_object_unref(c->tab);
+    g_slice_free(struct Client, c);
+}
+
+void
+spare_drop(void)
+{
+    struct Client *c;
+
+    while ((c = g_queue_pop_head(&spare_clients)) != NULL)
+        spare_free(c);
+}
+
+/* Memory that can be used without swapping, or without hitting the
+ * limit of our cgroup, whatever is less. */
+guint64
+memory_available(void)
+{
+    gchar *contents, *p;
+    guint64 avail = G_MAXUINT64, max, current;
+
+    if (g_file_get_contents("/proc/meminfo", &contents, NULL, NULL))
+    {
+        if ((p = strstr(contents, "MemAvailable:")) != NULL)
+            avail = g_ascii_strtoull(p + strlen("MemAvailable:"), NULL, 10) << 10;
+        g_free(contents);
+    }
+
+    if (cgroup_memory(&current, &max))
+        avail = MIN(avail, current < max ? max - current : 0);
+
+    return avail;
+}
+
+/* Watches the memory pressure stall information (PSI) of our cgroup, or
+ * of the whole system, and only acts while there is pressure:
+ *
+ *   PRESSURE_CLEAR_CACHE  WebKit's memory caches are cleared.
+ *   PRESSURE_FREEZE       Background tabs stop loading, pending tabs
+ *                         don't start.
+ *   PRESSURE_DISCARD      The least recently used tab is hibernated,
+ *                         one per check.
+ *
+ * The kernel wakes us up through a PSI trigger. Where we may not set
+ * one, the file is polled instead. A cgroup nearing its limit doesn't
+ * necessarily stall, so its usage is polled either way. Once pressure
+ * builds up, it is rechecked every PRESSURE_POLL_S seconds until it is
+ * gone. */
+void
+memory_pressure_setup(void)
+{
+    gchar *contents = NULL, *p, *dir;
+    int fd;
+
+    /* "0::/user.slice/..." is our cgroup v2. */
+    if (g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL) &&
+        (p = strstr(contents, "0::/")) != NULL && (p == contents || p[-1] == '\n'))
+    {
+        p[strcspn(p, "\n")] = 0;
+        dir = g_build_filename("/sys/fs/cgroup", p + 3, NULL);
+        pressure_file = g_build_filename(dir, "memory.pressure", NULL);
+        if (g_file_test(pressure_file, G_FILE_TEST_EXISTS))
+            pressure_cgroup = dir;
+        else
+        {
+            g_free(pressure_file);
+            pressure_file = NULL;
+            g_free(dir);
+        }
+    }
+    g_free(contents);
+
+    if (pressure_file == NULL)
+    {
+        if (!g_file_test("/proc/pressure/memory", G_FILE_TEST_EXISTS))
+        {
+            log_info("No memory pressure information available");
+            return;
+        }
+        pressure_file = g_strdup("/proc/pressure/memory");
+    }
+
+    /* Unprivileged triggers need a window of a multiple of 2 s. */
+    fd = open(pressure_file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1 && write(fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) != -1)
+    {
+        g_unix_fd_add(fd, G_IO_PRI, memory_pressure_event, NULL);
+        log_debug("Watching memory pressure through '%s'", pressure_file);
+        if (pressure_cgroup != NULL)
+            g_timeout_add_seconds(PRESSURE_POLL_IDLE_S, memory_pressure_poll, NULL);
+        return;
+    }
+    if (fd != -1)
+        close(fd);
+
+    log_debug("Polling memory pressure from '%s'", pressure_file);
+    g_timeout_add_seconds(PRESSURE_POLL_IDLE_S, memory_pressure_poll, NULL);
+}
+
+gboolean
+memory_pressure_event(gint fd, GIOCondition condition, gpointer data)
+{
+    if (pressure_timer == 0 && memory_pressure_check(NULL) == G_SOURCE_CONTINUE)
+        pressure_timer = g_timeout_add_seconds(PRESSURE_POLL_S, memory_pressure_check, NULL);
+
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean
+memory_pressure_poll(gpointer data)
+{
+    return memory_pressure_event(-1, 0, NULL);
+}
+
+gboolean
+memory_pressure_check(gpointer data)
+{
+    struct Client *c;
+    GtkWidget *page;
+    gint level, i, current;
+
+    level = memory_pressure_level();
+    if (level != pressure_level)
+        log_info("Memory pressure level %d", level);
+
+    /* The disk cache costs no memory, it stays. */
+    if (level >= PRESSURE_CLEAR_CACHE && pressure_level < PRESSURE_CLEAR_CACHE)
+        webkit_website_data_manager_clear(
+            webkit_web_context_get_website_data_manager(web_context),
+            WEBKIT_WEBSITE_DATA_MEMORY_CACHE, 0, NULL, NULL, NULL);
+
+    if (level >= PRESSURE_FREEZE && pressure_level < PRESSURE_FREEZE)
+    {
+        if (closed_tab_timer != 0)
+        {
+            g_source_remove(closed_tab_timer);
+            closed_tab_expire(NULL);
+        }
+        spare_drop();
+
+        current = gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook));
+        for (i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook)); i++)
+        {
+            page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+            c = g_object_get_data(G_OBJECT(page), "lariza-client");
+            if (i != current && webkit_web_view_is_loading(WEBKIT_WEB_VIEW(c->web_view)))
+                webkit_web_view_stop_loading(WEBKIT_WEB_VIEW(c->web_view));
+        }
+    }
+
+    if (level >= PRESSURE_DISCARD && (c = hibernate_candidate()) != NULL)
+        client_hibernate(c);
+
+    if (level == PRESSURE_NONE)
+        spare_schedule();
+
+    /* Pending tabs may load again. */
+    if (level < PRESSURE_FREEZE && pressure_level >= PRESSURE_FREEZE &&
+        background_tab_delay > 0 && pending_timer == 0 &&
+        !g_queue_is_empty(&pending_clients))
+        pending_timer = g_timeout_add(BACKGROUND_TAB_INTERVAL_MS,
+                                      client_load_next_pending, NULL);
+
+    pressure_level = level;
+    if (level == PRESSURE_NONE)
+    {
+        pressure_timer = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Maps the share of time tasks stalled on memory over the last 10 s,
+ * and how close our cgroup is to its limit, to a pressure level. */
+gint
+memory_pressure_level(void)
+{
+    gchar *contents, *p;
+    gdouble avg10 = 0;
+    guint64 current, max;
+    gint level = PRESSURE_NONE;
+
+    if (g_file_get_contents(pressure_file, &contents, NULL, NULL))
+    {
+        if ((p = strstr(contents, "some avg10=")) != NULL)
+            avg10 = g_ascii_strtod(p + strlen("some avg10="), NULL);
+        g_free(contents);
+    }
+
+    if (avg10 >= PRESSURE_DISCARD_PCT)
+        level = PRESSURE_DISCARD;
+    else if (avg10 >= PRESSURE_FREEZE_PCT)
+        level = PRESSURE_FREEZE;
+    else if (avg10 >= PRESSURE_CLEAR_CACHE_PCT)
+        level = PRESSURE_CLEAR_CACHE;
+
+    /* The OOM killer doesn't wait for stalls. */
+    if (cgroup_memory(&current, &max))
+    {
+        if (current >= max / 100 * PRESSURE_CGROUP_DISCARD_PCT)
+            level = MAX(level, PRESSURE_DISCARD);
+        else if (current >= max / 100 * PRESSURE_CGROUP_FREEZE_PCT)
+            level = MAX(level, PRESSURE_FREEZE);
+    }
+
+    return level;
+}
+
+/* Memory used by our cgroup and its limit. Fails without a limit. */
+gboolean
+cgroup_memory(guint64 *current, guint64 *max)
+{
+    gchar *contents, *path;
+    gboolean ok = FALSE;
+
+    if (pressure_cgroup == NULL)
+        return FALSE;
+
+    path = g_build_filename(pressure_cgroup, "memory.max", NULL);
+    *max = 0;
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+    {
+        *max = g_ascii_strtoull(contents, NULL, 10);  // 0 for "max"
+        g_free(contents);
+    }
+    g_free(path);
+
+    path = g_build_filename(pressure_cgroup, "memory.current", NULL);
+    if (*max > 0 && g_file_get_contents(path, &contents, NULL, NULL))
+    {
+        *current = g_ascii_strtoull(contents, NULL, 10);
+        ok = TRUE;
+        g_free(contents);
+    }
+    g_free(path);
+
+    return ok;
+}
+
+/* Loads the oldest pending tab, and the next one a little later. */
+gboolean
+client_load_next_pending(gpointer data)
+{
+    /* memory_pressure_check() starts us again. */
+    if (pressure_level >= PRESSURE_FREEZE)
+    {
+        pending_timer = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!g_queue_is_empty(&pending_clients))
+        client_load_pending(g_queue_peek_head(&pending_clients));
+
+    if (g_queue_is_empty(&pending_clients))
+        pending_timer = 0;
+    else
+        pending_timer = g_timeout_add(BACKGROUND_TAB_INTERVAL_MS,
+                                      client_load_next_pending, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+web_view_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event, gpointer user_data)
+{
+    struct Client *c = (struct Client *)user_data;
+
+    if (pageload_hosts != NULL)
+        pageload_changed(web_view, load_event);
+
+    /* Each navigation is a track of its own in the trace, split into
+     * its provisional and committed phase. A navigation that fails
+     * before it commits, or is replaced by another one, ends in
+     * whatever phase it got to. */
+    if (load_event == WEBKIT_LOAD_STARTED)
+    {
+        trace_navigation_end(c);
+        trace_async('b', "navigation", GPOINTER_TO_SIZE(web_view), webkit_web_view_get_uri(web_view));
+        trace_async('b', "provisional", GPOINTER_TO_SIZE(web_view), NULL);
+        c->trace_phase = TRACE_PHASE_PROVISIONAL;
+    }
+    else if (load_event == WEBKIT_LOAD_REDIRECTED)
+        trace_async('n', "redirect", GPOINTER_TO_SIZE(web_view), webkit_web_view_get_uri(web_view));
+    else if (load_event == WEBKIT_LOAD_COMMITTED) {
+        log_debug("Load committed: %s", webkit_web_view_get_uri(web_view));
+        if (c->trace_phase == TRACE_PHASE_PROVISIONAL)
+        {
+            trace_async('e', "provisional", GPOINTER_TO_SIZE(web_view), NULL);
+            trace_async('b', "committed", GPOINTER_TO_SIZE(web_view), NULL);
+            c->trace_phase = TRACE_PHASE_COMMITTED;
+        }
+
+        /* A view that isn't shown is first drawn when the user switches
+         * to it, which says nothing about the page. */
+        g_signal_handlers_disconnect_by_func(web_view, web_view_first_draw, NULL);
+        if ((trace_on() || pageload_hosts != NULL) &&
+            gtk_widget_get_mapped(GTK_WIDGET(web_view)))
+            g_signal_connect_after(G_OBJECT(web_view), "draw",
+                                   G_CALLBACK(web_view_first_draw), NULL);
+    }
+    else if (load_event == WEBKIT_LOAD_FINISHED)
+    {
+        log_debug("Load finished: %s", webkit_web_view_get_uri(web_view));
+        session_tab_changed(c);
+        trace_navigation_end(c);
+    }
+}
+
+/* Marks the first time the web view is drawn after a load committed.
+ * WebKit keeps showing the previous page until the new one has a
+ * visually non-empty layout, so this is when it shows up. */
+gboolean
+web_view_first_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    struct PageLoad *l;
+
+    g_signal_handlers_disconnect_by_func(widget, web_view_first_draw, data);
+    trace_async('n', "first_draw", GPOINTER_TO_SIZE(widget), NULL);
+
+    if (pageload_hosts != NULL)
+    {
+        l = pageload_get(WEBKIT_WEB_VIEW(widget));
+        if (l->start != 0 && l->paint == 0)
+            l->paint = g_get_monotonic_time();
+    }
+
+    return FALSE;
+}
+
+/* The hints script is compiled into a WebKitUserScript once and then
+ * shared by all user content managers. WebKit injects it into each new
+ * document at document start, so hints are ready before a page has
+ * finished loading and no per-load IPC or JS evaluation is needed.
+ * Configuration is passed in as arguments of the outer function. */
+WebKitUserScript *
+hints_user_script(void)
+{
+    static WebKitUserScript *script = NULL;
+    GString *source;
+
+    if (script != NULL)
+        return script;
+
+    const char *hints_script =
+        "// Anonymous function to get private namespace.\n"
+        "(function(charset, key_follow, key_follow_new_win) {\n"
+        "    /* All labels live in one overlay that is built while detached from\n"
+        "     * the document and then attached in one go. Only elements that are\n"
+        "     * currently in the viewport get a label; the overlay is rebuilt\n"
+        "     * when the page is scrolled while hints are active.\n"
+        "     *\n"
+        "     * Labels are kept in a prefix trie over the charset, and the overlay\n"
+        "     * mirrors it: every inner node is a container holding the subtrees\n"
+        "     * of its children, labels are the leaves. While the user types, the\n"
+        "     * overlay is hidden as a whole and only the node for the typed prefix\n"
+        "     * is made visible again, so a keystroke moves one class from one node\n"
+        "     * to another instead of touching every label. */\n"
+        "    var css =\n"
+        "        \"#lariza-hints, #lariza-hints div { all: initial; visibility: inherit; }\" +\n"
+        "        \"#lariza-hints { position: fixed; left: 0; top: 0; width: 0; height: 0;\" +\n"
+        "        \"  z-index: 2147483647; pointer-events: none; visibility: visible; }\" +\n"
+        "        \"#lariza-hints.f { visibility: hidden; }\" +\n"
+        "        \"#lariza-hints.f .cur { visibility: visible; }\" +\n"
+        "        \"#lariza-hints div.l { position: absolute; box-sizing: border-box; }\" +\n"
+        "        \"#lariza-hints div.l::before { all: initial; content: attr(data-id);\" +\n"
+        "        \"  position: absolute; left: -2pt; top: -2pt; padding: 0 3pt;\" +\n"
+        "        \"  border: black 1pt solid; border-radius: 10pt; color: black;\" +\n"
+        "        \"  background: #A7FFF5; font: normal 10pt monospace; white-space: nowrap;\" +\n"
+        "        \"  text-transform: lowercase; }\" +\n"
+        "        \"#lariza-hints.new div::before { background: #DAFFAD; }\" +\n"
+        "        \"#lariza-hints.f .cur div.l { box-shadow: 0 0 5pt 2pt black, 0 0 0 2pt #B00000 inset; }\" +\n"
+        "        \"#lariza-hints.f div.l.cur { box-shadow: 0 0 5pt 2pt black, 0 0 0 2pt red inset; }\" +\n"
+        "        \"#lariza-hints.f div.l.cur::before { background: #33FF00;\" +\n"
+        "        \"  content: attr(data-id) attr(data-href); }\" +\n"
+        "        \"#lariza-hints.new.f div.l.cur::before { background: #FF5D00; }\";\n"
         "\n"
-        "        for (var id in document.lariza_hints.labels)\n"
-        "        {\n"
-        "            var label = document.lariza_hints.labels[id];\n"
-        "            var bgcol = col_unsel;\n"
+        "    function lookup(value)\n"
+        "    {\n"
+        "        var node = document.lariza_hints.trie;\n"
         "\n"
-        "            longest_id = Math.max(longest_id, id.length);\n"
+        "        for (var i = 0; node !== undefined && i < value.length; i++)\n"
+        "            node = node.children[value[i]];\n"
         "\n"
-        "            if (document.lariza_hints.box.value !== \"\")\n"
-        "            {\n"
-        "                submatch = id.match(\"^\" + document.lariza_hints.box.value);\n"
-        "                if (submatch !== null)\n"
-        "                {\n"
-        "                    var href_suffix = \"\";\n"
-        "                    var box_shadow_inner = \"#B00000\";\n"
-        "                    if (id === document.lariza_hints.box.value)\n"
-        "                    {\n"
-        "                        bgcol = col_sel;\n"
-        "                        box_shadow_inner = \"red\";\n"
-        "                        if (label.elem.tagName.toLowerCase() === \"a\")\n"
-        "                            href_suffix = \": <span style='font-size: 75%'>\" +\n"
-        "                                          label.elem.href + \"</span>\";\n"
-        "                    }\n"
+        "        return node;\n"
+        "    }\n"
         "\n"
-        "                    var len = submatch[0].length;\n"
-        "                    label.span.innerHTML = \"<b>\" + submatch[0] + \"</b>\" +\n"
-        "                                           id.substring(len, id.length) +\n"
-        "                                           href_suffix;\n"
-        "                    label.span.style.visibility = \"visible\";\n"
+        "    function update_highlights_or_abort()\n"
+        "    {\n"
+        "        var value = document.lariza_hints.box.value;\n"
+        "        var node = lookup(value);\n"
         "\n"
-        "                    save_parent_style(label);\n"
-        "                    label.elem.style.boxShadow = \"0 0 5pt 2pt black, 0 0 0 2pt \" +\n"
-        "                                                 box_shadow_inner + \" inset\";\n"
-        "                }\n"
-        "                else\n"
-        "                {\n"
-        "                    label.span.style.visibility = \"hidden\";\n"
-        "                    reset_parent_style(label);\n"
-        "                }\n"
-        "            }\n"
-        "            else\n"
-        "            {\n"
-        "                label.span.style.visibility = \"visible\";\n"
-        "                label.span.innerHTML = id;\n"
-        "                reset_parent_style(label);\n"
-        "            }\n"
-        "            label.span.style.backgroundColor = bgcol;\n"
+        "        if (node === undefined)\n"
+        "        {\n"
+        "            set_state(\"inactive\");\n"
+        "            return;\n"
         "        }\n"
         "\n"
-        "        if (document.lariza_hints.box.value.length > longest_id)\n"
-        "            set_state(\"inactive\");\n"
+        "        if (document.lariza_hints.cur !== null)\n"
+        "            document.lariza_hints.cur.div.classList.remove(\"cur\");\n"
+        "        document.lariza_hints.cur = null;\n"
+        "\n"
+        "        if (value === \"\")\n"
+        "            document.lariza_hints.overlay.classList.remove(\"f\");\n"
+        "        else\n"
+        "        {\n"
+        "            node.div.classList.add(\"cur\");\n"
+        "            document.lariza_hints.cur = node;\n"
+        "            document.lariza_hints.overlay.classList.add(\"f\");\n"
+        "        }\n"
         "    }\n"
         "\n"
         "    function open_match()\n"
         "    {\n"
-        "        console.log('[hints] open_match called');\n"
-        "        var choice = document.lariza_hints.box.value;\n"
+        "        var label = lookup(document.lariza_hints.box.value);\n"
         "        var was_state = document.lariza_hints.state;\n"
         "\n"
-        "        var elem = document.lariza_hints.labels[choice].elem;\n"
-        "        set_state(\"inactive\");  /* Nukes labels. */\n"
+        "        if (label === undefined || label.elem === undefined)\n"
+        "            return;\n"
         "\n"
-        "        if (elem)\n"
-        "        {\n"
-        "            var tag_name = elem.tagName.toLowerCase();\n"
-        "            var type = elem.type ? elem.type.toLowerCase() : \"\";\n"
+        "        var elem = label.elem;\n"
+        "        set_state(\"inactive\");  /* Nukes labels. */\n"
         "\n"
-        "            console.log(\"[hints] Selected elem [\" + elem + \"] [\" + tag_name +\n"
-        "                        \"] [\" + type + \"]\");\n"
+        "        var tag_name = elem.tagName.toLowerCase();\n"
+        "        var type = elem.type ? elem.type.toLowerCase() : \"\";\n"
         "\n"
-        "            if (was_state === \"follow_new\" && tag_name === \"a\")\n"
-        "                window.open(elem.href);\n"
-        "            else if (\n"
-        "                (\n"
-        "                    tag_name === \"input\" &&\n"
-        "                    type !== \"button\" &&\n"
-        "                    type !== \"color\" &&\n"
-        "                    type !== \"checkbox\" &&\n"
-        "                    type !== \"file\" &&\n"
-        "                    type !== \"radio\" &&\n"
-        "                    type !== \"reset\" &&\n"
-        "                    type !== \"submit\"\n"
-        "                ) ||\n"
-        "                tag_name === \"textarea\" ||\n"
-        "                tag_name === \"select\"\n"
-        "            )\n"
-        "                elem.focus();\n"
-        "            else\n"
-        "                elem.click();\n"
-        "        }\n"
+        "        if (was_state === \"follow_new\" && tag_name === \"a\")\n"
+        "            window.open(elem.href);\n"
+        "        else if (\n"
+        "            (\n"
+        "                tag_name === \"input\" &&\n"
+        "                type !== \"button\" &&\n"
+        "                type !== \"color\" &&\n"
+        "                type !== \"checkbox\" &&\n"
+        "                type !== \"file\" &&\n"
+        "                type !== \"radio\" &&\n"
+        "                type !== \"reset\" &&\n"
+        "                type !== \"submit\"\n"
+        "            ) ||\n"
+        "            tag_name === \"textarea\" ||\n"
+        "            tag_name === \"select\"\n"
+        "        )\n"
+        "            elem.focus();\n"
+        "        else\n"
+        "            elem.click();\n"
         "    }\n"
         "\n"
         "    function set_state(new_state)\n"
         "    {\n"
-        "        console.log('[hints] set_state called with state: ' + new_state);\n"
         "        document.lariza_hints.state = new_state;\n"
         "\n"
         "        if (document.lariza_hints.state === \"inactive\")\n"
@@ -487,7 +2799,7 @@ void inject_hints_script(WebKitWebView *web_view)
         "        }\n"
         "        else\n"
         "        {\n"
-        "            if (document.lariza_hints.labels === null)\n"
+        "            if (document.lariza_hints.trie === null)\n"
         "                create_labels();\n"
         "\n"
         "            var box = document.lariza_hints.box;\n"
@@ -498,10 +2810,7 @@ void inject_hints_script(WebKitWebView *web_view)
         "\n"
         "                box.addEventListener(\"keydown\", on_box_key);\n"
         "                box.addEventListener(\"input\", on_box_input);\n"
-        "                box.style.opacity = \"0\";\n"
-        "                box.style.position = \"fixed\";\n"
-        "                box.style.left = \"0px\";\n"
-        "                box.style.top = \"0px\";\n"
+        "                box.style.cssText = \"opacity: 0; position: fixed; left: 0px; top: 0px;\";\n"
         "                box.type = \"text\";\n"
         "\n"
         "                box.setAttribute(\"lariza_input_box\", \"yes\");\n"
@@ -510,17 +2819,26 @@ void inject_hints_script(WebKitWebView *web_view)
         "            }\n"
         "\n"
         "            box.style.visibility = \"visible\";\n"
-        "            box.focus();\n"
+        "            box.focus({ preventScroll: true });\n"
         "        }\n"
+        "    }\n"
         "\n"
-        "        update_highlights_or_abort();\n"
+        "    function label_id(i, digits)\n"
+        "    {\n"
+        "        var id = \"\";\n"
+        "\n"
+        "        /* All labels have the same length, so no label is a prefix of\n"
+        "         * another one. */\n"
+        "        while (digits-- > 0)\n"
+        "        {\n"
+        "            id = charset[i % charset.length] + id;\n"
+        "            i = Math.floor(i / charset.length);\n"
+        "        }\n"
+        "        return id;\n"
         "    }\n"
         "\n"
         "    function create_labels()\n"
         "    {\n"
-        "        console.log('[hints] create_labels called');\n"
-        "        document.lariza_hints.labels = new Object();\n"
-        "\n"
         "        var selector = \"a[href]:not([href=''])\";\n"
         "        if (document.lariza_hints.state !== \"follow_new\")\n"
         "        {\n"
@@ -528,91 +2846,104 @@ void inject_hints_script(WebKitWebView *web_view)
         "            selector += \", textarea, select, button\";\n"
         "        }\n"
         "\n"
+        "        /* Only read geometry here, never write. This way, the whole\n"
+        "         * loop needs at most one layout pass. */\n"
         "        var elements = document.body.querySelectorAll(selector);\n"
+        "        var vw = window.innerWidth, vh = window.innerHeight;\n"
+        "        var visible = [];\n"
         "\n"
         "        for (var i = 0; i < elements.length; i++)\n"
         "        {\n"
-        "            var elem = elements[i];\n"
+        "            var r = elements[i].getBoundingClientRect();\n"
+        "            if (r.bottom < 0 || r.right < 0 || r.top > vh || r.left > vw ||\n"
+        "                (r.width === 0 && r.height === 0))\n"
+        "                continue;\n"
+        "            visible.push({ \"elem\": elements[i], \"rect\": r });\n"
+        "        }\n"
         "\n"
-        "            var label_id = \"\";\n"
-        "            var n = i;\n"
-        "            do\n"
-        "            {\n"
-        "                label_id += charset[n % charset.length];\n"
-        "                n = Math.floor(n / charset.length);\n"
-        "            } while (n !== 0);\n"
+        "        var digits = 1;\n"
+        "        while (Math.pow(charset.length, digits) < visible.length)\n"
+        "            digits++;\n"
         "\n"
-        "            var span = document.createElement(\"span\");\n"
-        "            span.style.border = \"black 1pt solid\";\n"
-        "            span.style.color = \"black\";\n"
-        "            span.style.fontFamily = \"monospace\";\n"
-        "            span.style.fontSize = \"10pt\";\n"
-        "            span.style.fontWeight = \"normal\";\n"
-        "            span.style.margin = \"0px 2pt\";\n"
-        "            span.style.position = \"absolute\";\n"
-        "            span.style.textTransform = \"lowercase\";\n"
-        "            span.style.visibility = \"hidden\";\n"
-        "            span.style.zIndex = \"2147483647\";\n"
+        "        var overlay = document.createElement(\"div\");\n"
+        "        overlay.id = \"lariza-hints\";\n"
+        "        if (document.lariza_hints.state === \"follow_new\")\n"
+        "            overlay.className = \"new\";\n"
         "\n"
-        "            document.lariza_hints.labels[label_id] = {\n"
-        "                \"elem\": elem,\n"
-        "                \"span\": span,\n"
-        "                \"parent_style\": null,\n"
-        "            };\n"
+        "        var style = document.createElement(\"style\");\n"
+        "        style.textContent = css;\n"
+        "        overlay.appendChild(style);\n"
         "\n"
-        "            var tag_name = elem.tagName.toLowerCase();\n"
-        "            if (tag_name === \"a\")\n"
-        "            {\n"
-        "                span.style.borderTopLeftRadius = \"10pt\";\n"
-        "                span.style.borderBottomLeftRadius = \"10pt\";\n"
-        "                span.style.padding = \"0px 2pt 0px 5pt\";\n"
-        "                elem.appendChild(span);\n"
-        "            }\n"
-        "            else\n"
+        "        var trie = { \"div\": overlay, \"children\": new Object() };\n"
+        "\n"
+        "        for (var i = 0; i < visible.length; i++)\n"
+        "        {\n"
+        "            var elem = visible[i].elem;\n"
+        "            var r = visible[i].rect;\n"
+        "            var id = label_id(i, digits);\n"
+        "            var node = trie;\n"
+        "\n"
+        "            /* Labels are created in order, so all but the last node on\n"
+        "             * the path usually exist already. */\n"
+        "            for (var d = 0; d < id.length; d++)\n"
         "            {\n"
-        "                span.style.borderRadius = \"10pt\";\n"
-        "                span.style.padding = \"0px 5pt\";\n"
-        "                elem.parentNode.insertBefore(span, elem);\n"
+        "                var child = node.children[id[d]];\n"
+        "                if (child === undefined)\n"
+        "                {\n"
+        "                    child = { \"div\": document.createElement(\"div\"),\n"
+        "                              \"children\": new Object() };\n"
+        "                    node.div.appendChild(child.div);\n"
+        "                    node.children[id[d]] = child;\n"
+        "                }\n"
+        "                node = child;\n"
         "            }\n"
         "\n"
-        "            console.log(\"[hints] Label ID \" + label_id + \", \" + i +\n"
-        "                        \" for elem [\" + elem + \"]\");\n"
+        "            var div = node.div;\n"
+        "            div.className = \"l\";\n"
+        "            div.setAttribute(\"data-id\", id);\n"
+        "            if (elem.tagName.toLowerCase() === \"a\")\n"
+        "                div.setAttribute(\"data-href\", \": \" + elem.href);\n"
+        "            div.style.cssText = \"left: \" + r.left + \"px; top: \" + r.top + \"px; \" +\n"
+        "                                \"width: \" + r.width + \"px; height: \" + r.height + \"px;\";\n"
+        "            node.elem = elem;\n"
         "        }\n"
+        "\n"
+        "        (document.body || document.documentElement).appendChild(overlay);\n"
+        "        document.lariza_hints.overlay = overlay;\n"
+        "        document.lariza_hints.trie = trie;\n"
+        "        document.lariza_hints.cur = null;\n"
+        "\n"
+        "        window.addEventListener(\"scroll\", on_scroll, { passive: true });\n"
         "    }\n"
         "\n"
         "    function nuke_labels()\n"
         "    {\n"
-        "        console.log('[hints] nuke_labels called');\n"
-        "        for (var id in document.lariza_hints.labels)\n"
-        "        {\n"
-        "            var label = document.lariza_hints.labels[id];\n"
-        "\n"
-        "            reset_parent_style(label);\n"
+        "        if (document.lariza_hints.overlay !== null)\n"
+        "            document.lariza_hints.overlay.remove();\n"
         "\n"
-        "            var tag_name = label.elem.tagName.toLowerCase();\n"
-        "            if (tag_name === \"a\")\n"
-        "                label.elem.removeChild(label.span);\n"
-        "            else\n"
-        "                label.elem.parentNode.removeChild(label.span);\n"
-        "        }\n"
+        "        window.removeEventListener(\"scroll\", on_scroll, { passive: true });\n"
         "\n"
-        "        document.lariza_hints.labels = null;\n"
+        "        document.lariza_hints.overlay = null;\n"
+        "        document.lariza_hints.trie = null;\n"
+        "        document.lariza_hints.cur = null;\n"
         "    }\n"
         "\n"
-        "    function reset_parent_style(label)\n"
+        "    function on_scroll(e)\n"
         "    {\n"
-        "        if (label.parent_style !== null)\n"
-        "            label.elem.style.boxShadow = label.parent_style.boxShadow;\n"
-        "    }\n"
+        "        if (document.lariza_hints.relabel)\n"
+        "            return;\n"
         "\n"
-        "    function save_parent_style(label)\n"
-        "    {\n"
-        "        if (label.parent_style === null)\n"
-        "        {\n"
-        "            var style = window.getComputedStyle(label.elem);\n"
-        "            label.parent_style = new Object();\n"
-        "            label.parent_style.boxShadow = style.getPropertyValue(\"boxShadow\");\n"
-        "        }\n"
+        "        /* Coalesce scroll events, relabel at most once per frame. */\n"
+        "        document.lariza_hints.relabel = true;\n"
+        "        window.requestAnimationFrame(function() {\n"
+        "            document.lariza_hints.relabel = false;\n"
+        "            if (document.lariza_hints.state === \"inactive\")\n"
+        "                return;\n"
+        "\n"
+        "            nuke_labels();\n"
+        "            create_labels();\n"
+        "            document.lariza_hints.box.value = \"\";\n"
+        "        });\n"
         "    }\n"
         "\n"
         "    function on_box_input(e)\n"
@@ -638,7 +2969,6 @@ void inject_hints_script(WebKitWebView *web_view)
         "\n"
         "    function on_window_key(e)\n"
         "    {\n"
-        "        console.log('[hints] on_window_key called with key: ' + e.key);\n"
         "        if (e.target.nodeName.toLowerCase() === \"textarea\" ||\n"
         "            e.target.nodeName.toLowerCase() === \"input\" ||\n"
         "            document.designMode === \"on\" ||\n"
@@ -660,230 +2990,3173 @@ void inject_hints_script(WebKitWebView *web_view)
         "    {\n"
         "        document.lariza_hints = new Object();\n"
         "        document.lariza_hints.box = null;\n"
-        "        document.lariza_hints.labels = null;\n"
+        "        document.lariza_hints.cur = null;\n"
+        "        document.lariza_hints.overlay = null;\n"
+        "        document.lariza_hints.relabel = false;\n"
         "        document.lariza_hints.state = \"inactive\";\n"
+        "        document.lariza_hints.trie = null;\n"
         "\n"
         "        document.addEventListener(\"keyup\", on_window_key);\n"
-        "\n"
-        "        console.log(\"[hints] Initialized.\");\n"
         "    }\n"
-        "    else\n"
-        "        console.log(\"[hints] ALREADY INSTALLED\");\n"
         "\n"
-        "})();\n"
-        "\n";
+        "})";
+
+    source = g_string_new(hints_script);
+    g_string_append_c(source, '(');
+    json_append_string(source, HINT_CHARSET);
+    g_string_append(source, ".split(\"\"), ");
+    json_append_string(source, HINT_FOLLOW_KEY);
+    g_string_append(source, ", ");
+    json_append_string(source, HINT_FOLLOW_NEW_WIN_KEY);
+    g_string_append(source, ");\n");
+
+    script = webkit_user_script_new(source->str,
+                                    WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+                                    WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+                                    NULL, NULL);
+    g_string_free(source, TRUE);
+
+    return script;
+}
+
+/* Adblocking is done by WebKit itself: EasyList/uBlock Origin style
+ * lists are translated into WebKit's content rule JSON, compiled once
+ * by a WebKitUserContentFilterStore and then attached to every tab.
+ * Compiling a big list takes several seconds, so the compiled result is
+ * kept in the store under a key derived from the list contents. As long
+ * as the lists don't change, a restart only has to load it. */
+void
+adblock_setup(void)
+{
+    gchar *p;
+    GTask *task;
+
+    if (!ENABLE_ADBLOCK)
+        return;
+
+    p = g_build_filename(g_get_user_cache_dir(), NAME, "adblock", NULL);
+    adblock_store = webkit_user_content_filter_store_new(p);
+    g_free(p);
+
+    /* Reading and hashing several MB of lists shouldn't delay the first
+     * window, so do it in a worker thread. */
+    task = g_task_new(NULL, NULL, adblock_read_finished, NULL);
+    g_task_run_in_thread(task, adblock_read_thread);
+    g_object_unref(task);
+}
+
+gint
+adblock_compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+void
+adblock_read_thread(GTask *task, gpointer source, gpointer data,
+                    GCancellable *cancellable)
+{
+    struct AdblockSource *src;
+    GPtrArray *files;
+    GChecksum *sum;
+    GDir *dir;
+    const gchar *entry;
+    gchar *base, *contents, *line, *next, *end, *copy;
+    gsize len;
+    guint i;
+
+    files = g_ptr_array_new_with_free_func(g_free);
+
+    /* ~/.config/cream/adblock may either be a single list (the old
+     * we_adblock.so location) or a directory full of lists. */
+    base = g_build_filename(g_get_user_config_dir(), NAME, "adblock", NULL);
+    if (g_file_test(base, G_FILE_TEST_IS_DIR))
+    {
+        dir = g_dir_open(base, 0, NULL);
+        if (dir != NULL)
+        {
+            while ((entry = g_dir_read_name(dir)) != NULL)
+                if (entry[0] != '.')
+                    g_ptr_array_add(files, g_build_filename(base, entry, NULL));
+            g_dir_close(dir);
+        }
+        /* The key must not depend on readdir() order. */
+        g_ptr_array_sort(files, adblock_compare_names);
+    }
+    else if (g_file_test(base, G_FILE_TEST_IS_REGULAR))
+        g_ptr_array_add(files, g_strdup(base));
+    g_free(base);
+
+    src = g_slice_new0(struct AdblockSource);
+    src->contents = g_string_new(NULL);
+    src->cosmetic_generic = g_ptr_array_new_with_free_func(g_free);
+    src->cosmetic_hide = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)g_ptr_array_unref);
+    src->cosmetic_unhide = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify)g_ptr_array_unref);
+    sum = g_checksum_new(G_CHECKSUM_SHA256);
+
+    for (i = 0; i < files->len; i++)
+    {
+        if (!g_file_get_contents(g_ptr_array_index(files, i), &contents, &len, NULL))
+        {
+            log_error("Could not read adblock list '%s'",
+                      (gchar *)g_ptr_array_index(files, i));
+            continue;
+        }
+        g_checksum_update(sum, (guchar *)contents, len);
+        g_string_append_len(src->contents, contents, len);
+        g_string_append_c(src->contents, '\n');
+        g_free(contents);
+    }
+
+    src->identifier = g_strdup_printf("adblock-v%d-%s", ADBLOCK_CONVERTER_VERSION,
+                                      g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    g_ptr_array_free(files, TRUE);
+
+    /* Cosmetic filters are not compiled by WebKit. Parsing them is
+     * cheap, so this is done on every start. */
+    end = src->contents->str + src->contents->len;
+    for (line = src->contents->str; line < end; line = next + 1)
+    {
+        next = memchr(line, '\n', end - line);
+        if (next == NULL)
+            next = end;
+        if (memchr(line, '#', next - line) != NULL)
+        {
+            copy = g_strndup(line, next - line);
+            cosmetic_parse_line(copy, src);
+            g_free(copy);
+        }
+    }
+
+    if (src->contents->len == 0)
+    {
+        adblock_source_free(src);
+        src = NULL;
+    }
+
+    g_task_return_pointer(task, src, adblock_source_free);
+}
+
+void
+adblock_read_finished(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    struct AdblockSource *src;
+
+    src = g_task_propagate_pointer(G_TASK(result), NULL);
+    if (src == NULL)
+        return;
+
+    cosmetic_add_sheets(src);
+
+    /* Old compiled lists are of no use anymore, drop them. */
+    webkit_user_content_filter_store_fetch_identifiers(adblock_store, NULL,
+                                                       adblock_prune,
+                                                       g_strdup(src->identifier));
+
+    webkit_user_content_filter_store_load(adblock_store, src->identifier, NULL,
+                                          adblock_filter_loaded, src);
+}
+
+void
+adblock_filter_loaded(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    struct AdblockSource *src = (struct AdblockSource *)data;
+    WebKitUserContentFilter *filter;
+    GTask *task;
+
+    filter = webkit_user_content_filter_store_load_finish(
+        WEBKIT_USER_CONTENT_FILTER_STORE(obj), result, NULL);
+    if (filter != NULL)
+    {
+        adblock_filter_ready(filter);
+        adblock_source_free(src);
+        return;
+    }
+
+    /* Cache miss: the lists are new or have changed. */
+    log_info("Compiling adblock lists, this may take a while");
+    task = g_task_new(NULL, NULL, adblock_convert_finished, NULL);
+    g_task_set_task_data(task, src, adblock_source_free);
+    g_task_run_in_thread(task, adblock_convert_thread);
+    g_object_unref(task);
+}
+
+void
+adblock_convert_thread(GTask *task, gpointer source, gpointer data,
+                       GCancellable *cancellable)
+{
+    struct AdblockSource *src = (struct AdblockSource *)data;
+
+    g_task_return_pointer(task, adblock_convert(src->contents->str), g_free);
+}
+
+void
+adblock_convert_finished(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    struct AdblockSource *src;
+    GBytes *json;
+    gchar *rules;
+
+    src = g_task_get_task_data(G_TASK(result));
+    rules = g_task_propagate_pointer(G_TASK(result), NULL);
+    if (rules == NULL)
+    {
+        log_warn("No usable rules in adblock lists");
+        return;
+    }
+
+    json = g_bytes_new_take(rules, strlen(rules));
+    webkit_user_content_filter_store_save(adblock_store, src->identifier, json,
+                                          NULL, adblock_filter_saved, NULL);
+    g_bytes_unref(json);
+}
+
+void
+adblock_filter_saved(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    WebKitUserContentFilter *filter;
+    GError *err = NULL;
+
+    filter = webkit_user_content_filter_store_save_finish(
+        WEBKIT_USER_CONTENT_FILTER_STORE(obj), result, &err);
+    if (filter == NULL)
+    {
+        log_error("Could not compile adblock lists: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    adblock_filter_ready(filter);
+}
+
+void
+adblock_filter_ready(WebKitUserContentFilter *filter)
+{
+    adblock_filter = filter;
+    webkit_user_content_manager_add_filter(user_content, adblock_filter);
+}
+
+void
+adblock_prune(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    gchar *keep = (gchar *)data;
+    gchar **ids;
+    guint i;
+
+    ids = webkit_user_content_filter_store_fetch_identifiers_finish(
+        WEBKIT_USER_CONTENT_FILTER_STORE(obj), result);
+    for (i = 0; ids != NULL && ids[i] != NULL; i++)
+        if (g_str_has_prefix(ids[i], "adblock-") && strcmp(ids[i], keep) != 0)
+            webkit_user_content_filter_store_remove(
+                WEBKIT_USER_CONTENT_FILTER_STORE(obj), ids[i], NULL, NULL, NULL);
+
+    g_strfreev(ids);
+    g_free(keep);
+}
+
+void
+adblock_source_free(gpointer data)
+{
+    struct AdblockSource *src = (struct AdblockSource *)data;
+
+    if (src == NULL)
+        return;
+
+    g_free(src->identifier);
+    g_string_free(src->contents, TRUE);
+    if (src->cosmetic_generic != NULL)
+        g_ptr_array_unref(src->cosmetic_generic);
+    if (src->cosmetic_hide != NULL)
+        g_hash_table_unref(src->cosmetic_hide);
+    if (src->cosmetic_unhide != NULL)
+        g_hash_table_unref(src->cosmetic_unhide);
+    g_slice_free(struct AdblockSource, src);
+}
+
+/* Translates the given lists (modified in place) into a JSON array of
+ * WebKit content rules. Exceptions have to come after all blocking
+ * rules because "ignore-previous-rules" only affects earlier rules.
+ * Returns NULL if nothing could be translated. */
+gchar *
+adblock_convert(gchar *lists)
+{
+    GString *blocks, *exceptions;
+    gchar *line, *next;
+    guint n = 0;
+
+    blocks = g_string_new("[");
+    exceptions = g_string_new(NULL);
+
+    for (line = lists; line != NULL; line = next)
+    {
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = 0;
+
+        if (n == ADBLOCK_MAX_RULES)
+        {
+            log_warn("Adblock lists exceed %d rules, ignoring the rest",
+                     ADBLOCK_MAX_RULES);
+            break;
+        }
+
+        if (adblock_convert_line(line, blocks, exceptions))
+            n++;
+    }
+
+    if (n == 0)
+    {
+        g_string_free(blocks, TRUE);
+        g_string_free(exceptions, TRUE);
+        return NULL;
+    }
+
+    if (exceptions->len > 0)
+    {
+        if (blocks->len > 1)
+            g_string_append_c(blocks, ',');
+        g_string_append_len(blocks, exceptions->str, exceptions->len);
+    }
+    g_string_append_c(blocks, ']');
+    g_string_free(exceptions, TRUE);
+
+    return g_string_free(blocks, FALSE);
+}
+
+static const struct {
+    const gchar *option;
+    guint types;
+} adblock_type_options[] = {
+    { "document",       1 << 0 },
+    { "doc",            1 << 0 },
+    { "subdocument",    1 << 0 },
+    { "frame",          1 << 0 },
+    { "image",          1 << 1 },
+    { "stylesheet",     1 << 2 },
+    { "css",            1 << 2 },
+    { "script",         1 << 3 },
+    { "font",           1 << 4 },
+    { "xmlhttprequest", 1 << 5 },
+    { "xhr",            1 << 5 },
+    { "websocket",      1 << 5 },
+    { "object",         1 << 5 },
+    { "ping",           1 << 5 },
+    { "other",          1 << 5 },
+    { "media",          1 << 6 },
+    { "popup",          1 << 7 },
+};
+
+/* Indexed by bit, as used in adblock_type_options[]. */
+static const gchar *adblock_type_names[] = {
+    "document", "image", "style-sheet", "script", "font", "raw", "media", "popup",
+};
+
+#define ADBLOCK_TYPES_ALL ((1 << LENGTH(adblock_type_names)) - 1)
+
+/* Translates one line of a filter list. Cosmetic filters, comments and
+ * anything WebKit can't express (regular expression rules, redirects,
+ * CSP injection, ...) are skipped. */
+gboolean
+adblock_convert_line(gchar *line, GString *blocks, GString *exceptions)
+{
+    GString *out, *re, *if_domain, *unless_domain;
+    gchar *pattern, *options, *opt, *next, *host;
+    const gchar *load_type = NULL;
+    gboolean exception = FALSE, match_case = FALSE, whole_page = FALSE;
+    gboolean negate, ok = TRUE;
+    guint types = 0, not_types = 0, i;
+    gsize len;
+
+    g_strstrip(line);
+    if (line[0] == 0 || line[0] == '!' || line[0] == '[')
+        return FALSE;
+
+    /* Element hiding and scriptlets. */
+    if (strstr(line, "##") || strstr(line, "#@#") || strstr(line, "#?#") ||
+        strstr(line, "#$#") || strstr(line, "#%#"))
+        return FALSE;
+
+    /* Network filters never contain blanks. This skips hosts files and
+     * other foreign syntax. */
+    if (strpbrk(line, " \t") != NULL)
+        return FALSE;
+
+    pattern = line;
+    if (g_str_has_prefix(pattern, "@@"))
+    {
+        exception = TRUE;
+        pattern += 2;
+    }
+
+    options = strrchr(pattern, '$');
+    if (options != NULL)
+        *options++ = 0;
+
+    len = strlen(pattern);
+    if (len > 1 && pattern[0] == '/' && pattern[len - 1] == '/')
+        return FALSE;
+
+    if_domain = g_string_new(NULL);
+    unless_domain = g_string_new(NULL);
+
+    for (opt = options; opt != NULL && ok; opt = next)
+    {
+        next = strchr(opt, ',');
+        if (next != NULL)
+            *next++ = 0;
+
+        negate = opt[0] == '~';
+        if (negate)
+            opt++;
+
+        if (strcmp(opt, "third-party") == 0 || strcmp(opt, "3p") == 0)
+            load_type = negate ? "first-party" : "third-party";
+        else if (strcmp(opt, "first-party") == 0 || strcmp(opt, "1p") == 0)
+            load_type = negate ? "third-party" : "first-party";
+        else if (strcmp(opt, "match-case") == 0)
+            match_case = !negate;
+        else if (strcmp(opt, "important") == 0)
+            ;  /* Blocking rules always win unless excepted. */
+        else if (g_str_has_prefix(opt, "domain="))
+            ok = adblock_parse_domains(opt + strlen("domain="), if_domain, unless_domain);
+        else if (g_str_has_prefix(opt, "from="))
+            ok = adblock_parse_domains(opt + strlen("from="), if_domain, unless_domain);
+        else if (exception && !negate &&
+                 (strcmp(opt, "document") == 0 || strcmp(opt, "doc") == 0))
+            whole_page = TRUE;
+        else
+        {
+            ok = FALSE;
+            for (i = 0; i < LENGTH(adblock_type_options); i++)
+            {
+                if (strcmp(opt, adblock_type_options[i].option) == 0)
+                {
+                    if (negate)
+                        not_types |= adblock_type_options[i].types;
+                    else
+                        types |= adblock_type_options[i].types;
+                    ok = TRUE;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (not_types != 0)
+    {
+        types = (types == 0 ? ADBLOCK_TYPES_ALL : types) & ~not_types;
+        ok = ok && types != 0;
+    }
+
+    re = g_string_new(NULL);
+    if (ok && whole_page)
+    {
+        /* "@@||example.com^$document" turns blocking off for everything
+         * on pages from example.com. */
+        ok = g_str_has_prefix(pattern, "||");
+        if (ok)
+        {
+            host = g_ascii_strdown(pattern + 2, -1);
+            if (host[0] != 0 && host[strlen(host) - 1] == '^')
+                host[strlen(host) - 1] = 0;
+            g_string_truncate(if_domain, 0);
+            ok = adblock_parse_domains(host, if_domain, unless_domain);
+            ok = ok && if_domain->len > 0;
+            g_free(host);
+        }
+        g_string_assign(re, ".*");
+        types = 0;
+    }
+    else if (ok)
+        ok = adblock_pattern_to_regex(pattern, re);
+
+    if (ok)
+    {
+        out = exception ? exceptions : blocks;
+        if (out->len > 0 && out->str[out->len - 1] != '[')
+            g_string_append_c(out, ',');
+
+        g_string_append(out, "{\"trigger\":{\"url-filter\":");
+        json_append_string(out, re->str);
+
+        if (match_case)
+            g_string_append(out, ",\"url-filter-is-case-sensitive\":true");
+
+        if (types != 0 && types != ADBLOCK_TYPES_ALL)
+        {
+            g_string_append(out, ",\"resource-type\":[");
+            for (i = 0; i < LENGTH(adblock_type_names); i++)
+            {
+                if (types & (1 << i))
+                {
+                    if (out->str[out->len - 1] != '[')
+                        g_string_append_c(out, ',');
+                    json_append_string(out, adblock_type_names[i]);
+                }
+            }
+            g_string_append_c(out, ']');
+        }
+
+        if (load_type != NULL)
+            g_string_append_printf(out, ",\"load-type\":[\"%s\"]", load_type);
+
+        /* WebKit allows only one of these per trigger. */
+        if (if_domain->len > 0)
+            g_string_append_printf(out, ",\"if-domain\":[%s]", if_domain->str);
+        else if (unless_domain->len > 0)
+            g_string_append_printf(out, ",\"unless-domain\":[%s]", unless_domain->str);
+
+        g_string_append_printf(out, "},\"action\":{\"type\":\"%s\"}}",
+                               exception ? "ignore-previous-rules" : "block");
+    }
+
+    g_string_free(re, TRUE);
+    g_string_free(if_domain, TRUE);
+    g_string_free(unless_domain, TRUE);
+
+    return ok;
+}
+
+/* Parses "a.com|~b.a.com" into JSON array members. Entity matching
+ * ("example.*") is not supported by WebKit. If all included domains
+ * had to be dropped, the rule would suddenly apply everywhere, so it
+ * is rejected instead. */
+gboolean
+adblock_parse_domains(gchar *list, GString *if_domain, GString *unless_domain)
+{
+    GString *to;
+    gchar *d, *next, *p;
+    gboolean had_if = FALSE;
+
+    for (d = list; d != NULL; d = next)
+    {
+        next = strchr(d, '|');
+        if (next != NULL)
+            *next++ = 0;
+
+        to = if_domain;
+        if (d[0] == '~')
+        {
+            to = unless_domain;
+            d++;
+        }
+        else
+            had_if = TRUE;
+
+        for (p = d; *p != 0; p++)
+        {
+            *p = g_ascii_tolower(*p);
+            if (!g_ascii_isalnum(*p) && *p != '.' && *p != '-')
+                break;
+        }
+        if (d[0] == 0 || *p != 0)
+            continue;
+
+        if (to->len > 0)
+            g_string_append_c(to, ',');
+        g_string_append_printf(to, "\"*%s\"", d);
+    }
+
+    return !had_if || if_domain->len > 0;
+}
+
+/* WebKit's URL filters use a reduced regular expression dialect:
+ * no alternatives, no counted repetitions and ASCII only. */
+gboolean
+adblock_pattern_to_regex(const gchar *p, GString *re)
+{
+    gboolean end_anchor = FALSE;
+    gsize len, i;
+
+    if (g_str_has_prefix(p, "||"))
+    {
+        g_string_append(re, "^[^:]+://+([^/]+\\.)?");
+        p += 2;
+    }
+    else if (p[0] == '|')
+    {
+        g_string_append_c(re, '^');
+        p++;
+    }
+    else
+    {
+        while (p[0] == '*')
+            p++;
+    }
+
+    len = strlen(p);
+    if (len > 0 && p[len - 1] == '|')
+    {
+        end_anchor = TRUE;
+        len--;
+    }
+    else
+    {
+        while (len > 0 && p[len - 1] == '*')
+            len--;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        if ((guchar)p[i] >= 0x80 || (guchar)p[i] < 0x20)
+            return FALSE;
+
+        switch (p[i])
+        {
+            case '*':
+                g_string_append(re, ".*");
+                break;
+            case '^':
+                g_string_append(re, "[^a-zA-Z0-9_.%-]");
+                break;
+            case '|':
+                return FALSE;
+            case '.': case '+': case '?': case '$': case '\\':
+            case '(': case ')': case '[': case ']': case '{': case '}':
+                g_string_append_c(re, '\\');
+                g_string_append_c(re, p[i]);
+                break;
+            default:
+                g_string_append_c(re, p[i]);
+        }
+    }
+
+    if (end_anchor)
+        g_string_append_c(re, '$');
+
+    if (re->len == 0)
+        g_string_append(re, ".*");
+
+    return TRUE;
+}
+
+/* Cosmetic filters ("example.com##.ad-banner") hide elements through
+ * user style sheets in the shared user content manager. Selectors are
+ * grouped by the hosts they're hidden on (all, for generic ones) and
+ * the hosts excepted from that ("example.com#@#.ad-banner"), one sheet
+ * per group with those hosts in its allow and block lists. The sheets
+ * are added once, and WebKit picks them by URI when it creates a
+ * document, before anything is painted. */
+void
+cosmetic_add_sheets(struct AdblockSource *src)
+{
+    WebKitUserStyleSheet *sheet;
+    GHashTable *hide, *unhide, *groups, *seen;
+    GHashTableIter iter;
+    gpointer key, value;
+    gchar **lists, **allow, **block;
+    const gchar *sel;
+    guint i;
+
+    hide = cosmetic_by_selector(src->cosmetic_hide);
+    unhide = cosmetic_by_selector(src->cosmetic_unhide);
+    groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_string_free);
+    seen = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (i = 0; i < src->cosmetic_generic->len; i++)
+    {
+        sel = g_ptr_array_index(src->cosmetic_generic, i);
+        if (g_hash_table_add(seen, (gpointer)sel))
+            cosmetic_group(groups, sel, NULL, unhide);
+    }
+
+    /* Selectors that are generic anyway need no host rules. */
+    g_hash_table_iter_init(&iter, hide);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        if (!g_hash_table_contains(seen, key))
+            cosmetic_group(groups, key, value, unhide);
+
+    g_hash_table_iter_init(&iter, groups);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        lists = g_strsplit(key, "|", 2);
+        allow = cosmetic_patterns(lists[0]);
+        block = cosmetic_patterns(lists[1]);
+        sheet = webkit_user_style_sheet_new(((GString *)value)->str,
+                                            WEBKIT_USER_CONTENT_INJECT_ALL_FRAMES,
+                                            WEBKIT_USER_STYLE_LEVEL_USER,
+                                            (const gchar * const *)allow,
+                                            (const gchar * const *)block);
+        webkit_user_content_manager_add_style_sheet(user_content, sheet);
+        webkit_user_style_sheet_unref(sheet);
+        g_strfreev(allow);
+        g_strfreev(block);
+        g_strfreev(lists);
+    }
+    log_debug("Cosmetic filters: %u sheets", g_hash_table_size(groups));
+
+    g_hash_table_destroy(seen);
+    g_hash_table_destroy(groups);
+    g_hash_table_destroy(unhide);
+    g_hash_table_destroy(hide);
+}
+
+/* Turns hostname -> selectors into selector -> sorted hostnames. The
+ * strings still belong to table. */
+GHashTable *
+cosmetic_by_selector(GHashTable *table)
+{
+    GHashTable *index;
+    GHashTableIter iter;
+    GPtrArray *selectors, *hosts;
+    gpointer host, value;
+    guint i;
+
+    index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify)g_ptr_array_unref);
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &host, &value))
+    {
+        selectors = value;
+        for (i = 0; i < selectors->len; i++)
+        {
+            hosts = g_hash_table_lookup(index, g_ptr_array_index(selectors, i));
+            if (hosts == NULL)
+            {
+                hosts = g_ptr_array_new();
+                g_hash_table_insert(index, g_ptr_array_index(selectors, i), hosts);
+            }
+            if (hosts->len == 0 || g_ptr_array_index(hosts, hosts->len - 1) != host)
+                g_ptr_array_add(hosts, host);
+        }
+    }
+
+    g_hash_table_iter_init(&iter, index);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        g_ptr_array_sort(value, adblock_compare_names);
+
+    return index;
+}
+
+/* Adds the rule for selector to the group of selectors hidden on the
+ * same hosts (all if hide is NULL) with the same exceptions. Groups are
+ * keyed "HOST,...|HOST,...". */
+void
+cosmetic_group(GHashTable *groups, const gchar *selector, GPtrArray *hide,
+               GHashTable *unhide)
+{
+    GPtrArray *hosts[2];
+    GString *key, *css;
+    guint i, j;
+
+    hosts[0] = hide;
+    hosts[1] = g_hash_table_lookup(unhide, selector);
+
+    key = g_string_new(NULL);
+    for (i = 0; i < 2; i++)
+    {
+        if (i > 0)
+            g_string_append_c(key, '|');
+        for (j = 0; hosts[i] != NULL && j < hosts[i]->len; j++)
+        {
+            if (j > 0)
+                g_string_append_c(key, ',');
+            g_string_append(key, g_ptr_array_index(hosts[i], j));
+        }
+    }
+
+    css = g_hash_table_lookup(groups, key->str);
+    if (css == NULL)
+    {
+        css = g_string_new(NULL);
+        g_hash_table_insert(groups, g_string_free(key, FALSE), css);
+    }
+    else
+        g_string_free(key, TRUE);
+    g_string_append_printf(css, "%s{display:none!important}\n", selector);
+}
+
+/* Returns URI patterns for a comma-separated list of hosts, matching
+ * their subdomains as well, or NULL if the list is empty. */
+gchar **
+cosmetic_patterns(const gchar *hosts)
+{
+    gchar **patterns, *h;
+    guint i;
+
+    if (hosts[0] == 0)
+        return NULL;
+
+    patterns = g_strsplit(hosts, ",", -1);
+    for (i = 0; patterns[i] != NULL; i++)
+    {
+        h = patterns[i];
+        patterns[i] = g_strdup_printf("*://*.%s/*", h);
+        g_free(h);
+    }
+
+    return patterns;
+}
+
+void
+cosmetic_parse_line(gchar *line, struct AdblockSource *src)
+{
+    GHashTable *table;
+    gchar *sep, *selector, *d, *next, *p;
+    gboolean unhide = FALSE, any_host = FALSE, negate;
+
+    g_strstrip(line);
+    if (line[0] == '!')
+        return;
+
+    if ((sep = strstr(line, "#@#")) != NULL)
+    {
+        unhide = TRUE;
+        selector = sep + 3;
+    }
+    else if ((sep = strstr(line, "##")) != NULL)
+        selector = sep + 2;
+    else
+        return;
+    *sep = 0;
+
+    if (!cosmetic_selector_valid(selector))
+        return;
+
+    for (d = line; d != NULL && d[0] != 0; d = next)
+    {
+        next = strchr(d, ',');
+        if (next != NULL)
+            *next++ = 0;
+
+        negate = d[0] == '~';
+        if (negate)
+            d++;
+
+        for (p = d; *p != 0; p++)
+        {
+            *p = g_ascii_tolower(*p);
+            if (!g_ascii_isalnum(*p) && *p != '.' && *p != '-')
+                break;
+        }
+        if (d[0] == 0 || *p != 0)
+            continue;
+
+        if (negate)
+        {
+            /* "~example.com##.ad" hides .ad everywhere else. */
+            if (!unhide)
+                cosmetic_add(src->cosmetic_unhide, d, selector);
+            continue;
+        }
+
+        any_host = TRUE;
+        table = unhide ? src->cosmetic_unhide : src->cosmetic_hide;
+        cosmetic_add(table, d, selector);
+    }
+
+    if (!any_host && !unhide)
+        g_ptr_array_add(src->cosmetic_generic, g_strdup(selector));
+}
+
+void
+cosmetic_add(GHashTable *table, const gchar *host, const gchar *selector)
+{
+    GPtrArray *selectors;
+
+    selectors = g_hash_table_lookup(table, host);
+    if (selectors == NULL)
+    {
+        selectors = g_ptr_array_new_with_free_func(g_free);
+        g_hash_table_insert(table, g_strdup(host), selectors);
+    }
+    g_ptr_array_add(selectors, g_strdup(selector));
+}
+
+/* Procedural filters, scriptlets and HTML filters are uBlock Origin
+ * extensions that CSS can't express. */
+gboolean
+cosmetic_selector_valid(const gchar *selector)
+{
+    static const gchar *procedural[] = {
+        ":-abp-", ":contains(", ":has-text(", ":if(", ":if-not(",
+        ":matches-attr(", ":matches-css", ":matches-path(", ":min-text-length(",
+        ":nth-ancestor(", ":others(", ":remove(", ":style(", ":upward(",
+        ":watch-attr(", ":xpath(",
+    };
+    guint i;
+
+    if (selector[0] == 0 || selector[0] == '+' || selector[0] == '^')
+        return FALSE;
+
+    if (strpbrk(selector, "{}") != NULL)
+        return FALSE;
+
+    for (i = 0; i < LENGTH(procedural); i++)
+        if (strstr(selector, procedural[i]) != NULL)
+            return FALSE;
+
+    return TRUE;
+}
+
+void
+json_append_string(GString *out, const gchar *s)
+{
+    g_string_append_c(out, '"');
+    for (; *s != 0; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            g_string_append_c(out, '\\');
+        g_string_append_c(out, *s);
+    }
+    g_string_append_c(out, '"');
+}
+
+/* Cooperative instances talk over a SOCK_SEQPACKET Unix socket in the
+ * runtime directory. The first instance listens on it, later ones
+ * connect, send their URIs and exit. Every packet is one request and
+ * gets one reply, so a batch of URIs arrives as a whole:
+ *
+ *     open [background]\n URI\n URI\n ...  ->  ok N\n
+ *     list\n                               ->  ok N\n INDEX\tURI\tTITLE\n ...
+ *
+ * Anything else is answered with "error MESSAGE\n". */
+void
+cooperation_setup(void)
+{
+    struct sockaddr_un addr;
+    gint tries, err = 0;
+    int fd, lock;
+
+    if (!cooperation_address(&addr))
+        return;
+
+    /* Another instance may be starting up right now. If it beats us to
+     * binding the socket, connect to it instead. The lock keeps it from
+     * binding between our connect() and unlink(), which would remove
+     * its socket. */
+    lock = cooperation_lock();
+    for (tries = 0; tries < 3; tries++)
+    {
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            err = errno;
+            break;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0)
+        {
+            cooperative_socket = fd;
+            cooperative_alone = FALSE;
+            if (lock != -1)
+                close(lock);
+            return;
+        }
+        err = errno;
+
+        /* Nobody is listening on a socket left behind by a crash. */
+        if (err == ECONNREFUSED)
+            unlink(cooperative_socket_path);
+        else if (err != ENOENT)
+        {
+            close(fd);
+            break;
+        }
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == 0 &&
+            listen(fd, SOMAXCONN) == 0 &&
+            g_unix_set_fd_nonblocking(fd, TRUE, NULL))
+        {
+            cooperative_socket = fd;
+            stat(cooperative_socket_path, &cooperative_socket_stat);
+            g_unix_fd_add(fd, G_IO_IN, control_accept, NULL);
+            if (lock != -1)
+                close(lock);
+            return;
+        }
+        err = errno;
+        close(fd);
+        if (err != EADDRINUSE)
+            break;
+    }
+    if (lock != -1)
+        close(lock);
+
+    log_error("Could not set up socket '%s': %s", cooperative_socket_path,
+              g_strerror(err));
+    g_free(cooperative_socket_path);
+    cooperative_socket_path = NULL;
+}
+
+gboolean
+cooperation_address(struct sockaddr_un *addr)
+{
+    gchar *name;
+
+    if (cooperative_socket_path == NULL)
+    {
+        name = g_strdup_printf("%s-%s", NAME".sock", socket_suffix);
+        cooperative_socket_path = g_build_filename(g_get_user_runtime_dir(), name, NULL);
+        g_free(name);
+    }
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(cooperative_socket_path) >= sizeof addr->sun_path)
+    {
+        log_error("Socket path too long: '%s'", cooperative_socket_path);
+        return FALSE;
+    }
+    strcpy(addr->sun_path, cooperative_socket_path);
+
+    return TRUE;
+}
+
+/* Takes the lock next to the socket that serializes binding and
+ * removing it. Returns the descriptor to close to release it, or -1 if
+ * the lock file can't be used, in which case we go ahead without. */
+int
+cooperation_lock(void)
+{
+    struct stat st, held;
+    gchar *path;
+    int fd;
+
+    /* The last instance to exit removes the lock file while holding it.
+     * Someone waiting on that file then holds a lock nobody else can
+     * see, so retry until the file locked is the one at path. */
+    path = g_strconcat(cooperative_socket_path, ".lock", NULL);
+    for (;;)
+    {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+        {
+            log_error("Could not open lock '%s': %s", path, g_strerror(errno));
+            break;
+        }
+        while (flock(fd, LOCK_EX) == -1)
+        {
+            if (errno != EINTR)
+            {
+                log_error("Could not lock '%s': %s", path, g_strerror(errno));
+                close(fd);
+                fd = -1;
+                break;
+            }
+        }
+        if (fd == -1 ||
+            (fstat(fd, &held) == 0 && stat(path, &st) == 0 &&
+             st.st_dev == held.st_dev && st.st_ino == held.st_ino))
+            break;
+        close(fd);
+    }
+    g_free(path);
+
+    return fd;
+}
+
+/* Fast path for the common case of a running instance, taken before
+ * GTK is initialized. Hands the command line over and exits. Returns
+ * if there is no one to hand it to, or if the command line is better
+ * left to the regular startup, which will retry. */
+void
+cooperation_forward(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    gboolean background = FALSE, list = FALSE;
+    const gchar *e;
+    int opt, fd, i;
+
+    /* Long options belong to GTK. */
+    for (i = 1; i < argc; i++)
+        if (strncmp(argv[i], "--", 2) == 0)
+            return;
+
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "Cbl")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                background = TRUE;
+                break;
+            case 'l':
+                list = TRUE;
+                break;
+            default:
+                optind = 1;
+                opterr = 1;
+                return;
+        }
+    }
+
+    /* Read the way grab_environment_configuration() does, which hasn't
+     * run yet. */
+    if ((e = g_getenv(NAME_UPPERCASE"_SOCKET_SUFFIX")) != NULL)
+        socket_suffix = g_strdup(e);
+    if ((e = g_getenv(NAME_UPPERCASE"_HOME_URI")) != NULL)
+        home_uri = g_strdup(e);
+
+    fd = cooperation_address(&addr) ?
+         socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0) : -1;
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        optind = 1;
+        opterr = 1;
+        return;
+    }
+
+    cooperative_socket = fd;
+    cooperative_alone = FALSE;
+    exit(cooperation_hand_over(list, background, argc - optind, argv + optind));
+}
+
+/* Sends the command line to the running instance. Returns the exit
+ * status. */
+int
+cooperation_hand_over(gboolean list, gboolean background, int argc, char **argv)
+{
+    gboolean ok;
+
+    if (list)
+        ok = control_send("list\n");
+    else if (argc == 0)
+        ok = control_open(&home_uri, 1, background);
+    else
+        ok = control_open(argv, argc, background);
+    cooperation_finish();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void
+cooperation_finish(void)
+{
+    if (cooperative_socket == -1)
+        return;
+
+    /* A new instance may have replaced our socket already if we were
+     * slow to exit. Only remove the one we bound. */
+    if (cooperative_alone)
+    {
+        struct stat st;
+        gchar *path;
+        int lock;
+
+        lock = cooperation_lock();
+        if (stat(cooperative_socket_path, &st) == 0 &&
+            st.st_dev == cooperative_socket_stat.st_dev &&
+            st.st_ino == cooperative_socket_stat.st_ino)
+        {
+            unlink(cooperative_socket_path);
+            if (lock != -1)
+            {
+                path = g_strconcat(cooperative_socket_path, ".lock", NULL);
+                unlink(path);
+                g_free(path);
+            }
+        }
+        if (lock != -1)
+            close(lock);
+    }
+    close(cooperative_socket);
+    cooperative_socket = -1;
+}
+
+gboolean
+control_accept(gint fd, GIOCondition condition, gpointer data)
+{
+    int conn;
+
+    while ((conn = accept(fd, NULL, NULL)) != -1)
+    {
+        if (fcntl(conn, F_SETFD, FD_CLOEXEC) == -1 ||
+            !g_unix_set_fd_nonblocking(conn, TRUE, NULL))
+        {
+            close(conn);
+            continue;
+        }
+
+        /* The request is usually there already. */
+        if (control_read(conn, G_IO_IN, NULL) == G_SOURCE_CONTINUE)
+            g_unix_fd_add(conn, G_IO_IN | G_IO_HUP | G_IO_ERR, control_read, NULL);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_warn("Could not accept connection: %s", g_strerror(errno));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Handles all requests that are waiting on fd in one go. */
+gboolean
+control_read(gint fd, GIOCondition condition, gpointer data)
+{
+    static gchar buf[CONTROL_MSG_MAX + 1];
+    GString *reply;
+    gint64 t0;
+    ssize_t n;
+
+    reply = g_string_new(NULL);
+    for (;;)
+    {
+        n = recv(fd, buf, sizeof buf, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            if (n == -1)
+                log_warn("Could not read request: %s", g_strerror(errno));
+            close(fd);
+            g_string_free(reply, TRUE);
+            return G_SOURCE_REMOVE;
+        }
+
+        if (n > CONTROL_MSG_MAX)
+            g_string_assign(reply, "error Request too long\n");
+        else
+        {
+            buf[n] = 0;
+            t0 = trace_begin();
+            control_handle(buf, reply);
+            trace_end("control", t0, buf);
+        }
+
+        if (send(fd, reply->str, reply->len, MSG_NOSIGNAL) == -1)
+            log_warn("Could not send reply: %s", g_strerror(errno));
+        g_string_truncate(reply, 0);
+    }
+    g_string_free(reply, TRUE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+control_handle(gchar *request, GString *reply)
+{
+    struct Client *c;
+    GtkWidget *page;
+    GString *tabs;
+    const gchar *uri, *title;
+    gchar *line, *next, *t;
+    gboolean focus;
+    guint n = 0;
+    gint i;
+
+    if ((next = strchr(request, '\n')) != NULL)
+        *next++ = 0;
+
+    if (strcmp(request, "open") == 0 || strcmp(request, "open background") == 0)
+    {
+        /* Only the first tab of a batch is brought to the front. */
+        focus = strcmp(request, "open") == 0;
+        for (line = next; line != NULL && *line != 0; line = next)
+        {
+            if ((next = strchr(line, '\n')) != NULL)
+                *next++ = 0;
+            if (*line == 0)
+                continue;
+            client_new(line, NULL, TRUE, focus && n == 0);
+            n++;
+        }
+        g_string_append_printf(reply, "ok %u\n", n);
+    }
+    else if (strcmp(request, "list") == 0)
+    {
+        tabs = g_string_new(NULL);
+        for (i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook)); i++)
+        {
+            page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+            c = g_object_get_data(G_OBJECT(page), "lariza-client");
+            uri = c->pending_uri;
+            if (uri == NULL)
+                uri = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+            title = webkit_web_view_get_title(WEBKIT_WEB_VIEW(c->web_view));
+
+            t = g_strdelimit(g_strdup(title == NULL ? "" : title), "\t\n", ' ');
+            line = g_strdup_printf("%d\t%s\t%s\n", i, uri == NULL ? "" : uri, t);
+            g_free(t);
+            if (tabs->len + strlen(line) + 16 > CONTROL_MSG_MAX)
+            {
+                g_free(line);
+                break;
+            }
+            g_string_append(tabs, line);
+            g_free(line);
+            n++;
+        }
+        g_string_append_printf(reply, "ok %u\n%s", n, tabs->str);
+        g_string_free(tabs, TRUE);
+    }
+    else
+        g_string_append(reply, "error Unknown request\n");
+}
+
+/* Sends uris to the running instance, as few packets as possible. */
+gboolean
+control_open(gchar **uris, gint n, gboolean background)
+{
+    GString *request;
+    gchar *f;
+    gboolean ok = TRUE;
+    gint i;
+
+    request = g_string_new(background ? "open background\n" : "open\n");
+    for (i = 0; i < n && ok; i++)
+    {
+        /* Let the running instance decide what to make of the rest. */
+        if ((f = ensure_uri_scheme(uris[i])) == NULL)
+            f = g_strdup(uris[i]);
+        if (strlen(f) + 1 > CONTROL_MSG_MAX - sizeof "open background\n")
+            log_warn("URI too long, ignored: '%.64s...'", f);
+        else
+        {
+            if (request->len + strlen(f) + 1 > CONTROL_MSG_MAX)
+            {
+                ok = control_send(request->str);
+                g_string_assign(request, "open background\n");
+            }
+            g_string_append(request, f);
+            g_string_append_c(request, '\n');
+        }
+        g_free(f);
+    }
+    if (ok)
+        ok = control_send(request->str);
+    g_string_free(request, TRUE);
+
+    return ok;
+}
+
+/* Sends a request to the running instance and waits for its reply. The
+ * body of the reply, if any, goes to stdout. */
+gboolean
+control_send(const gchar *request)
+{
+    static gchar reply[CONTROL_MSG_MAX + 1];
+    struct timeval tv = { CONTROL_TIMEOUT_S, 0 };
+    gchar *body;
+    ssize_t n;
+
+    setsockopt(cooperative_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    if (send(cooperative_socket, request, strlen(request), MSG_NOSIGNAL) == -1)
+    {
+        log_error("Could not send request: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    do
+        n = recv(cooperative_socket, reply, CONTROL_MSG_MAX, 0);
+    while (n == -1 && errno == EINTR);
+    if (n <= 0)
+    {
+        log_error("No reply from running instance: %s",
+                  n == 0 ? "Connection closed" : g_strerror(errno));
+        return FALSE;
+    }
+    reply[n] = 0;
+
+    body = strchr(reply, '\n');
+    if (strncmp(reply, "ok ", 3) != 0 || body == NULL)
+    {
+        g_strchomp(reply);
+        log_error("Running instance: %s", reply);
+        return FALSE;
+    }
+    fputs(body + 1, stdout);
+
+    return TRUE;
+}
+
+void
+changed_download_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    WebKitDownload *download = WEBKIT_DOWNLOAD(obj);
+    WebKitURIResponse *resp;
+    GtkToolItem *tb = GTK_TOOL_ITEM(data);
+    gdouble p, size_mb;
+    const gchar *uri;
+    gchar *t, *filename, *base;
+    guint64 content_length;
+
+    p = webkit_download_get_estimated_progress(download);
+    p = p > 1 ? 1 : p;
+    p = p < 0 ? 0 : p;
+    p *= 100;
+    resp = webkit_download_get_response(download);
+    content_length = webkit_uri_response_get_content_length(resp);
+    size_mb = content_length / 1e6;
+
+    uri = webkit_download_get_destination(download);
+    filename = g_filename_from_uri(uri, NULL, NULL);
+    if (filename == NULL)
+    {
+        log_warn("Could not construct file name from URI!");
+        t = g_strdup_printf("%s (%.0f%% of %.1f MB)",
+                            webkit_uri_response_get_uri(resp), p, size_mb);
+    }
+    else
+    {
+        base = g_path_get_basename(filename);
+        t = g_strdup_printf("%s (%.0f%% of %.1f MB)", base, p, size_mb);
+        g_free(filename);
+        g_free(base);
+    }
+    gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), t);
+    g_free(t);
+
+    // If the download is complete, remove it from the active downloads
+    if (p >= 100) {
+        downloads--;
+        gtk_widget_destroy(GTK_WIDGET(tb));
+    }
+}
+
+void changed_load_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gdouble p;
+    gchar *grab_feeds =
+        "a = document.querySelectorAll('"
+        "    html > head > link[rel=\"alternate\"][href][type=\"application/atom+xml\"],"
+        "    html > head > link[rel=\"alternate\"][href][type=\"application/rss+xml\"]"
+        "');"
+        "if (a.length == 0)"
+        "    null;"
+        "else"
+        "{"
+        "    out = '';"
+        "    for (i = 0; i < a.length; i++)"
+        "    {"
+        "        url = encodeURIComponent(a[i].href);"
+        "        if ('title' in a[i] && a[i].title != '')"
+        "            title = encodeURIComponent(a[i].title);"
+        "        else"
+        "            title = url;"
+        "        out += '<li><a href=\"' + url + '\">' + title + '</a></li>';"
+        "    }"
+        "    out;"
+        "}";
+
+    p = webkit_web_view_get_estimated_load_progress(WEBKIT_WEB_VIEW(c->web_view));
+    if (p == 1)
+    {
+        p = 0;
+
+        /* The page has loaded fully. We now run the short JavaScript
+         * snippet above that operates on the DOM. It tries to grab all
+         * occurences of <link rel="alternate" ...>, i.e. RSS/Atom feed
+         * references. */
+        trace_async('b', "grab_feeds", GPOINTER_TO_SIZE(c), NULL);
+        webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(c->web_view),
+                                            grab_feeds, -1, NULL, NULL,
+                                            NULL, grab_feeds_finished, c);
+
+        run_user_scripts(WEBKIT_WEB_VIEW(c->web_view));
+    }
+    gtk_entry_set_progress_fraction(GTK_ENTRY(c->location), p);
+}
+
+void
+changed_favicon(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    cairo_surface_t *f;
+    int w, h, w_should, h_should;
+    GdkPixbuf *pb, *pb_scaled;
+
+    f = webkit_web_view_get_favicon(WEBKIT_WEB_VIEW(c->web_view));
+    if (f == NULL)
+    {
+        gtk_image_set_from_icon_name(GTK_IMAGE(c->tabicon), "text-html",
+                                     GTK_ICON_SIZE_SMALL_TOOLBAR);
+    }
+    else
+    {
+        w = cairo_image_surface_get_width(f);
+        h = cairo_image_surface_get_height(f);
+        pb = gdk_pixbuf_get_from_surface(f, 0, 0, w, h);
+        if (pb != NULL)
+        {
+            w_should = 16 * gtk_widget_get_scale_factor(c->tabicon);
+            h_should = 16 * gtk_widget_get_scale_factor(c->tabicon);
+            pb_scaled = gdk_pixbuf_scale_simple(pb, w_should, h_should,
+                                                GDK_INTERP_BILINEAR);
+            gtk_image_set_from_pixbuf(GTK_IMAGE(c->tabicon), pb_scaled);
+
+            g_object_unref(pb_scaled);
+            g_object_unref(pb);
+        }
+    }
+}
+
+void
+changed_title(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    const gchar *t, *u;
+    struct Client *c = (struct Client *)data;
+
+    u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+    t = webkit_web_view_get_title(WEBKIT_WEB_VIEW(c->web_view));
+
+    u = u == NULL ? NAME : u;
+    u = u[0] == 0 ? NAME : u;
+
+    t = t == NULL ? u : t;
+    t = t[0] == 0 ? u : t;
+
+    gtk_label_set_text(GTK_LABEL(c->tablabel), t);
+    gtk_widget_set_tooltip_text(c->tablabel, t);
+    mainwindow_title(gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook)));
+
+    if (history_file != NULL && t != u && strcmp(u, NAME) != 0)
+        history_title(u, t);
+}
+
+void
+changed_uri(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    const gchar *t;
+    struct Client *c = (struct Client *)data;
+
+    t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+
+    /* When a web process crashes, we get a "notify::uri" signal, but we
+     * can no longer read a meaningful URI. It's just an empty string
+     * now. Not updating the location bar in this scenario is important,
+     * because we would override the "WEB PROCESS CRASHED" message. */
+    if (t != NULL && strlen(t) > 0)
+    {
+        gtk_entry_set_text(GTK_ENTRY(c->location), t);
+
+        if (history_file != NULL)
+            history_add(t);
+    }
+}
+
+/* The open tabs are kept in a journal, so they survive a crash of cream
+ * or of the X session:
+ *
+ *     magic | record | record | ...
+ *
+ * A record is a header followed by len bytes of payload, the ID in the
+ * header is the ID of a tab. A tab record carries the URI and the
+ * serialized session state of a tab. It is appended whenever a page
+ * has finished loading and when the tab is left, which catches up on
+ * scrolling. An order record lists the IDs of all open tabs and is
+ * appended when tabs are added, closed or moved, a focus record when
+ * another tab is activated. The latest record of a tab wins, tabs that
+ * are not in the latest order record are closed.
+ *
+ *     Tab record:    header | URI length | URI | state
+ *     Order record:  header | ID | ID | ...
+ *     Focus record:  header
+ *
+ * Numbers are in host byte order. Records are collected for
+ * SESSION_WRITE_DELAY_MS and appended in one go. Once the journal has
+ * grown to SESSION_COMPACT_FACTOR times its compacted size, a
+ * background thread replays it and rewrites it as one record per open
+ * tab. That doesn't touch any web views, so a snapshot never serializes
+ * all tabs at once. Records collected in the meantime are appended to
+ * the new file.
+ *
+ * On startup, the tabs of the journal are restored as pending tabs,
+ * see client_defer(), so only the focused one loads right away.
+ * Returns whether there were any. */
+gboolean
+session_setup(void)
+{
+    struct Session s;
+    struct SessionTab *t;
+    struct Client *c, **restored;
+    WebKitWebView *wv;
+    guint i, j, n, focus = 0;
+    int fd;
+
+    if (!session_read(&s) || (fd = session_compact(&s)) == -1)
+    {
+        session_free(&s);
+        session_file = NULL;
+        return FALSE;
+    }
+    session_size = session_compacted = lseek(fd, 0, SEEK_CUR);
+    session_next_id = MAX(session_next_id, s.next_id);
+
+    n = s.order->len;
+    for (i = 0; i < n; i++)
+        if (g_array_index(s.order, guint32, i) == s.focus)
+            focus = i;
+
+    /* The first tab of a window loads right away, so the focused tab is
+     * created first. New tabs go next to the current one, so they are
+     * moved to their place afterwards. */
+    restored = g_new(struct Client *, n);
+    for (i = 0; i < n; i++)
+    {
+        j = (focus + i) % n;
+        t = g_hash_table_lookup(s.tabs, GUINT_TO_POINTER(g_array_index(s.order, guint32, j)));
+
+        wv = client_new(NULL, NULL, TRUE, FALSE);
+        c = g_object_get_data(G_OBJECT(gtk_widget_get_parent(GTK_WIDGET(wv))),
+                              "lariza-client");
+        c->tab_id = g_array_index(s.order, guint32, j);
+        if (t->state != NULL)
+            c->session = g_bytes_ref(t->state);
+        client_defer(c, g_strdup(t->uri));
+        restored[j] = c;
+    }
+    for (i = 0; i < n; i++)
+        gtk_notebook_reorder_child(GTK_NOTEBOOK(mw.notebook), restored[i]->vbox, i);
+
+    if (n > 0)
+    {
+        session_focused = restored[focus];
+        log_info("Restored %u tabs from '%s'", n, session_file);
+    }
+
+    /* Nothing has changed yet. */
+    session_fd = fd;
+    g_free(restored);
+    session_free(&s);
+
+    return n > 0;
+}
+
+/* Replays the journal. Tabs that are closed are dropped, and so is a
+ * broken tail, which is what a crash while appending leaves behind. Fails
+ * if the file exists but isn't a journal, which is then left alone.
+ * Runs in the compacting thread as well, so it only fills in s. */
+gboolean
+session_read(struct Session *s)
+{
+    struct SessionHeader hdr;
+    struct SessionTab *t;
+    GArray *order;
+    GError *err = NULL;
+    gchar *data, *p, *end;
+    gsize len, magic = strlen(SESSION_MAGIC);
+    guint32 uri_len, id;
+    guint i;
+
+    s->tabs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->order = g_array_new(FALSE, FALSE, sizeof (guint32));
+    s->focus = 0;
+    s->next_id = 0;
+
+    if (!g_file_get_contents(session_file, &data, &len, &err))
+    {
+        if (g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+            g_error_free(err);
+            return TRUE;
+        }
+        log_error("Could not read session file: %s", err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+
+    if (len < magic || memcmp(data, SESSION_MAGIC, magic) != 0)
+    {
+        log_error("'%s' is not a session file, leaving it alone", session_file);
+        g_free(data);
+        return FALSE;
+    }
+
+    end = data + len;
+    for (p = data + magic; p < end; p += hdr.len)
+    {
+        if ((gsize)(end - p) < sizeof hdr)
+            break;
+        memcpy(&hdr, p, sizeof hdr);
+        p += sizeof hdr;
+        if ((gsize)(end - p) < hdr.len)
+            break;
+
+        if (hdr.type == SESSION_RECORD_TAB)
+        {
+            if (hdr.len < sizeof uri_len)
+                break;
+            memcpy(&uri_len, p, sizeof uri_len);
+            if (uri_len == 0 || uri_len > hdr.len - sizeof uri_len)
+                break;
+
+            session_tab_free(g_hash_table_lookup(s->tabs, GUINT_TO_POINTER(hdr.id)));
+            t = g_new0(struct SessionTab, 1);
+            t->uri = g_strndup(p + sizeof uri_len, uri_len);
+            if (hdr.len > sizeof uri_len + uri_len)
+                t->state = g_bytes_new(p + sizeof uri_len + uri_len,
+                                       hdr.len - sizeof uri_len - uri_len);
+            g_hash_table_insert(s->tabs, GUINT_TO_POINTER(hdr.id), t);
+        }
+        else if (hdr.type == SESSION_RECORD_ORDER && hdr.len % sizeof id == 0)
+        {
+            g_array_set_size(s->order, 0);
+            g_array_append_vals(s->order, p, hdr.len / sizeof id);
+        }
+        else if (hdr.type == SESSION_RECORD_FOCUS)
+            s->focus = hdr.id;
+        else
+            break;
+
+        s->next_id = MAX(s->next_id, hdr.id + 1);
+    }
+    if (p < end)
+        log_warn("Session file is damaged at offset %"G_GSIZE_FORMAT", "
+                 "ignoring the rest", (gsize)(p - data));
+
+    /* Tabs that never got a tab record can't be restored. */
+    order = g_array_new(FALSE, FALSE, sizeof (guint32));
+    for (i = 0; i < s->order->len; i++)
+    {
+        id = g_array_index(s->order, guint32, i);
+        if (g_hash_table_lookup(s->tabs, GUINT_TO_POINTER(id)) != NULL)
+            g_array_append_val(order, id);
+        s->next_id = MAX(s->next_id, id + 1);
+    }
+    g_array_free(s->order, TRUE);
+    s->order = order;
+
+    g_free(data);
+
+    return TRUE;
+}
+
+void
+session_tab_free(struct SessionTab *t)
+{
+    if (t == NULL)
+        return;
+
+    g_free(t->uri);
+    if (t->state != NULL)
+        g_bytes_unref(t->state);
+    g_free(t);
+}
+
+void
+session_free(struct Session *s)
+{
+    GHashTableIter iter;
+    struct SessionTab *t;
+
+    g_hash_table_iter_init(&iter, s->tabs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&t))
+        session_tab_free(t);
+    g_hash_table_destroy(s->tabs);
+    g_array_free(s->order, TRUE);
+}
+
+/* Atomically replaces the journal by the open tabs of s. Returns the
+ * new file, or -1. */
+int
+session_compact(struct Session *s)
+{
+    struct SessionTab *t;
+    GByteArray *buf;
+    gchar *tmp;
+    guint32 id;
+    guint i;
+    int out;
+
+    buf = g_byte_array_new();
+    g_byte_array_append(buf, (const guint8 *)SESSION_MAGIC, strlen(SESSION_MAGIC));
+    for (i = 0; i < s->order->len; i++)
+    {
+        id = g_array_index(s->order, guint32, i);
+        t = g_hash_table_lookup(s->tabs, GUINT_TO_POINTER(id));
+        session_append_tab(buf, id, t->uri, t->state);
+    }
+    session_append_header(buf, 0, SESSION_RECORD_ORDER, s->order->len * sizeof id);
+    g_byte_array_append(buf, (const guint8 *)s->order->data, s->order->len * sizeof id);
+    session_append_header(buf, s->focus, SESSION_RECORD_FOCUS, 0);
+
+    tmp = g_strconcat(session_file, ".XXXXXX", NULL);
+    out = g_mkstemp(tmp);
+    if (out == -1 || write_full(out, (gchar *)buf->data, buf->len) != (ssize_t)buf->len ||
+        fdatasync(out) == -1 || rename(tmp, session_file) == -1)
+    {
+        log_error("Could not compact session file: %s", g_strerror(errno));
+        if (out != -1)
+        {
+            close(out);
+            unlink(tmp);
+        }
+        out = -1;
+    }
+    else
+        log_debug("Compacted session file to %u tabs", s->order->len);
+
+    g_free(tmp);
+    g_byte_array_free(buf, TRUE);
+
+    return out;
+}
+
+void
+session_append_header(GByteArray *buf, guint32 id, guint8 type, gsize len)
+{
+    struct SessionHeader hdr;
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.id = id;
+    hdr.type = type;
+    hdr.len = len;
+    g_byte_array_append(buf, (const guint8 *)&hdr, sizeof hdr);
+}
+
+void
+session_append_tab(GByteArray *buf, guint32 id, const gchar *uri, GBytes *state)
+{
+    guint32 uri_len = strlen(uri);
+    gsize state_len = state != NULL ? g_bytes_get_size(state) : 0;
+
+    session_append_header(buf, id, SESSION_RECORD_TAB,
+                          sizeof uri_len + uri_len + state_len);
+    g_byte_array_append(buf, (const guint8 *)&uri_len, sizeof uri_len);
+    g_byte_array_append(buf, (const guint8 *)uri, uri_len);
+    if (state_len > 0)
+        g_byte_array_append(buf, g_bytes_get_data(state, NULL), state_len);
+}
+
+/* Connected to "page-added", "page-removed", "page-reordered" and
+ * "switch-page" of the notebook. */
+void
+session_pages_changed(GtkNotebook *nb, GtkWidget *child, guint idx, gpointer data)
+{
+    struct Client *c = g_object_get_data(G_OBJECT(child), "lariza-client");
+
+    /* Closing the window is no reason to forget the tabs. */
+    if (session_fd == -1 || gtk_widget_in_destruction(GTK_WIDGET(nb)))
+        return;
+
+    switch (GPOINTER_TO_INT(data))
+    {
+        case SESSION_PAGE_SWITCHED:
+            if (session_focused != NULL)
+                session_tab_changed(session_focused);
+            session_focused = c;
+            session_focus_dirty = TRUE;
+            break;
+        case SESSION_PAGE_ADDED:
+            c->journal_dirty = TRUE;
+            /* Fall through */
+        default:
+            session_order_dirty = TRUE;
+    }
+
+    if (session_timer == 0)
+        session_timer = g_timeout_add(SESSION_WRITE_DELAY_MS, session_flush, NULL);
+}
+
+void
+session_tab_changed(struct Client *c)
+{
+    if (session_fd == -1)
+        return;
+
+    c->journal_dirty = TRUE;
+    if (session_timer == 0)
+        session_timer = g_timeout_add(SESSION_WRITE_DELAY_MS, session_flush, NULL);
+}
+
+/* Appends the records of whatever changed since the last time. */
+gboolean
+session_flush(gpointer data)
+{
+    WebKitWebViewSessionState *state;
+    struct Client *c;
+    GtkWidget *page;
+    GByteArray *buf;
+    GArray *order;
+    GBytes *bytes;
+    GTask *task;
+    const gchar *uri;
+    gint i, n;
+
+    session_timer = 0;
+    if (session_fd == -1)
+        return G_SOURCE_REMOVE;
+
+    buf = g_byte_array_new();
+    order = g_array_new(FALSE, FALSE, sizeof (guint32));
+    n = gtk_notebook_get_n_pages(GTK_NOTEBOOK(mw.notebook));
+    for (i = 0; i < n; i++)
+    {
+        page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(mw.notebook), i);
+        c = g_object_get_data(G_OBJECT(page), "lariza-client");
+        g_array_append_val(order, c->tab_id);
+        if (!c->journal_dirty)
+            continue;
+        c->journal_dirty = FALSE;
+
+        /* Pending and hibernated tabs have nothing new to say, but they
+         * may be new themselves. */
+        if (c->pending_uri != NULL)
+            session_append_tab(buf, c->tab_id, c->pending_uri, c->session);
+        else if ((uri = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view))) != NULL &&
+                 uri[0] != 0)
+        {
+            state = webkit_web_view_get_session_state(WEBKIT_WEB_VIEW(c->web_view));
+            bytes = webkit_web_view_session_state_serialize(state);
+            webkit_web_view_session_state_unref(state);
+            session_append_tab(buf, c->tab_id, uri, bytes);
+            g_bytes_unref(bytes);
+        }
+    }
+
+    if (session_order_dirty)
+    {
+        session_append_header(buf, 0, SESSION_RECORD_ORDER, order->len * sizeof (guint32));
+        g_byte_array_append(buf, (const guint8 *)order->data, order->len * sizeof (guint32));
+        session_order_dirty = FALSE;
+    }
+    if (session_focus_dirty && session_focused != NULL)
+    {
+        session_append_header(buf, session_focused->tab_id, SESSION_RECORD_FOCUS, 0);
+        session_focus_dirty = FALSE;
+    }
+    g_array_free(order, TRUE);
+
+    if (session_backlog != NULL)
+        g_byte_array_append(session_backlog, buf->data, buf->len);
+    else
+        session_write(buf);
+    g_byte_array_free(buf, TRUE);
+
+    if (session_fd != -1 && session_backlog == NULL &&
+        session_size > MAX(SESSION_COMPACT_MIN, session_compacted * SESSION_COMPACT_FACTOR))
+    {
+        session_backlog = g_byte_array_new();
+        task = g_task_new(NULL, NULL, session_compact_finished, NULL);
+        g_task_run_in_thread(task, session_compact_thread);
+        g_object_unref(task);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Everything written so far is in the journal, the main thread holds
+ * back new records until this is done. */
+void
+session_compact_thread(GTask *task, gpointer source, gpointer task_data,
+                       GCancellable *cancellable)
+{
+    struct Session s;
+    int fd = -1;
+
+    if (session_read(&s))
+        fd = session_compact(&s);
+    session_free(&s);
+
+    g_task_return_int(task, fd);
+}
+
+void
+session_compact_finished(GObject *obj, GAsyncResult *result, gpointer data)
+{
+    GByteArray *backlog = session_backlog;
+    int fd;
+
+    session_backlog = NULL;
+
+    /* If compacting failed, the old journal is still in place. */
+    fd = g_task_propagate_int(G_TASK(result), NULL);
+    if (fd != -1)
+    {
+        close(session_fd);
+        session_fd = fd;
+        session_size = session_compacted = lseek(fd, 0, SEEK_CUR);
+    }
+
+    session_write(backlog);
+    g_byte_array_free(backlog, TRUE);
+}
+
+void
+session_write(GByteArray *buf)
+{
+    if (buf->len == 0 || session_fd == -1)
+        return;
+
+    if (write_full(session_fd, (gchar *)buf->data, buf->len) != (ssize_t)buf->len)
+    {
+        log_error("Could not write session file, giving up on it");
+        close(session_fd);
+        session_fd = -1;
+        return;
+    }
+    if (session_fsync == HISTORY_FSYNC_BATCH)
+        fdatasync(session_fd);
+    session_size += buf->len;
+}
+
+void
+session_finish(void)
+{
+    if (session_fd == -1)
+        return;
+
+    if (session_timer != 0)
+    {
+        g_source_remove(session_timer);
+        session_flush(NULL);
+    }
+
+    /* The records held back go to whichever file wins. */
+    while (session_backlog != NULL)
+        g_main_context_iteration(NULL, TRUE);
+
+    if (session_fd == -1)
+        return;
+    if (session_fsync != HISTORY_FSYNC_NEVER)
+        fdatasync(session_fd);
+    close(session_fd);
+    session_fd = -1;
+}
+
+/* History is a binary log, see history.h. It is written by a background
+ * thread, so that slow disks never stall the UI. The main thread pushes
+ * entries on a lock-free stack and only wakes up the writer through a
+ * pipe when the stack was empty. Consecutive duplicates, which
+ * pushState-heavy pages produce a lot, never make it into the queue.
+ *
+ * The writer keeps the URI dictionary in memory. Once enough visit and
+ * title records have piled up, it compacts the log into one record per
+ * URI and atomically replaces the file. */
+void
+history_setup(void)
+{
+    GError *err = NULL;
+
+    if (!g_unix_open_pipe(history_wake, FD_CLOEXEC, &err) ||
+        !g_unix_set_fd_nonblocking(history_wake[1], TRUE, &err))
+    {
+        log_error("Could not start history writer: %s", err->message);
+        g_error_free(err);
+        history_file = NULL;
+        return;
+    }
+
+    history_delta = g_hash_table_new(g_str_hash, g_str_equal);
+    history_delta_list = g_ptr_array_new();
+    history_completions = gtk_list_store_new(1, G_TYPE_STRING);
+
+    history_thread = g_thread_new(NAME"-history", history_writer, NULL);
+}
+
+void
+history_add(const gchar *uri)
+{
+    if (g_strcmp0(uri, history_last) == 0)
+        return;
+    g_free(history_last);
+    history_last = g_strdup(uri);
+
+    if (history_thread == NULL || strlen(uri) > HISTORY_URI_MAX)
+        return;
+
+    history_delta_add(uri, strlen(uri), FALSE, g_get_real_time() / G_USEC_PER_SEC);
+    history_push(uri, NULL);
+}
+
+void
+history_title(const gchar *uri, const gchar *title)
+{
+    if (history_thread == NULL || strlen(uri) > HISTORY_URI_MAX)
+        return;
+
+    history_push(uri, title);
+}
+
+void
+history_push(const gchar *uri, const gchar *title)
+{
+    struct HistoryEntry *e, *head;
+
+    e = g_new(struct HistoryEntry, 1);
+    e->uri = g_strdup(uri);
+    e->title = g_strdup(title);
+    e->time = g_get_real_time() / G_USEC_PER_SEC;
+    do
+    {
+        head = g_atomic_pointer_get(&history_queue);
+        e->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&history_queue, head, e));
+
+    if (head == NULL && write(history_wake[1], "", 1) == -1 && errno != EAGAIN)
+        log_error("Could not wake history writer: %s", g_strerror(errno));
+}
+
+/* Writes what's left in the queue and waits for the writer to exit. */
+void
+history_finish(void)
+{
+    if (history_thread == NULL)
+        return;
+
+    g_atomic_int_set(&history_stop, 1);
+    if (write(history_wake[1], "", 1) == -1 && errno != EAGAIN)
+        log_error("Could not wake history writer: %s", g_strerror(errno));
+
+    g_thread_join(history_thread);
+    history_thread = NULL;
+}
+
+gpointer
+history_writer(gpointer data)
+{
+    struct HistoryEntry *batch, *e, *next, *ordered;
+    struct HistoryURI *u;
+    struct HistoryLog *log;
+    GString *buf = g_string_new(NULL);
+    gboolean stop = FALSE;
+    struct stat st;
+    char drain[64];
+    gint64 t0;
+    gsize len;
+    int fd;
+
+    history_uris = g_hash_table_new(g_str_hash, g_str_equal);
+    history_ids = g_ptr_array_new();
+
+    /* Everything up to here is in the log, everything after this comes
+     * from the queue and is in the main thread's delta already. */
+    fd = history_load();
+    if (fd != -1 && fstat(fd, &st) == 0)
+    {
+        log = g_new(struct HistoryLog, 1);
+        log->size = st.st_size;
+        log->dev = st.st_dev;
+        log->ino = st.st_ino;
+        g_idle_add(history_loaded, log);
+    }
+
+    while (!stop)
+    {
+        if (read(history_wake[0], drain, sizeof drain) == -1 && errno != EINTR)
+        {
+            log_error("History writer: %s", g_strerror(errno));
+            break;
+        }
+
+        /* Busy pages tend to produce several entries in a row. Wait a
+         * little, so they all go out with a single write. */
+        stop = g_atomic_int_get(&history_stop);
+        if (!stop)
+            g_usleep(HISTORY_BATCH_DELAY_MS * 1000);
+
+        do
+            batch = g_atomic_pointer_get(&history_queue);
+        while (!g_atomic_pointer_compare_and_exchange(&history_queue, batch, NULL));
+        t0 = trace_begin();
+
+        /* The stack is newest first. */
+        for (ordered = NULL, e = batch; e != NULL; e = next)
+        {
+            next = e->next;
+            e->next = ordered;
+            ordered = e;
+        }
+        for (e = ordered; e != NULL; e = next)
+        {
+            next = e->next;
+            u = history_lookup(e->uri, strlen(e->uri), buf);
+
+            if (e->title == NULL)
+            {
+                history_append_record(buf, u->id, HISTORY_RECORD_VISIT,
+                                      &e->time, sizeof e->time, NULL, 0);
+                u->visits++;
+                u->last = e->time;
+                history_dead++;
+            }
+            else
+            {
+                /* Don't cut multi-byte characters in half. */
+                len = strlen(e->title);
+                if (len > HISTORY_TITLE_MAX)
+                    for (len = HISTORY_TITLE_MAX; len > 0 && (e->title[len] & 0xc0) == 0x80; len--)
+                        ;
+                if (u->title == NULL || strncmp(u->title, e->title, len) != 0 ||
+                    u->title[len] != 0)
+                {
+                    if (u->title != NULL)
+                        history_dead++;
+                    g_free(u->title);
+                    u->title = g_strndup(e->title, len);
+                    history_append_record(buf, u->id, HISTORY_RECORD_TITLE,
+                                          NULL, 0, u->title, len);
+                }
+            }
+
+            g_free(e->uri);
+            g_free(e->title);
+            g_free(e);
+        }
+
+        if (buf->len == 0)
+            continue;
+
+        if (fd != -1 && write_full(fd, buf->str, buf->len) == (ssize_t)buf->len &&
+            history_fsync == HISTORY_FSYNC_BATCH)
+            fdatasync(fd);
+        g_string_truncate(buf, 0);
+
+        if (fd != -1 && history_dead > HISTORY_COMPACT_MIN &&
+            history_dead > history_ids->len)
+            fd = history_compact(fd);
+        trace_end("history_write", t0, NULL);
+    }
+
+    if (fd != -1)
+    {
+        if (history_fsync != HISTORY_FSYNC_NEVER)
+            fdatasync(fd);
+        close(fd);
+    }
+    g_string_free(buf, TRUE);
+
+    return NULL;
+}
+
+/* Reads the URI dictionary from the log and returns the log, opened for
+ * appending. A plain text history of older versions is converted, the
+ * original is kept with a ".txt" suffix. */
+int
+history_load(void)
+{
+    struct history_record r;
+    struct HistoryURI *u;
+    const gchar *data, *p, *next, *end;
+    GMappedFile *mf;
+    GError *err = NULL;
+    gchar *backup;
+    struct stat st;
+    gsize len, magic = strlen(HISTORY_MAGIC);
+    int fd;
+
+    fd = open(history_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        log_error("Error opening history file: %s", g_strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        if (write_full(fd, HISTORY_MAGIC, magic) != (ssize_t)magic)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    mf = g_mapped_file_new(history_file, FALSE, &err);
+    if (mf == NULL)
+    {
+        log_error("Error reading history file: %s", err->message);
+        g_error_free(err);
+        close(fd);
+        return -1;
+    }
+    data = g_mapped_file_get_contents(mf);
+    len = g_mapped_file_get_length(mf);
+    end = data + len;
+
+    if (len < magic || memcmp(data, HISTORY_MAGIC, magic) != 0)
+    {
+        for (p = data; p < end && (next = memchr(p, '\n', end - p)) != NULL; p = next + 1)
+        {
+            if (next == p || next - p > HISTORY_URI_MAX)
+                continue;
+            u = history_lookup(p, next - p, NULL);
+            u->visits++;
+            u->last = st.st_mtime;
+        }
+        g_mapped_file_unref(mf);
+        close(fd);
+
+        backup = g_strconcat(history_file, ".txt", NULL);
+        if (link(history_file, backup) == -1 && errno != EEXIST)
+        {
+            log_error("Could not back up history file to '%s': %s", backup,
+                      g_strerror(errno));
+            g_free(backup);
+            return -1;
+        }
+        log_info("Converting history file, the old one is kept as '%s'", backup);
+        g_free(backup);
+
+        return history_compact(-1);
+    }
+
+    for (p = data + magic; p < end; p = next)
+    {
+        if ((next = history_record_next(p, end, &r)) == NULL)
+            break;
+
+        if (r.type == HISTORY_RECORD_URI)
+        {
+            if (r.id != history_ids->len)
+                break;
+            u = history_lookup(r.text, r.len, NULL);
+            if (u->id != r.id)
+                break;
+            u->visits = r.visits;
+            u->last = r.time;
+        }
+        else if (r.id >= history_ids->len)
+            break;
+        else if (r.type == HISTORY_RECORD_VISIT)
+        {
+            u = g_ptr_array_index(history_ids, r.id);
+            u->visits++;
+            u->last = MAX(u->last, r.time);
+            history_dead++;
+        }
+        else if (r.type == HISTORY_RECORD_TITLE)
+        {
+            u = g_ptr_array_index(history_ids, r.id);
+            if (u->title != NULL)
+                history_dead++;
+            g_free(u->title);
+            u->title = g_strndup(r.text, r.len);
+        }
+    }
+
+    /* Cut off whatever a crash left behind, or nothing appended after
+     * it could be read. */
+    if (p < end)
+    {
+        log_warn("History file is damaged at offset %lu, truncating it",
+                 (unsigned long)(p - data));
+        if (ftruncate(fd, p - data) == -1)
+        {
+            log_error("Could not truncate history file: %s", g_strerror(errno));
+            g_mapped_file_unref(mf);
+            close(fd);
+            return -1;
+        }
+    }
+    g_mapped_file_unref(mf);
+
+    if (history_dead > HISTORY_COMPACT_MIN && history_dead > history_ids->len)
+        fd = history_compact(fd);
+
+    return fd;
+}
+
+/* Rewrites the log as one URI record and one title record per URI. This
+ * folds all visit records into the URI records. Returns the new log, or
+ * fd if that didn't work out. */
+int
+history_compact(int fd)
+{
+    struct history_uri rec;
+    struct HistoryURI *u;
+    GString *buf;
+    gchar *tmp;
+    guint i;
+    int out;
+
+    buf = g_string_new(HISTORY_MAGIC);
+    for (i = 0; i < history_ids->len; i++)
+    {
+        u = g_ptr_array_index(history_ids, i);
+        memset(&rec, 0, sizeof rec);
+        rec.visits = u->visits;
+        rec.last = u->last;
+        history_append_record(buf, u->id, HISTORY_RECORD_URI, &rec, sizeof rec,
+                              u->uri, strlen(u->uri));
+        if (u->title != NULL)
+            history_append_record(buf, u->id, HISTORY_RECORD_TITLE, NULL, 0,
+                                  u->title, strlen(u->title));
+    }
+
+    tmp = g_strconcat(history_file, ".XXXXXX", NULL);
+    out = g_mkstemp(tmp);
+    if (out == -1 || write_full(out, buf->str, buf->len) != (ssize_t)buf->len ||
+        fdatasync(out) == -1 || rename(tmp, history_file) == -1)
+    {
+        log_error("Could not compact history file: %s", g_strerror(errno));
+        if (out != -1)
+        {
+            close(out);
+            unlink(tmp);
+        }
+        g_free(tmp);
+        g_string_free(buf, TRUE);
+        return fd;
+    }
+
+    log_info("Compacted history file to %u URIs", history_ids->len);
+
+    if (fd != -1)
+        close(fd);
+    history_dead = 0;
+    g_free(tmp);
+    g_string_free(buf, TRUE);
+
+    return out;
+}
+
+/* Returns the dictionary entry of uri, defining it if needed. The URI
+ * record of a new entry is appended to buf, unless that is NULL. */
+struct HistoryURI *
+history_lookup(const gchar *uri, gsize len, GString *buf)
+{
+    struct history_uri rec;
+    struct HistoryURI *u;
+    gchar *key;
+
+    key = g_strndup(uri, len);
+    u = g_hash_table_lookup(history_uris, key);
+    if (u != NULL)
+    {
+        g_free(key);
+        return u;
+    }
+
+    u = g_new0(struct HistoryURI, 1);
+    u->uri = key;
+    u->id = history_ids->len;
+    g_hash_table_insert(history_uris, u->uri, u);
+    g_ptr_array_add(history_ids, u);
+
+    if (buf != NULL)
+    {
+        memset(&rec, 0, sizeof rec);
+        history_append_record(buf, u->id, HISTORY_RECORD_URI, &rec, sizeof rec,
+                              u->uri, len);
+    }
+
+    return u;
+}
+
+void
+history_append_record(GString *buf, guint32 id, guint8 type, gconstpointer fixed,
+                      gsize fixed_len, const gchar *text, gsize text_len)
+{
+    struct history_header hdr;
+
+    memset(&hdr, 0, sizeof hdr);
+    hdr.id = id;
+    hdr.type = type;
+    hdr.len = fixed_len + text_len;
+
+    g_string_append_len(buf, (const gchar *)&hdr, sizeof hdr);
+    if (fixed_len > 0)
+        g_string_append_len(buf, fixed, fixed_len);
+    if (text_len > 0)
+        g_string_append_len(buf, text, text_len);
+}
+
+gboolean
+history_loaded(gpointer data)
+{
+    struct HistoryLog *log = (struct HistoryLog *)data;
+
+    history_index_setup(log);
+    g_free(log);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* The location bar completes from a trigram index over the history
+ * log. It is built in a worker thread and memory-mapped as-is:
+ *
+ *     header | urls[nurls] | trigrams[ntrigrams] | ranks[nids] |
+ *     postings | strings
+ *
+ * URIs are sorted by visits, so an index ID is also a rank and a query
+ * can stop after the first few verified matches. ranks maps the IDs of
+ * the log to those of the index. Trigrams are sorted for binary search.
+ * Records appended to the log since the index was built, and the visits
+ * of this session, are kept in a small in-memory delta that is scanned
+ * linearly. Once the part of the log that isn't indexed grows too large,
+ * or the log was compacted, the index is rebuilt on the next start. */
+gchar *
+history_index_path(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), NAME, "history.idx", NULL);
+}
+
+/* log is what the writer found when it started. */
+void
+history_index_setup(struct HistoryLog *log)
+{
+    struct history_record r;
+    GHashTable *fresh;
+    const gchar *p, *next, *end, *uri;
+    gchar *path, *tail;
+    gsize len;
+    int fd;
+
+    path = history_index_path();
+    if (!history_index_open(&history_index, path, log))
+    {
+        g_free(path);
+        history_index_rebuild(log);
+        return;
+    }
+    g_free(path);
+
+    len = log->size - history_index.hdr->covered;
+    if (len > HISTORY_INDEX_TAIL_MAX)
+    {
+        history_index_rebuild(log);
+        return;
+    }
+    if (len == 0)
+        return;
+
+    /* Only read what was appended after the index was built. */
+    tail = g_malloc(len);
+    fresh = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    fd = open(history_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || pread(fd, tail, len, history_index.hdr->covered) != (ssize_t)len)
+        log_warn("Could not read history file: %s", g_strerror(errno));
+    else
+    {
+        end = tail + len;
+        for (p = tail; p < end && (next = history_record_next(p, end, &r)) != NULL;
+             p = next)
+        {
+            if (r.type == HISTORY_RECORD_URI)
+            {
+                g_hash_table_insert(fresh, GUINT_TO_POINTER(r.id),
+                                    g_strndup(r.text, r.len));
+                continue;
+            }
+            if (r.type != HISTORY_RECORD_VISIT)
+                continue;
+
+            if (r.id < history_index.hdr->nids)
+                uri = history_index.strings +
+                      history_index.urls[history_index.ranks[r.id]].name;
+            else if ((uri = g_hash_table_lookup(fresh, GUINT_TO_POINTER(r.id))) == NULL)
+                continue;
+            history_delta_add(uri, strlen(uri), TRUE, r.time);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+    g_hash_table_destroy(fresh);
+    g_free(tail);
+}
+
+gboolean
+history_index_open(struct HistoryIndex *hi, const gchar *path, struct HistoryLog *log)
+{
+    const struct HistoryIndexHeader *hdr;
+    struct stat st;
+    guint32 i;
+    int fd;
+
+    memset(hi, 0, sizeof *hi);
 
-        webkit_web_view_evaluate_javascript(web_view, hints_script, -1, NULL, NULL, NULL, NULL, NULL);
-    } else {
-        fprintf(stderr, "Hints are disabled\n");
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return FALSE;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof *hdr)
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    hi->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hi->map == MAP_FAILED)
+    {
+        hi->map = NULL;
+        return FALSE;
+    }
+    hi->size = st.st_size;
+
+    /* An index of another, a compacted or a truncated log is useless. */
+    hdr = hi->map;
+    if (memcmp(hdr->magic, HISTORY_INDEX_MAGIC, sizeof hdr->magic) != 0 ||
+        hdr->size != hi->size || hdr->dev != log->dev || hdr->ino != log->ino ||
+        hdr->covered > log->size || hdr->nids > hdr->nurls ||
+        sizeof *hdr + (guint64)hdr->nurls * sizeof *hi->urls +
+            (guint64)hdr->ntrigrams * sizeof *hi->trigrams +
+            (guint64)hdr->nids * sizeof *hi->ranks > hdr->strings ||
+        hdr->strings >= hdr->size ||
+        ((const gchar *)hi->map)[hdr->size - 1] != 0)
+    {
+        history_index_close(hi);
+        return FALSE;
+    }
+
+    hi->hdr = hdr;
+    hi->urls = (const struct HistoryIndexURL *)(hdr + 1);
+    hi->trigrams = (const struct HistoryIndexTrigram *)(hi->urls + hdr->nurls);
+    hi->ranks = (const guint32 *)(hi->trigrams + hdr->ntrigrams);
+    hi->strings = (const gchar *)hi->map + hdr->strings;
+
+    for (i = 0; i < hdr->nids; i++)
+    {
+        if (hi->ranks[i] >= hdr->nurls)
+        {
+            history_index_close(hi);
+            return FALSE;
+        }
     }
+
+    madvise(hi->map, hi->size, MADV_RANDOM);
+
+    return TRUE;
 }
 
 void
-cooperation_setup(void)
+history_index_close(struct HistoryIndex *hi)
+{
+    if (hi->map != NULL)
+        munmap(hi->map, hi->size);
+    memset(hi, 0, sizeof *hi);
+}
+
+/* Indexes the log as it was when we started. */
+void
+history_index_rebuild(struct HistoryLog *log)
+{
+    struct HistoryLog *data;
+    GTask *task;
+
+    if (history_index_building)
+        return;
+    history_index_building = TRUE;
+
+    log_info("Indexing history file");
+
+    data = g_new(struct HistoryLog, 1);
+    *data = *log;
+    task = g_task_new(NULL, NULL, history_index_build_finished, NULL);
+    g_task_set_task_data(task, data, g_free);
+    g_task_run_in_thread(task, history_index_build_thread);
+    g_object_unref(task);
+}
+
+void
+history_index_build_thread(GTask *task, gpointer source, gpointer task_data,
+                           GCancellable *cancellable)
 {
-    GIOChannel *towatch;
-    gchar *fifofilename, *fifopath;
+    struct HistoryLog *log = (struct HistoryLog *)task_data;
+    struct HistoryIndexHeader hdr;
+    struct HistoryIndexTrigram tri;
+    struct HistoryIndexURL url;
+    struct HistoryMatch match, *m;
+    struct HistoryPostings *list;
+    struct history_record r;
+    guint32 tris[HISTORY_INDEX_TEXT_MAX], id, gap, *ranks;
+    guint64 base;
+    GArray *matches, *urls, *keys, *trigrams;
+    GByteArray *postings, *out;
+    GHashTable *lists;
+    GHashTableIter iter;
+    GMappedFile *mf;
+    GString *strings;
+    GError *err = NULL;
+    const gchar *data, *p, *next, *end;
+    gchar *path, *dir;
+    gpointer key;
+    struct stat st;
+    gboolean ok;
+    guint i, k, n;
+    guchar b;
+    int fd;
+
+    fd = open(history_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(errno),
+                                "%s: %s", history_file, g_strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    if ((guint64)st.st_dev != log->dev || (guint64)st.st_ino != log->ino)
+    {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CHANGED,
+                                "%s was replaced", history_file);
+        close(fd);
+        return;
+    }
+    mf = g_mapped_file_new_from_fd(fd, FALSE, &err);
+    close(fd);
+    if (mf == NULL)
+    {
+        g_task_return_error(task, err);
+        return;
+    }
 
-    fifofilename = g_strdup_printf("%s-%s", NAME".fifo", fifo_suffix);
-    fifopath = g_build_filename(g_get_user_runtime_dir(), fifofilename, NULL);
-    g_free(fifofilename);
+    memset(&hdr, 0, sizeof hdr);
 
-    if (!g_file_test(fifopath, G_FILE_TEST_EXISTS))
-        mkfifo(fifopath, 0600);
+    /* Count visits per URI, indexed by log ID. The writer checked the
+     * log when it started, so a broken record can only be the end of
+     * what has been written since. */
+    data = g_mapped_file_get_contents(mf);
+    end = data + MIN(log->size, g_mapped_file_get_length(mf));
+    p = data + MIN((gsize)(end - data), strlen(HISTORY_MAGIC));
 
-    cooperative_pipe_fp = open(fifopath, O_WRONLY | O_NONBLOCK);
-    if (!cooperative_pipe_fp)
+    matches = g_array_new(FALSE, FALSE, sizeof (struct HistoryMatch));
+    for (; p < end && (next = history_record_next(p, end, &r)) != NULL; p = next)
     {
-        fprintf(stderr, NAME": Can't open FIFO at all.\n");
+        if (r.type == HISTORY_RECORD_URI && r.id == matches->len)
+        {
+            match.uri = g_strndup(r.text, r.len);
+            match.id = r.id;
+            match.visits = r.visits;
+            match.last = r.time;
+            g_array_append_val(matches, match);
+        }
+        else if (r.type == HISTORY_RECORD_VISIT && r.id < matches->len)
+        {
+            m = &g_array_index(matches, struct HistoryMatch, r.id);
+            m->visits++;
+            m->last = MAX(m->last, r.time);
+        }
     }
-    else
+    hdr.covered = p - data;
+    hdr.nids = matches->len;
+
+    g_array_sort(matches, history_index_compare_matches);
+    ranks = g_new(guint32, matches->len + 1);
+    for (id = 0; id < matches->len; id++)
+        ranks[g_array_index(matches, struct HistoryMatch, id).id] = id;
+
+    /* URI table, string pool and one posting list per trigram. IDs are
+     * handed out in ascending order, so they can be delta coded right
+     * away. */
+    strings = g_string_new(NULL);
+    g_string_append_c(strings, 0);
+    urls = g_array_sized_new(FALSE, FALSE, sizeof url, matches->len);
+    lists = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (id = 0; id < matches->len; id++)
     {
-        if (write(cooperative_pipe_fp, "", 0) == -1)
+        m = &g_array_index(matches, struct HistoryMatch, id);
+        url.name = strings->len;
+        url.visits = m->visits;
+        url.last = m->last;
+        g_array_append_val(urls, url);
+        g_string_append_len(strings, m->uri, strlen(m->uri) + 1);
+
+        n = history_index_trigrams(m->uri, strlen(m->uri), tris);
+        for (k = 0; k < n; k++)
         {
-            /* Could not do an empty write to the FIFO which means there's
-             * no one listening. */
-            close(cooperative_pipe_fp);
-            towatch = g_io_channel_new_file(fifopath, "r+", NULL);
-            g_io_add_watch(towatch, G_IO_IN, (GIOFunc)remote_msg, NULL);
+            list = g_hash_table_lookup(lists, GUINT_TO_POINTER(tris[k]));
+            if (list == NULL)
+            {
+                list = g_new0(struct HistoryPostings, 1);
+                list->bytes = g_byte_array_new();
+                g_hash_table_insert(lists, GUINT_TO_POINTER(tris[k]), list);
+            }
+
+            for (gap = id - list->prev; gap >= 0x80; gap >>= 7)
+            {
+                b = (gap & 0x7f) | 0x80;
+                g_byte_array_append(list->bytes, &b, 1);
+            }
+            b = gap;
+            g_byte_array_append(list->bytes, &b, 1);
+            list->prev = id;
+            list->count++;
         }
-        else
-            cooperative_alone = FALSE;
+        g_free((gchar *)m->uri);
+    }
+
+    keys = g_array_sized_new(FALSE, FALSE, sizeof id, g_hash_table_size(lists));
+    g_hash_table_iter_init(&iter, lists);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+    {
+        id = GPOINTER_TO_UINT(key);
+        g_array_append_val(keys, id);
+    }
+    g_array_sort(keys, history_index_compare_u32);
+
+    trigrams = g_array_sized_new(FALSE, FALSE, sizeof tri, keys->len);
+    postings = g_byte_array_new();
+    for (i = 0; i < keys->len; i++)
+    {
+        tri.trigram = g_array_index(keys, guint32, i);
+        list = g_hash_table_lookup(lists, GUINT_TO_POINTER(tri.trigram));
+        tri.count = list->count;
+        tri.postings = postings->len;
+        g_array_append_val(trigrams, tri);
+        g_byte_array_append(postings, list->bytes->data, list->bytes->len);
+        g_byte_array_free(list->bytes, TRUE);
+        g_free(list);
+    }
+    g_hash_table_destroy(lists);
+    g_array_free(keys, TRUE);
+
+    memcpy(hdr.magic, HISTORY_INDEX_MAGIC, sizeof hdr.magic);
+    hdr.dev = st.st_dev;
+    hdr.ino = st.st_ino;
+    hdr.nurls = urls->len;
+    hdr.ntrigrams = trigrams->len;
+    base = sizeof hdr + (guint64)urls->len * sizeof url +
+           (guint64)trigrams->len * sizeof tri + (guint64)hdr.nids * sizeof *ranks;
+    for (i = 0; i < trigrams->len; i++)
+        g_array_index(trigrams, struct HistoryIndexTrigram, i).postings += base;
+    hdr.strings = base + postings->len;
+    hdr.size = hdr.strings + strings->len;
+
+    out = g_byte_array_sized_new(hdr.size);
+    g_byte_array_append(out, (guint8 *)&hdr, sizeof hdr);
+    g_byte_array_append(out, (guint8 *)urls->data, urls->len * sizeof url);
+    g_byte_array_append(out, (guint8 *)trigrams->data, trigrams->len * sizeof tri);
+    g_byte_array_append(out, (guint8 *)ranks, hdr.nids * sizeof *ranks);
+    g_byte_array_append(out, postings->data, postings->len);
+    g_byte_array_append(out, (guint8 *)strings->str, strings->len);
+
+    path = history_index_path();
+    dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    if (strings->len > G_MAXUINT32)
+    {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "History too large");
+        ok = FALSE;
     }
+    else
+        ok = g_file_set_contents(path, (gchar *)out->data, out->len, &err);
 
-    g_free(fifopath);
+    g_free(dir);
+    g_free(path);
+    g_free(ranks);
+    g_byte_array_free(out, TRUE);
+    g_byte_array_free(postings, TRUE);
+    g_array_free(trigrams, TRUE);
+    g_array_free(urls, TRUE);
+    g_string_free(strings, TRUE);
+    g_array_free(matches, TRUE);
+    g_mapped_file_unref(mf);
+
+    if (ok)
+        g_task_return_boolean(task, TRUE);
+    else
+        g_task_return_error(task, err);
 }
 
 void
-changed_download_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+history_index_build_finished(GObject *source, GAsyncResult *result, gpointer data)
 {
-    WebKitDownload *download = WEBKIT_DOWNLOAD(obj);
-    WebKitURIResponse *resp;
-    GtkToolItem *tb = GTK_TOOL_ITEM(data);
-    gdouble p, size_mb;
-    const gchar *uri;
-    gchar *t, *filename, *base;
-    guint64 content_length;
+    struct HistoryLog *log = g_task_get_task_data(G_TASK(result));
+    struct HistoryIndex fresh;
+    struct HistoryDelta *d;
+    GError *err = NULL;
+    gchar *path;
+    guint i;
 
-    p = webkit_download_get_estimated_progress(download);
-    p = p > 1 ? 1 : p;
-    p = p < 0 ? 0 : p;
-    p *= 100;
-    resp = webkit_download_get_response(download);
-    content_length = webkit_uri_response_get_content_length(resp);
-    size_mb = content_length / 1e6;
+    history_index_building = FALSE;
 
-    uri = webkit_download_get_destination(download);
-    filename = g_filename_from_uri(uri, NULL, NULL);
-    if (filename == NULL)
+    if (!g_task_propagate_boolean(G_TASK(result), &err))
     {
-        fprintf(stderr, NAME": Could not construct file name from URI!\n");
-        t = g_strdup_printf("%s (%.0f%% of %.1f MB)",
-                            webkit_uri_response_get_uri(resp), p, size_mb);
+        log_error("Could not index history: %s", err->message);
+        g_error_free(err);
+        return;
     }
-    else
+
+    path = history_index_path();
+    if (!history_index_open(&fresh, path, log))
     {
-        base = g_path_get_basename(filename);
-        t = g_strdup_printf("%s (%.0f%% of %.1f MB)", base, p, size_mb);
-        g_free(filename);
-        g_free(base);
+        log_error("Could not load history index '%s'", path);
+        g_free(path);
+        return;
     }
-    gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), t);
-    g_free(t);
+    g_free(path);
 
-    // If the download is complete, remove it from the active downloads
-    if (p >= 100) {
-        downloads--;
-        gtk_widget_destroy(GTK_WIDGET(tb));
+    /* Everything up to the start of this session is indexed now. Keep
+     * only this session's visits in the delta. */
+    for (i = 0; i < history_delta_list->len; )
+    {
+        d = g_ptr_array_index(history_delta_list, i);
+        d->visits_file = 0;
+        if (d->visits_session == 0)
+        {
+            g_hash_table_remove(history_delta, d->uri);
+            g_ptr_array_remove_index_fast(history_delta_list, i);
+            g_free(d->uri);
+            g_free(d);
+            continue;
+        }
+        i++;
     }
+
+    history_index_close(&history_index);
+    history_index = fresh;
 }
 
-void changed_load_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+/* Sorted, unique trigrams of the lower-cased start of s. */
+guint
+history_index_trigrams(const gchar *s, gsize len, guint32 *out)
 {
-    struct Client *c = (struct Client *)data;
-    gdouble p;
-    gchar *grab_feeds =
-        "a = document.querySelectorAll('"
-        "    html > head > link[rel=\"alternate\"][href][type=\"application/atom+xml\"],"
-        "    html > head > link[rel=\"alternate\"][href][type=\"application/rss+xml\"]"
-        "');"
-        "if (a.length == 0)"
-        "    null;"
-        "else"
-        "{"
-        "    out = '';"
-        "    for (i = 0; i < a.length; i++)"
-        "    {"
-        "        url = encodeURIComponent(a[i].href);"
-        "        if ('title' in a[i] && a[i].title != '')"
-        "            title = encodeURIComponent(a[i].title);"
-        "        else"
-        "            title = url;"
-        "        out += '<li><a href=\"' + url + '\">' + title + '</a></li>';"
-        "    }"
-        "    out;"
-        "}";
+    guint i, n = 0, unique = 0;
 
-    p = webkit_web_view_get_estimated_load_progress(WEBKIT_WEB_VIEW(c->web_view));
-    if (p == 1)
+    len = MIN(len, HISTORY_INDEX_TEXT_MAX);
+    for (i = 0; i + 2 < len; i++)
+        out[n++] = (guint32)(guchar)g_ascii_tolower(s[i]) << 16 |
+                   (guint32)(guchar)g_ascii_tolower(s[i + 1]) << 8 |
+                   (guint32)(guchar)g_ascii_tolower(s[i + 2]);
+
+    qsort(out, n, sizeof *out, history_index_compare_u32);
+    for (i = 0; i < n; i++)
+        if (unique == 0 || out[unique - 1] != out[i])
+            out[unique++] = out[i];
+
+    return unique;
+}
+
+gint
+history_index_compare_u32(gconstpointer a, gconstpointer b)
+{
+    guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+gint
+history_index_compare_trigrams(gconstpointer key, gconstpointer elem)
+{
+    guint32 t = *(const guint32 *)key;
+    const struct HistoryIndexTrigram *tri = elem;
+
+    return t < tri->trigram ? -1 : t > tri->trigram;
+}
+
+/* Most visited first, then most recent first. */
+gint
+history_index_compare_matches(gconstpointer a, gconstpointer b)
+{
+    const struct HistoryMatch *x = a, *y = b;
+
+    if (x->visits != y->visits)
+        return x->visits > y->visits ? -1 : 1;
+    return x->last > y->last ? -1 : x->last < y->last;
+}
+
+gboolean
+history_cursor_next(struct HistoryCursor *cur)
+{
+    guint32 gap = 0;
+    guint shift = 0;
+
+    if (cur->left == 0)
+        return FALSE;
+
+    do
     {
-        p = 0;
+        gap |= (guint32)(*cur->p & 0x7f) << shift;
+        shift += 7;
+    } while (*cur->p++ & 0x80);
 
-        /* The page has loaded fully. We now run the short JavaScript
-         * snippet above that operates on the DOM. It tries to grab all
-         * occurences of <link rel="alternate" ...>, i.e. RSS/Atom feed
-         * references. */
-        webkit_web_view_evaluate_javascript(WEBKIT_WEB_VIEW(c->web_view),
-                                            grab_feeds, -1, NULL, NULL,
-                                            NULL, grab_feeds_finished, c);
+    cur->id = cur->started ? cur->id + gap : gap;
+    cur->started = TRUE;
+    cur->left--;
 
-        run_user_scripts(WEBKIT_WEB_VIEW(c->web_view));
-    }
-    gtk_entry_set_progress_fraction(GTK_ENTRY(c->location), p);
+    return TRUE;
+}
+
+/* Case-insensitive substring search, needle must be in lower case. */
+gboolean
+history_contains(const gchar *haystack, const gchar *needle)
+{
+    gsize len = strlen(needle);
+
+    for (; *haystack != 0; haystack++)
+        if (g_ascii_tolower(*haystack) == needle[0] &&
+            g_ascii_strncasecmp(haystack, needle, len) == 0)
+            return TRUE;
+
+    return FALSE;
 }
 
 void
-changed_favicon(GObject *obj, GParamSpec *pspec, gpointer data)
+history_delta_add(const gchar *uri, gsize len, gboolean from_file, gint64 time)
 {
-    struct Client *c = (struct Client *)data;
-    cairo_surface_t *f;
-    int w, h, w_should, h_should;
-    GdkPixbuf *pb, *pb_scaled;
+    struct HistoryDelta *d;
+    gchar *key;
 
-    f = webkit_web_view_get_favicon(WEBKIT_WEB_VIEW(c->web_view));
-    if (f == NULL)
+    key = g_strndup(uri, len);
+    d = g_hash_table_lookup(history_delta, key);
+    if (d == NULL)
     {
-        gtk_image_set_from_icon_name(GTK_IMAGE(c->tabicon), "text-html",
-                                     GTK_ICON_SIZE_SMALL_TOOLBAR);
+        d = g_new0(struct HistoryDelta, 1);
+        d->uri = key;
+        g_hash_table_insert(history_delta, d->uri, d);
+        g_ptr_array_add(history_delta_list, d);
     }
     else
+        g_free(key);
+
+    if (from_file)
+        d->visits_file++;
+    else
+        d->visits_session++;
+    d->last = MAX(d->last, time);
+}
+
+/* Fills out with up to HISTORY_COMPLETION_MAX URIs containing text, best
+ * first. Only the posting lists of the query's trigrams are touched: we
+ * walk the shortest one and skip ahead in the others. */
+guint
+history_complete(const gchar *text, struct HistoryMatch *out)
+{
+    struct HistoryCursor cursors[HISTORY_INDEX_TEXT_MAX], cur;
+    guint32 tris[HISTORY_INDEX_TEXT_MAX];
+    const struct HistoryIndexTrigram *tri;
+    const struct HistoryIndexURL *url;
+    struct HistoryMatch match;
+    struct HistoryDelta *d;
+    gboolean exhausted = FALSE;
+    gchar *needle;
+    guint i, j, k, n = 0, ntris = 0, worst;
+
+    needle = g_ascii_strdown(text, -1);
+
+    if (history_index.map != NULL)
+        ntris = history_index_trigrams(needle, strlen(needle), tris);
+
+    for (i = 0; i < ntris; i++)
     {
-        w = cairo_image_surface_get_width(f);
-        h = cairo_image_surface_get_height(f);
-        pb = gdk_pixbuf_get_from_surface(f, 0, 0, w, h);
-        if (pb != NULL)
+        tri = bsearch(&tris[i], history_index.trigrams, history_index.hdr->ntrigrams,
+                      sizeof *tri, history_index_compare_trigrams);
+        if (tri == NULL)
         {
-            w_should = 16 * gtk_widget_get_scale_factor(c->tabicon);
-            h_should = 16 * gtk_widget_get_scale_factor(c->tabicon);
-            pb_scaled = gdk_pixbuf_scale_simple(pb, w_should, h_should,
-                                                GDK_INTERP_BILINEAR);
-            gtk_image_set_from_pixbuf(GTK_IMAGE(c->tabicon), pb_scaled);
-
-            g_object_unref(pb_scaled);
-            g_object_unref(pb);
+            exhausted = TRUE;
+            break;
         }
+
+        cur.p = (const guchar *)history_index.map + tri->postings;
+        cur.left = tri->count;
+        cur.id = 0;
+        cur.started = FALSE;
+
+        /* Keep the cursors sorted by length. */
+        for (j = i; j > 0 && cursors[j - 1].left > cur.left; j--)
+            cursors[j] = cursors[j - 1];
+        cursors[j] = cur;
     }
-}
 
-void
-changed_title(GObject *obj, GParamSpec *pspec, gpointer data)
-{
-    const gchar *t, *u;
-    struct Client *c = (struct Client *)data;
+    /* The rarest few trigrams narrow things down enough, the substring
+     * check below does the rest. */
+    ntris = MIN(ntris, HISTORY_QUERY_TRIGRAMS);
 
-    u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
-    t = webkit_web_view_get_title(WEBKIT_WEB_VIEW(c->web_view));
+    while (ntris > 0 && !exhausted && n < HISTORY_COMPLETION_MAX &&
+           history_cursor_next(&cursors[0]))
+    {
+        for (j = 1; j < ntris; j++)
+        {
+            while (!cursors[j].started || cursors[j].id < cursors[0].id)
+            {
+                if (!history_cursor_next(&cursors[j]))
+                {
+                    exhausted = TRUE;
+                    break;
+                }
+            }
+            if (exhausted || cursors[j].id != cursors[0].id)
+                break;
+        }
+        if (j < ntris || cursors[0].id >= history_index.hdr->nurls)
+            continue;
+
+        /* Trigrams may match in any order, check the real thing. */
+        url = &history_index.urls[cursors[0].id];
+        if (!history_contains(history_index.strings + url->name, needle))
+            continue;
+
+        out[n].uri = history_index.strings + url->name;
+        out[n].visits = url->visits;
+        out[n].last = url->last;
+        if ((d = g_hash_table_lookup(history_delta, out[n].uri)) != NULL)
+        {
+            out[n].visits += d->visits_file + d->visits_session;
+            out[n].last = d->last;
+        }
+        n++;
+    }
 
-    u = u == NULL ? NAME : u;
-    u = u[0] == 0 ? NAME : u;
+    k = n;
+    for (i = 0; i < history_delta_list->len; i++)
+    {
+        d = g_ptr_array_index(history_delta_list, i);
+        if (!history_contains(d->uri, needle))
+            continue;
+
+        for (j = 0; j < k && strcmp(out[j].uri, d->uri) != 0; j++)
+            ;
+        if (j < k)
+            continue;  // Already counted above
+
+        match.uri = d->uri;
+        match.visits = d->visits_file + d->visits_session;
+        match.last = d->last;
+        if (n < HISTORY_COMPLETION_MAX)
+            out[n++] = match;
+        else
+        {
+            for (worst = 0, j = 1; j < n; j++)
+                if (history_index_compare_matches(&out[j], &out[worst]) > 0)
+                    worst = j;
+            if (history_index_compare_matches(&match, &out[worst]) < 0)
+                out[worst] = match;
+        }
+    }
 
-    t = t == NULL ? u : t;
-    t = t[0] == 0 ? u : t;
+    qsort(out, n, sizeof *out, history_index_compare_matches);
+    g_free(needle);
 
-    gtk_label_set_text(GTK_LABEL(c->tablabel), t);
-    gtk_widget_set_tooltip_text(c->tablabel, t);
-    mainwindow_title(gtk_notebook_get_current_page(GTK_NOTEBOOK(mw.notebook)));
+    return n;
 }
 
 void
-changed_uri(GObject *obj, GParamSpec *pspec, gpointer data)
+location_changed(GtkEditable *editable, gpointer data)
 {
+    struct HistoryMatch matches[HISTORY_COMPLETION_MAX];
     const gchar *t;
-    struct Client *c = (struct Client *)data;
-    FILE *fp;
+    guint i, n;
 
-    t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+    /* The text also changes when a page changes its URI. */
+    if (!gtk_widget_has_focus(GTK_WIDGET(editable)))
+        return;
 
-    /* When a web process crashes, we get a "notify::uri" signal, but we
-     * can no longer read a meaningful URI. It's just an empty string
-     * now. Not updating the location bar in this scenario is important,
-     * because we would override the "WEB PROCESS CRASHED" message. */
-    if (t != NULL && strlen(t) > 0)
-    {
-        gtk_entry_set_text(GTK_ENTRY(c->location), t);
+    gtk_list_store_clear(history_completions);
+
+    t = gtk_entry_get_text(GTK_ENTRY(editable));
+    if (strlen(t) < 3 || (t[0] == ':' && t[1] == '/'))
+        return;
+
+    n = history_complete(t, matches);
+    for (i = 0; i < n; i++)
+        gtk_list_store_insert_with_values(history_completions, NULL, -1,
+                                          0, matches[i].uri, -1);
+}
+
+gboolean
+location_completion_match(GtkEntryCompletion *completion, const gchar *key,
+                          GtkTreeIter *iter, gpointer data)
+{
+    /* The model only ever contains matches. */
+    return TRUE;
+}
 
-        if (history_file != NULL)
-        {
-            fp = fopen(history_file, "a");
-            if (fp != NULL)
-            {
-                fprintf(fp, "%s\n", t);
-                fclose(fp);
-            }
-            else
-                perror(NAME": Error opening history file");
-        }
-    }
+gboolean
+location_completion_selected(GtkEntryCompletion *completion, GtkTreeModel *model,
+                             GtkTreeIter *iter, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gchar *uri;
+
+    gtk_tree_model_get(model, iter, 0, &uri, -1);
+    gtk_widget_grab_focus(c->web_view);
+    gtk_entry_set_text(GTK_ENTRY(c->location), uri);
+    webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), uri);
+    g_free(uri);
+
+    return TRUE;
 }
 
 gboolean
@@ -905,9 +6178,22 @@ decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
               WebKitPolicyDecisionType type, gpointer data)
 {
     WebKitResponsePolicyDecision *r;
+    WebKitNavigationAction *a;
+    const gchar *uri;
 
     switch (type)
     {
+        case WEBKIT_POLICY_DECISION_TYPE_NAVIGATION_ACTION:
+        case WEBKIT_POLICY_DECISION_TYPE_NEW_WINDOW_ACTION:
+            /* Subresources are handled by we_blocklist.so. */
+            a = webkit_navigation_policy_decision_get_navigation_action(
+                WEBKIT_NAVIGATION_POLICY_DECISION(decision));
+            uri = webkit_uri_request_get_uri(webkit_navigation_action_get_request(a));
+            if (!blocklist_match_uri(&blocklist, uri))
+                return FALSE;
+            log_debug("Blocked navigation to %s", uri);
+            webkit_policy_decision_ignore(decision);
+            break;
         case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
             r = WEBKIT_RESPONSE_POLICY_DECISION(decision);
             if (!webkit_response_policy_decision_is_mime_type_supported(r))
@@ -925,6 +6211,9 @@ decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
 void
 download_handle_finished(WebKitDownload *download, gpointer data)
 {
+    trace_async('e', "download", GPOINTER_TO_SIZE(download), NULL);
+    if (g_queue_remove(&active_downloads, download))
+        g_object_unref(download);
     downloads--;
     if (downloads == 0 && gtk_widget_get_visible(dm.win)) {
         gtk_widget_hide(dm.win);
@@ -958,7 +6247,7 @@ download_handle(WebKitDownload *download, gchar *suggested_filename, gpointer da
 
     // If the content length is 0, cancel the download
     if (content_length == 0) {
-        fprintf(stderr, NAME": Download cancelled due to zero content length\n");
+        log_warn("Download cancelled due to zero content length");
         webkit_download_cancel(download);
         return FALSE;
     }
@@ -986,7 +6275,7 @@ download_handle(WebKitDownload *download, gchar *suggested_filename, gpointer da
 
     if (suffix == 1000)
     {
-        fprintf(stderr, NAME": Suffix reached limit for download.\n");
+        log_warn("Suffix reached limit for download.");
         webkit_download_cancel(download);
     }
     else
@@ -1008,6 +6297,9 @@ download_handle(WebKitDownload *download, gchar *suggested_filename, gpointer da
                          G_CALLBACK(changed_download_progress), tb);
 
         downloads++;
+        g_queue_push_tail(&active_downloads, g_object_ref(download));
+        trace_async('b', "download", GPOINTER_TO_SIZE(download),
+                    webkit_uri_request_get_uri(webkit_download_get_request(download)));
         g_signal_connect(G_OBJECT(download), "finished",
                          G_CALLBACK(download_handle_finished), NULL);
 
@@ -1073,14 +6365,9 @@ downloadmanager_setup(void)
 gchar *
 ensure_uri_scheme(const gchar *t)
 {
-    static GRegex *url_regex = NULL;
     gchar *f, *fabs;
 
-    if (!url_regex) {
-        url_regex = g_regex_new("^[a-zA-Z0-9-]+\\.[a-zA-Z]{2,}(\\S*)?$", 0, 0, NULL);
-    }
-
-    if (g_regex_match(url_regex, t, 0, NULL)) {
+    if (uri_is_bare_host(t)) {
         return g_strdup_printf("http://%s", t);
     }
 
@@ -1090,7 +6377,8 @@ ensure_uri_scheme(const gchar *t)
         !g_str_has_prefix(f, "file:") &&
         !g_str_has_prefix(f, "about:") &&
         !g_str_has_prefix(f, "data:") &&
-        !g_str_has_prefix(f, "webkit:"))
+        !g_str_has_prefix(f, "webkit:") &&
+        !g_str_has_prefix(f, NAME":"))
     {
         g_free(f);
         fabs = realpath(t, NULL);
@@ -1107,6 +6395,49 @@ ensure_uri_scheme(const gchar *t)
     }
 }
 
+/* Whether t looks like "example.com/foo", that is, matches
+ * ^[a-zA-Z0-9-]+\.[a-zA-Z]{2,}\S*$. Spelled out, because compiling a
+ * regex is a noticeable part of handing URIs to a running instance. */
+gboolean
+uri_is_bare_host(const gchar *t)
+{
+    const gchar *p;
+
+    for (p = t; g_ascii_isalnum(*p) || *p == '-'; p++)
+        ;
+    if (p == t || *p++ != '.')
+        return FALSE;
+
+    if (!g_ascii_isalpha(p[0]) || !g_ascii_isalpha(p[1]))
+        return FALSE;
+
+    for (; *p != 0; p++)
+        if (g_ascii_isspace(*p))
+            return FALSE;
+
+    return TRUE;
+}
+
+gchar *
+uri_get_host(const gchar *uri)
+{
+    GUri *u;
+    gchar *host = NULL;
+
+    if (uri == NULL)
+        return NULL;
+
+    u = g_uri_parse(uri, G_URI_FLAGS_NONE, NULL);
+    if (u != NULL)
+    {
+        if (g_uri_get_host(u) != NULL && g_uri_get_host(u)[0] != 0)
+            host = g_ascii_strdown(g_uri_get_host(u), -1);
+        g_uri_unref(u);
+    }
+
+    return host;
+}
+
 void
 grab_environment_configuration(void)
 {
@@ -1116,10 +6447,22 @@ grab_environment_configuration(void)
     if (e != NULL)
         accepted_language[0] = g_strdup(e);
 
+    e = g_getenv(NAME_UPPERCASE"_SPARE_TABS");
+    if (e != NULL)
+        spare_tabs = atoi(e);
+
+    e = g_getenv(NAME_UPPERCASE"_BACKGROUND_TAB_DELAY");
+    if (e != NULL)
+        background_tab_delay = atoi(e);
+
     e = g_getenv(NAME_UPPERCASE"_DISABLE_SMOOTH_SCROLLING");
     if (e != NULL)
         disable_smooth_scrolling = (g_ascii_strcasecmp(e, "true") == 0 || g_ascii_strcasecmp(e, "1") == 0);
 
+    e = g_getenv(NAME_UPPERCASE"_BLOCKLIST");
+    if (e != NULL)
+        blocklist_file = g_strdup(e);
+
     e = g_getenv(NAME_UPPERCASE"_DOWNLOAD_DIR");
     if (e != NULL)
         download_dir = g_strdup(e);
@@ -1128,14 +6471,94 @@ grab_environment_configuration(void)
     if (e != NULL)
         enable_console_to_stdout = (g_ascii_strcasecmp(e, "true") == 0 || g_ascii_strcasecmp(e, "1") == 0);
 
-    e = g_getenv(NAME_UPPERCASE"_FIFO_SUFFIX");
+    e = g_getenv(NAME_UPPERCASE"_SOCKET_SUFFIX");
+    if (e != NULL)
+        socket_suffix = g_strdup(e);
+
+    e = g_getenv(NAME_UPPERCASE"_HIBERNATE_AFTER");
     if (e != NULL)
-        fifo_suffix = g_strdup(e);
+        hibernate_after = atoi(e);
+
+    e = g_getenv(NAME_UPPERCASE"_HIBERNATE_BUDGET");
+    if (e != NULL)
+        hibernate_budget_mb = atoi(e);
+
+    e = g_getenv(NAME_UPPERCASE"_CACHE_MODEL");
+    if (e != NULL)
+    {
+        if (strcmp(e, "viewer") == 0)
+            cache_profile = CACHE_PROFILE_VIEWER;
+        if (strcmp(e, "browser") == 0)
+            cache_profile = CACHE_PROFILE_BROWSER;
+        if (strcmp(e, "custom") == 0)
+            cache_profile = CACHE_PROFILE_CUSTOM;
+    }
+
+    e = g_getenv(NAME_UPPERCASE"_DISK_CACHE_DIR");
+    if (e != NULL)
+        disk_cache_dir = g_strdup(e);
+
+    e = g_getenv(NAME_UPPERCASE"_DISK_CACHE_BUDGET");
+    if (e != NULL)
+        disk_cache_budget_mb = atoi(e);
+
+    e = g_getenv(NAME_UPPERCASE"_MEMORY_LIMIT");
+    if (e != NULL)
+        memory_limit_mb = atoi(e);
+
+    e = g_getenv(NAME_UPPERCASE"_SESSION_FILE");
+    if (e != NULL)
+        session_file = g_strdup(e);
 
     e = g_getenv(NAME_UPPERCASE"_HISTORY_FILE");
     if (e != NULL)
         history_file = g_strdup(e);
 
+    e = g_getenv(NAME_UPPERCASE"_LOG_LEVEL");
+    if (e != NULL)
+    {
+        if (strcmp(e, "debug") == 0)
+            log_level = LOG_LEVEL_DEBUG;
+        if (strcmp(e, "info") == 0)
+            log_level = LOG_LEVEL_INFO;
+        if (strcmp(e, "warn") == 0)
+            log_level = LOG_LEVEL_WARN;
+        if (strcmp(e, "error") == 0)
+            log_level = LOG_LEVEL_ERROR;
+        if (strcmp(e, "none") == 0)
+            log_level = LOG_LEVEL_NONE;
+    }
+
+    e = g_getenv(NAME_UPPERCASE"_PAGELOAD_FILE");
+    if (e != NULL)
+        pageload_file = g_strdup(e);
+
+    e = g_getenv(NAME_UPPERCASE"_TRACE");
+    if (e != NULL && e[0] != 0)
+        trace_file = g_strdup(e);
+
+    e = g_getenv(NAME_UPPERCASE"_HISTORY_FSYNC");
+    if (e != NULL)
+    {
+        if (strcmp(e, "never") == 0)
+            history_fsync = HISTORY_FSYNC_NEVER;
+        if (strcmp(e, "exit") == 0)
+            history_fsync = HISTORY_FSYNC_EXIT;
+        if (strcmp(e, "batch") == 0)
+            history_fsync = HISTORY_FSYNC_BATCH;
+    }
+
+    e = g_getenv(NAME_UPPERCASE"_SESSION_FSYNC");
+    if (e != NULL)
+    {
+        if (strcmp(e, "never") == 0)
+            session_fsync = HISTORY_FSYNC_NEVER;
+        if (strcmp(e, "exit") == 0)
+            session_fsync = HISTORY_FSYNC_EXIT;
+        if (strcmp(e, "batch") == 0)
+            session_fsync = HISTORY_FSYNC_BATCH;
+    }
+
     e = g_getenv(NAME_UPPERCASE"_HOME_URI");
     if (e != NULL)
         home_uri = g_strdup(e);
@@ -1194,9 +6617,10 @@ void grab_feeds_finished(GObject *object, GAsyncResult *result, gpointer data)
 
     js_value = webkit_web_view_evaluate_javascript_finish(WEBKIT_WEB_VIEW(object),
                                                           result, &err);
+    trace_async('e', "grab_feeds", GPOINTER_TO_SIZE(c), NULL);
     if (!js_value)
     {
-        fprintf(stderr, NAME": Error running javascript: %s\n", err->message);
+        log_warn("Error running javascript: %s", err->message);
         g_error_free(err);
         return;
     }
@@ -1207,8 +6631,8 @@ void grab_feeds_finished(GObject *object, GAsyncResult *result, gpointer data)
         JSCException *exception = jsc_context_get_exception(jsc_value_get_context(js_value));
         if (exception != NULL)
         {
-            fprintf(stderr, NAME": Error running javascript: %s\n",
-                    jsc_exception_get_message(exception));
+            log_warn("Error running javascript: %s",
+                     jsc_exception_get_message(exception));
             g_free(str_value);
         }
         else
@@ -1310,7 +6734,11 @@ key_common(GtkWidget *widget, GdkEvent *event, gpointer data)
         for (unsigned int i = 0; i < LENGTH(keys); i++) {
             if (key_event->keyval == keys[i].keyval && 
                 (key_event->state & (GDK_MOD1_MASK | GDK_CONTROL_MASK | GDK_SHIFT_MASK)) == keys[i].mod) {
-                return keys[i].func(c, keys[i].arg);
+                gint64 t0 = trace_begin();
+                gboolean handled = keys[i].func(c, keys[i].arg);
+
+                trace_end("key", t0, gdk_keyval_name(key_event->keyval));
+                return handled;
             }
         }
 
@@ -1524,62 +6952,156 @@ key_web_view(GtkWidget *widget, GdkEvent *event, gpointer data)
 void 
 init_default_web_context(void)
 {
-    gchar *p;
+    gchar *p, *we;
+    GVariantBuilder ext_data;
+    WebKitMemoryPressureSettings *mps;
+    WebKitWebsiteDataManager *dm;
     WebKitWebContext *wc;
 
-    wc = webkit_web_context_get_default();
+    /* Has to happen before the context exists. */
+    if (memory_limit_mb > 0)
+    {
+        mps = webkit_memory_pressure_settings_new();
+        webkit_memory_pressure_settings_set_memory_limit(mps, memory_limit_mb);
+        webkit_web_context_set_memory_pressure_settings(mps);
+        webkit_memory_pressure_settings_free(mps);
+    }
+
+    /* Everything else stays where the default context keeps it. */
+    if (disk_cache_dir == NULL)
+        disk_cache_dir = g_build_filename(g_get_user_cache_dir(), NAME, NULL);
+    dm = webkit_website_data_manager_new("disk-cache-directory", disk_cache_dir, NULL);
+    web_context = wc = webkit_web_context_new_with_website_data_manager(dm);
+    g_object_unref(dm);
 
+    /* WebKit only takes one directory. A user directory replaces the
+     * installed one, so it must carry we_blocklist.so as well. */
     p = g_build_filename(g_get_user_config_dir(), NAME, "web_extensions", NULL);
-    webkit_web_context_set_web_extensions_directory(wc, p);
+    if (g_file_test(p, G_FILE_TEST_IS_DIR))
+    {
+        we = g_build_filename(p, "we_blocklist.so", NULL);
+        if (!g_file_test(we, G_FILE_TEST_EXISTS))
+            log_warn("'%s' lacks we_blocklist.so, requests to blocked "
+                     "hosts won't be cancelled", p);
+        g_free(we);
+        webkit_web_context_set_web_extensions_directory(wc, p);
+    }
+    else
+        webkit_web_context_set_web_extensions_directory(wc, WEBEXTDIR);
     g_free(p);
 
     g_signal_connect(G_OBJECT(wc), "download-started",
                      G_CALLBACK(download_handle_start), NULL);
 
+    /* Pages of our own, only cream:stats for now. Web pages can't load
+     * them. */
+    webkit_web_context_register_uri_scheme(wc, NAME, stats_request, NULL, NULL);
+    webkit_security_manager_register_uri_scheme_as_local(
+        webkit_web_context_get_security_manager(wc), NAME);
+
     trust_user_certs(wc);
 
-    WebKitSettings *settings = webkit_settings_new();
-    
-    // Apply performance and resource usage settings
-    webkit_settings_set_enable_site_specific_quirks(settings, enable_site_specific_quirks);
-    webkit_settings_set_enable_write_console_messages_to_stdout(settings, enable_write_console_messages_to_stdout);
-    webkit_settings_set_enable_media_capabilities(settings, enable_media_capabilities);
-    webkit_settings_set_enable_page_cache(settings, enable_page_cache);
-    webkit_settings_set_enable_encrypted_media(settings, enable_encrypted_media);
-    
-    // Set a more conservative cache model
-    webkit_web_context_set_cache_model(wc, WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
-    
-    // Apply minimalistic UI settings
-    webkit_settings_set_enable_site_specific_quirks(settings, !disable_site_icons);
-    
+    user_content = webkit_user_content_manager_new();
+    if (ENABLE_HINTS)
+        webkit_user_content_manager_add_script(user_content, hints_user_script());
+    adblock_setup();
+
+    /* The document viewer model turns off WebKit's memory and disk
+     * caches and its page cache, whatever the settings say. */
+    switch (cache_profile)
+    {
+        case CACHE_PROFILE_VIEWER:
+            webkit_web_context_set_cache_model(wc, WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+            enable_page_cache = FALSE;
+            break;
+        case CACHE_PROFILE_BROWSER:
+            webkit_web_context_set_cache_model(wc, WEBKIT_CACHE_MODEL_WEB_BROWSER);
+            enable_page_cache = TRUE;
+            break;
+        default:
+            webkit_web_context_set_cache_model(wc, custom_cache_model);
+    }
+
+    /* One settings object for all tabs, so changing it affects all of
+     * them at once. */
+    web_settings = webkit_settings_new();
+
+    if (user_agent != NULL) {
+        webkit_settings_set_user_agent(web_settings, user_agent);
+    }
+
+    // Apply WebKit settings
+    webkit_settings_set_enable_javascript(web_settings, enable_javascript);
+    webkit_settings_set_auto_load_images(web_settings, enable_images);
+    webkit_settings_set_enable_webgl(web_settings, enable_webgl);
+    webkit_settings_set_hardware_acceleration_policy(web_settings, 
+        enable_hardware_acceleration ? WEBKIT_HARDWARE_ACCELERATION_POLICY_ALWAYS : WEBKIT_HARDWARE_ACCELERATION_POLICY_NEVER);
+
+    // Apply additional WebKit settings
+    webkit_settings_set_enable_page_cache(web_settings, enable_page_cache);
+    webkit_settings_set_enable_developer_extras(web_settings, enable_developer_extras);
+    webkit_settings_set_enable_fullscreen(web_settings, enable_fullscreen);
+    webkit_settings_set_enable_dns_prefetching(web_settings, enable_dns_prefetching);
+    webkit_settings_set_enable_hyperlink_auditing(web_settings, enable_hyperlink_auditing);
+    webkit_settings_set_media_playback_requires_user_gesture(web_settings, !enable_media_stream);
+    webkit_settings_set_print_backgrounds(web_settings, print_backgrounds);
+ 
+    // Font Settings   
+    webkit_settings_set_default_charset(web_settings, default_charset);
+    webkit_settings_set_default_font_family(web_settings, sans_serif_font_family);
+    webkit_settings_set_serif_font_family(web_settings, serif_font_family);
+    webkit_settings_set_monospace_font_family(web_settings, monospace_font_family);
+    webkit_settings_set_minimum_font_size(web_settings, minimum_font_size);
+    webkit_settings_set_default_font_size(web_settings, default_font_size);
+    webkit_settings_set_default_monospace_font_size(web_settings, default_monospace_font_size);
+
+    webkit_settings_set_javascript_can_open_windows_automatically(web_settings, javascript_can_open_windows);
+    webkit_settings_set_enable_webrtc(web_settings, enable_webrtc);
+    webkit_settings_set_enable_mediasource(web_settings, enable_mediasource);
+    webkit_settings_set_enable_javascript_markup(web_settings, enable_javascript_markup);
+    webkit_settings_set_enable_resizable_text_areas(web_settings, enable_resizable_text_areas);
+    webkit_settings_set_enable_html5_local_storage(web_settings, enable_html5_local_storage);
+
+    // Apply new performance and resource usage settings
+    webkit_settings_set_enable_site_specific_quirks(web_settings, enable_site_specific_quirks);
+    webkit_settings_set_enable_write_console_messages_to_stdout(web_settings, enable_write_console_messages_to_stdout);
+    webkit_settings_set_enable_media_capabilities(web_settings, enable_media_capabilities);
+    webkit_settings_set_enable_encrypted_media(web_settings, enable_encrypted_media);
+
+    webkit_settings_set_enable_smooth_scrolling(web_settings, !disable_smooth_scrolling);
+
+    if (accepted_language[0] != NULL)
+        webkit_web_context_set_preferred_languages(wc, accepted_language);
+    webkit_web_context_set_spell_checking_languages(wc, spell_checking_languages);
+    webkit_web_context_set_spell_checking_enabled(wc, enable_spell_checking);
+
     // Apply additional privacy settings
     webkit_cookie_manager_set_accept_policy(
         webkit_web_context_get_cookie_manager(wc),
         block_third_party_cookies ? WEBKIT_COOKIE_POLICY_ACCEPT_NO_THIRD_PARTY : WEBKIT_COOKIE_POLICY_ACCEPT_ALWAYS
     );
 
-    webkit_web_context_set_web_extensions_initialization_user_data(wc, 
-        g_variant_new_boolean(enable_back_forward_navigation_gestures));
+    if (blocklist_file == NULL)
+        blocklist_file = g_build_filename(g_get_user_cache_dir(), NAME, "blocklist", NULL);
+    if (blocklist_open(&blocklist, blocklist_file) == -1 &&
+        g_file_test(blocklist_file, G_FILE_TEST_EXISTS))
+        log_error("Blocklist '%s' is damaged, rebuild it", blocklist_file);
+
+    g_variant_builder_init(&ext_data, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&ext_data, "{sv}", "back-forward-navigation-gestures",
+                          g_variant_new_boolean(enable_back_forward_navigation_gestures));
+    if (blocklist.map != NULL)
+        g_variant_builder_add(&ext_data, "{sv}", "blocklist",
+                              g_variant_new_string(blocklist_file));
+    webkit_web_context_set_web_extensions_initialization_user_data(wc,
+        g_variant_builder_end(&ext_data));
 
     // Set favicon cache directory
     gchar *favicon_cache_dir = g_build_filename(g_get_user_cache_dir(), NAME, "favicons", NULL);
     webkit_web_context_set_favicon_database_directory(wc, disable_site_icons ? NULL : favicon_cache_dir);
     g_free(favicon_cache_dir);
 
-    // Set the settings for the default web view
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(webkit_web_view_new());
-    webkit_web_view_set_settings(web_view, settings);
-    
-    // Ensure proper reference management
-    g_object_ref_sink(web_view);
-    g_object_unref(web_view);
-
-    // Clean up
-    g_object_unref(settings);
-
-    // Print a note about the GStreamer FDK AAC plugin
-    g_print("Note: If you encounter issues with AAC playback, you may need to install the GStreamer FDK AAC plugin.\n");
+    log_info("Note: If you encounter issues with AAC playback, you may need to install the GStreamer FDK AAC plugin.");
 }
 
 void
@@ -1596,6 +7118,21 @@ mainwindow_setup(void)
     gtk_container_add(GTK_CONTAINER(mw.win), mw.notebook);
     g_signal_connect(G_OBJECT(mw.notebook), "switch-page",
                      G_CALLBACK(notebook_switch_page), NULL);
+    if (session_file != NULL)
+    {
+        g_signal_connect(G_OBJECT(mw.notebook), "page-added",
+                         G_CALLBACK(session_pages_changed),
+                         GINT_TO_POINTER(SESSION_PAGE_ADDED));
+        g_signal_connect(G_OBJECT(mw.notebook), "page-removed",
+                         G_CALLBACK(session_pages_changed),
+                         GINT_TO_POINTER(SESSION_PAGES_CHANGED));
+        g_signal_connect(G_OBJECT(mw.notebook), "page-reordered",
+                         G_CALLBACK(session_pages_changed),
+                         GINT_TO_POINTER(SESSION_PAGES_CHANGED));
+        g_signal_connect(G_OBJECT(mw.notebook), "switch-page",
+                         G_CALLBACK(session_pages_changed),
+                         GINT_TO_POINTER(SESSION_PAGE_SWITCHED));
+    }
 }
 
 void
@@ -1617,6 +7154,14 @@ mainwindow_title(gint idx)
 void
 notebook_switch_page(GtkNotebook *nb, GtkWidget *p, guint idx, gpointer data)
 {
+    struct Client *c = g_object_get_data(G_OBJECT(p), "lariza-client");
+
+    if (c != NULL)
+    {
+        c->last_active = g_get_monotonic_time();
+        client_load_pending(c);
+    }
+
     mainwindow_title(idx);
 }
 
@@ -1637,21 +7182,6 @@ quit_if_nothing_active(void)
     return FALSE;
 }
 
-gboolean
-remote_msg(GIOChannel *channel, GIOCondition condition, gpointer data)
-{
-    gchar *uri = NULL;
-
-    g_io_channel_read_line(channel, &uri, NULL, NULL, NULL);
-    if (uri)
-    {
-        g_strstrip(uri);
-        client_new(uri, NULL, TRUE, TRUE);
-        g_free(uri);
-    }
-    return TRUE;
-}
-
 void run_user_scripts(WebKitWebView *web_view)
 {
     static GHashTable *script_cache = NULL;
@@ -1676,7 +7206,11 @@ void run_user_scripts(WebKitWebView *web_view)
                     }
                 }
                 if (contents) {
-                    webkit_web_view_evaluate_javascript(web_view, contents, -1, NULL, NULL, NULL, NULL, NULL);
+                    gsize id = trace_on() ? ++trace_next_id : 0;
+
+                    trace_async('b', "user_script", id, entry);
+                    webkit_web_view_evaluate_javascript(web_view, contents, -1, NULL, NULL, NULL,
+                                                        run_user_script_finished, GSIZE_TO_POINTER(id));
                 }
                 g_free(path);
             }
@@ -1687,6 +7221,23 @@ void run_user_scripts(WebKitWebView *web_view)
     g_free(base);
 }
 
+void run_user_script_finished(GObject *object, GAsyncResult *result, gpointer data)
+{
+    GError *err = NULL;
+    JSCValue *js_value;
+
+    js_value = webkit_web_view_evaluate_javascript_finish(WEBKIT_WEB_VIEW(object),
+                                                          result, &err);
+    trace_async('e', "user_script", GPOINTER_TO_SIZE(data), NULL);
+    if (js_value == NULL)
+    {
+        log_debug("User script failed: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+    g_object_unref(js_value);
+}
+
 void
 search(gpointer data, gint direction)
 {
@@ -1701,6 +7252,16 @@ search(gpointer data, gint direction)
 
     switch (direction) {
         case 0:
+            /* The web process counts all matches before it answers. */
+            if (trace_on())
+            {
+                search_finished(fc, NULL);
+                g_signal_connect(G_OBJECT(fc), "found-text",
+                                 G_CALLBACK(search_found), NULL);
+                g_signal_connect(G_OBJECT(fc), "failed-to-find",
+                                 G_CALLBACK(search_finished), NULL);
+                trace_async('b', "find", GPOINTER_TO_SIZE(fc), search_text);
+            }
             webkit_find_controller_search(fc, search_text, options, G_MAXUINT);
             break;
         case 1:
@@ -1712,6 +7273,21 @@ search(gpointer data, gint direction)
     }
 }
 
+void
+search_found(WebKitFindController *fc, guint matches, gpointer data)
+{
+    search_finished(fc, data);
+}
+
+/* Ends the "find" span of the trace, if a search is still running. */
+void
+search_finished(WebKitFindController *fc, gpointer data)
+{
+    if (g_signal_handlers_disconnect_by_func(fc, search_found, data) > 0)
+        trace_async('e', "find", GPOINTER_TO_SIZE(fc), NULL);
+    g_signal_handlers_disconnect_by_func(fc, search_finished, data);
+}
+
 void
 show_web_view(WebKitWebView *web_view, gpointer data)
 {
@@ -1750,7 +7326,7 @@ trust_user_certs(WebKitWebContext *wc)
                                        file, NULL);
             cert = g_tls_certificate_new_from_file(absfile, NULL);
             if (cert == NULL)
-                fprintf(stderr, NAME": Could not load trusted cert '%s'\n", file);
+                log_warn("Could not load trusted cert '%s'", file);
             else
                 webkit_web_context_allow_tls_certificate_for_host(wc, cert, file);
             file = g_dir_read_name(dir);
@@ -1773,7 +7349,7 @@ write_full(int fd, char *data, size_t len)
                 r = 0;
             else
             {
-                perror(NAME": write_full");
+                log_error("write_full: %s", g_strerror(errno));
                 return r;
             }
         }
@@ -1786,12 +7362,254 @@ write_full(int fd, char *data, size_t len)
     return done;
 }
 
+/* Every message ends up in a ring buffer in memory, no matter what
+ * log_level says. Only messages at log_level or above are written to
+ * stderr, so the common case costs a snprintf() and no I/O. The ring is
+ * dumped on SIGUSR1 and when we crash. */
+void
+log_setup(void)
+{
+    int crash_signals[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV };
+    struct sigaction sa;
+    size_t i;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = log_crashed;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < LENGTH(crash_signals); i++)
+        sigaction(crash_signals[i], &sa, NULL);
+
+    g_unix_signal_add(SIGUSR1, log_dump_requested, NULL);
+}
+
+void
+log_write(gint level, const gchar *format, ...)
+{
+    static const gchar levels[] = "DIWE";
+    gchar *line;
+    gint64 now;
+    va_list ap;
+    int n;
+
+    /* Several threads may log at once, each of them gets its own line. */
+    line = log_ring[(guint)g_atomic_int_add(&log_next, 1) % LOG_RING_LINES];
+
+    now = g_get_real_time();
+    n = snprintf(line, LOG_LINE_MAX, "%"G_GINT64_FORMAT".%03d %c ",
+                 now / G_USEC_PER_SEC, (int)(now % G_USEC_PER_SEC / 1000),
+                 levels[level]);
+    va_start(ap, format);
+    vsnprintf(line + n, LOG_LINE_MAX - n, format, ap);
+    va_end(ap);
+
+    if (level >= log_level)
+        fprintf(stderr, NAME": %s\n", line + n);
+}
+
+/* Must be async-signal-safe, it's called from log_crashed(). */
+void
+log_dump(int fd)
+{
+    static const char header[] = "---- "NAME" log ----\n";
+    guint next, i;
+    const gchar *line;
+
+    if (write(fd, header, sizeof header - 1) == -1)
+        return;
+
+    next = (guint)g_atomic_int_get(&log_next);
+    for (i = 0; i < LOG_RING_LINES; i++)
+    {
+        line = log_ring[(next + i) % LOG_RING_LINES];
+        if (line[0] == 0)
+            continue;
+        if (write(fd, line, strlen(line)) == -1 || write(fd, "\n", 1) == -1)
+            return;
+    }
+}
+
+gboolean
+log_dump_requested(gpointer data)
+{
+    log_dump(STDERR_FILENO);
+    return G_SOURCE_CONTINUE;
+}
+
+void
+log_crashed(int sig)
+{
+    log_dump(STDERR_FILENO);
+
+    /* SA_RESETHAND restored the default action. */
+    raise(sig);
+}
+
+/* Trace events go to a buffer of the thread that records them. Only
+ * that thread writes to it, so recording takes no lock: the event is
+ * filled in, then published by bumping len. Buffers are never freed,
+ * trace_write() reads them all on exit. With tracing off, the macros
+ * above reduce each trace point to a test of trace_file. */
+void
+trace_add(gchar phase, const gchar *name, gint64 start, gsize id, const gchar *arg)
+{
+    struct TraceBuffer *b = g_private_get(&trace_buffer_key);
+    struct TraceEvent *e;
+    gchar *comm = NULL;
+    gint64 now;
+
+    if (b == NULL)
+    {
+        b = g_malloc(sizeof *b);
+        b->tid = g_atomic_int_add(&trace_threads, 1) + 1;
+        b->len = 0;
+        b->dropped = 0;
+        b->name[0] = 0;
+        if (g_file_get_contents("/proc/thread-self/comm", &comm, NULL, NULL))
+            g_strlcpy(b->name, g_strchomp(comm), sizeof b->name);
+        g_free(comm);
+
+        do
+            b->next = g_atomic_pointer_get(&trace_buffers);
+        while (!g_atomic_pointer_compare_and_exchange(&trace_buffers, b->next, b));
+        g_private_set(&trace_buffer_key, b);
+    }
+
+    if (b->len == TRACE_EVENTS_MAX)
+    {
+        b->dropped++;
+        return;
+    }
+
+    now = g_get_monotonic_time();
+    e = &b->events[b->len];
+    e->phase = phase;
+    e->name = name;
+    e->arg = g_strdup(arg);
+    e->ts = start != 0 ? start : now;
+    e->dur = now - e->ts;
+    e->id = id;
+    g_atomic_int_set(&b->len, b->len + 1);
+}
+
+/* Ends the spans of the navigation going on in c, if any. */
+void
+trace_navigation_end(struct Client *c)
+{
+    gsize id = GPOINTER_TO_SIZE(c->web_view);
+
+    if (c->trace_phase == TRACE_PHASE_NONE)
+        return;
+
+    trace_async('e', c->trace_phase == TRACE_PHASE_PROVISIONAL ? "provisional" : "committed",
+                id, NULL);
+    trace_async('e', "navigation", id, NULL);
+    c->trace_phase = TRACE_PHASE_NONE;
+}
+
+void
+trace_json_string(FILE *fp, const gchar *s)
+{
+    fputc('"', fp);
+    for (; *s != 0; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((guchar)*s < 0x20)
+            fprintf(fp, "\\u%04x", (guchar)*s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+gboolean
+trace_quit(gpointer data)
+{
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
+
+/* Writes all events in Chrome's trace event format, which Perfetto
+ * and chrome://tracing load. */
+void
+trace_write(void)
+{
+    struct TraceBuffer *b;
+    struct TraceEvent *e;
+    const gchar *sep = "\n";
+    guint dropped = 0;
+    gint i, len;
+    FILE *fp;
+    int pid = getpid();
+
+    if (trace_file == NULL)
+        return;
+
+    if ((fp = fopen(trace_file, "w")) == NULL)
+    {
+        log_error("Could not write trace '%s': %s", trace_file, g_strerror(errno));
+        return;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+    for (b = g_atomic_pointer_get(&trace_buffers); b != NULL; b = b->next)
+    {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":", sep, pid, b->tid);
+        trace_json_string(fp, b->name);
+        fputs("}}", fp);
+        sep = ",\n";
+
+        len = g_atomic_int_get(&b->len);
+        for (i = 0; i < len; i++)
+        {
+            e = &b->events[i];
+            fprintf(fp, ",\n{\"name\":");
+            trace_json_string(fp, e->name);
+            fprintf(fp, ",\"cat\":\""NAME"\",\"ph\":\"%c\",\"ts\":%"G_GINT64_FORMAT
+                    ",\"pid\":%d,\"tid\":%d", e->phase, e->ts, pid, b->tid);
+            if (e->phase == 'X')
+                fprintf(fp, ",\"dur\":%"G_GINT64_FORMAT, e->dur);
+            else if (e->phase == 'i')
+                fputs(",\"s\":\"t\"", fp);
+            else
+                fprintf(fp, ",\"id\":\"0x%"G_GSIZE_MODIFIER"x\"", e->id);
+            if (e->arg != NULL)
+            {
+                fputs(",\"args\":{\"arg\":", fp);
+                trace_json_string(fp, e->arg);
+                fputc('}', fp);
+            }
+            fputc('}', fp);
+        }
+        dropped += b->dropped;
+    }
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0)
+        log_error("Could not write trace '%s': %s", trace_file, g_strerror(errno));
+    if (dropped > 0)
+        log_warn("Trace: %u events dropped, buffers were full", dropped);
+}
+
 int main(int argc, char **argv)
 {
+    gboolean background = FALSE, list = FALSE, restored = FALSE;
     int opt, i;
 
+    cooperation_forward(argc, argv);
+
     gtk_init(&argc, &argv);
     grab_environment_configuration();
+    log_setup();
+
+    /* Shut down cleanly on these, so the trace gets written. */
+    if (trace_on())
+    {
+        g_unix_signal_add(SIGINT, trace_quit, NULL);
+        g_unix_signal_add(SIGTERM, trace_quit, NULL);
+    }
 
     // Initialize the closed_tabs queue
     closed_tabs = g_queue_new();
@@ -1806,18 +7624,21 @@ int main(int argc, char **argv)
     // Preload resources
     preload_resources();
 
-    // Add periodic cleanup
-    g_timeout_add_seconds(300, cleanup_resources, NULL);  // Clean up every 5 minutes
-
-    while ((opt = getopt(argc, argv, "C")) != -1)
+    while ((opt = getopt(argc, argv, "Cbl")) != -1)
     {
         switch (opt)
         {
             case 'C':
                 cooperative_instances = FALSE;
                 break;
+            case 'b':
+                background = TRUE;
+                break;
+            case 'l':
+                list = TRUE;
+                break;
             default:
-                fprintf(stderr, "Usage: "NAME" [OPTION]... [URI]...\n");
+                fprintf(stderr, "Usage: "NAME" [-C] [-b] [-l] [URI]...\n");
                 exit(EXIT_FAILURE);
         }
     }
@@ -1825,35 +7646,57 @@ int main(int argc, char **argv)
     if (cooperative_instances)
         cooperation_setup();
 
-    if (!cooperative_instances || cooperative_alone)
-        init_default_web_context();
+    /* Another instance started while we did. */
+    if (cooperative_instances && !cooperative_alone)
+        exit(cooperation_hand_over(list, background, argc - optind, argv + optind));
+    if (list)
+    {
+        log_error("No running instance to list tabs of");
+        cooperation_finish();
+        exit(EXIT_FAILURE);
+    }
+
+    init_default_web_context();
+    disk_cache_setup();
+    pageload_setup();
+    if (history_file != NULL)
+        history_setup();
 
     downloadmanager_setup();
     mainwindow_setup();
 
+    if (hibernate_after > 0 || hibernate_budget_mb > 0)
+        g_timeout_add_seconds(HIBERNATE_CHECK_S, hibernate_check, NULL);
+    memory_pressure_setup();
+
+    if (session_file != NULL)
+        restored = session_setup();
+
     if (optind >= argc)
-        client_new(home_uri, NULL, TRUE, TRUE);
+    {
+        if (!restored)
+            client_new(home_uri, NULL, TRUE, TRUE);
+    }
     else
     {
         for (i = optind; i < argc; i++)
-            client_new(argv[i], NULL, TRUE, TRUE);
+            client_new(argv[i], NULL, TRUE, i == optind);
     }
 
-    if (!cooperative_instances || cooperative_alone)
-        gtk_main();
+    gtk_main();
 
     // Cleanup
-    g_queue_free_full(closed_tabs, g_free);
+    cooperation_finish();
+    session_finish();
+    history_finish();
+    disk_cache_finish();
+    pageload_finish();
+    g_queue_free_full(closed_tabs, closed_tab_free);
+    trace_write();
 
     exit(EXIT_SUCCESS);
 }
 
-gboolean cleanup_resources(gpointer user_data)
-{
-    webkit_web_context_clear_cache(webkit_web_context_get_default());
-    return G_SOURCE_CONTINUE;
-}
-
 void preload_resources(void)
 {
     // Preload icons
@@ -1861,9 +7704,6 @@ void preload_resources(void)
     gtk_icon_theme_load_icon(icon_theme, "text-html", GTK_ICON_SIZE_SMALL_TOOLBAR, 0, NULL);
     gtk_icon_theme_load_icon(icon_theme, "gtk-delete", GTK_ICON_SIZE_SMALL_TOOLBAR, 0, NULL);
     
-    // Precompile regular expressions
-    g_regex_new("^[a-zA-Z0-9-]+\\.[a-zA-Z]{2,}(\\S*)?$", 0, 0, NULL);
-    
     // Preload user scripts
     run_user_scripts(NULL);
 }
@@ -11,26 +11,99 @@
 #define ENABLE_HINTS 1  // Set to 0 to disable hints
 #define HINT_FOLLOW_KEY "f"
 #define HINT_FOLLOW_NEW_WIN_KEY "F"
+#define HINT_CHARSET "sdfghjklertzuivbn"  // Characters used for hint labels
 
 /* Adblocking */
 #define ENABLE_ADBLOCK 1
 
+/* Logging */
+enum { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR, LOG_LEVEL_NONE };
+#define LOG_LEVEL_COMPILED LOG_LEVEL_DEBUG  // Calls below this level are compiled out
+#define LOG_RING_LINES 512  // Messages kept in memory, must be a power of two
+#define LOG_LINE_MAX 256
+
+/* Tracing */
+#define TRACE_EVENTS_MAX 65536  // Per thread, later events are dropped
+
+/* History */
+enum { HISTORY_FSYNC_NEVER, HISTORY_FSYNC_EXIT, HISTORY_FSYNC_BATCH };
+#define HISTORY_BATCH_DELAY_MS 500  // Entries are collected this long before being written
+
+/* Session */
+#define SESSION_WRITE_DELAY_MS 1000     // Changes are collected this long before being written
+#define SESSION_COMPACT_MIN (256 << 10) // Never compact a smaller journal
+#define SESSION_COMPACT_FACTOR 4        // Compact once grown to this many times its compacted size
+
 /* General Configuration */
 static const gchar *accepted_language[2] = { NULL, NULL };
 static gint clients = 0, downloads = 0;
+static gchar *blocklist_file = NULL; /* Defaults to ~/.cache/cream/blocklist */
 static gchar *download_dir = "/var/tmp"; /* Directory has to be static */
-static gchar *fifo_suffix = "main";
+static gchar *socket_suffix = "main";
 static gdouble global_zoom = 1.0;
 static gchar *history_file = NULL;
+static gchar *session_file = NULL;
+static gint history_fsync = HISTORY_FSYNC_NEVER;
+static gint session_fsync = HISTORY_FSYNC_NEVER;  /* Same choices, for session_file */
+static gint log_level = LOG_LEVEL_WARN;  /* Messages at this level or above go to stderr */
+static gchar *trace_file = NULL;  /* Trace events are written here on exit, NULL: no tracing */
 static gchar *home_uri = "https://html.duckduckgo.com/html/"; // about:blank
 static gchar *search_text = NULL;
 static gchar *search_engine = "https://duckduckgo.com/?q=%s";
 static gchar *user_agent = NULL;
 
 /* Cooperative Mode Settings */
+#define CONTROL_MSG_MAX 65536  // Largest request or reply on the control socket
+#define CONTROL_TIMEOUT_S 5    // How long to wait for the running instance to reply
 static gboolean cooperative_alone = TRUE;
 static gboolean cooperative_instances = TRUE;
-static int cooperative_pipe_fp = 0;
+static int cooperative_socket = -1;
+
+/* Background Tabs */
+#define BACKGROUND_TAB_INTERVAL_MS 1000  // Pending tabs then load one at a time, this far apart
+static gint background_tab_delay = 0;    // Seconds until pending tabs load on their own, 0: when activated, -1: right away
+
+/* Spare Tabs */
+#define SPARE_REFILL_INTERVAL_MS 2000  // Spares are made one at a time, this far apart
+#define SPARE_HEADROOM_MB 512          // Memory that has to be available per spare
+static gint spare_tabs = 1;            // Ready-made tabs kept for new tabs, 0: none
+
+/* Closed Tabs */
+#define CLOSED_TAB_GRACE_S 15  // The web view of the last closed tab is kept this long, 0: not at all
+
+/* Tab Hibernation */
+#define HIBERNATE_CHECK_S 30          // How often to look for tabs to hibernate
+static gint hibernate_after = 0;      // Minutes of inactivity until a tab is hibernated, 0: never
+static gint hibernate_budget_mb = 0;  // Memory of all web processes to stay below, 0: no limit
+
+/* Caches */
+enum { CACHE_PROFILE_VIEWER, CACHE_PROFILE_BROWSER, CACHE_PROFILE_CUSTOM };
+static gint cache_profile = CACHE_PROFILE_BROWSER;
+static WebKitCacheModel custom_cache_model = WEBKIT_CACHE_MODEL_DOCUMENT_BROWSER;  // With enable_page_cache as set below
+#define DISK_CACHE_CHECK_S 60            // Sizes are fetched, and the budget enforced, this often
+#define DISK_CACHE_LOW_WATER_PCT 90      // Evicting stops at this % of the budget
+static gchar *disk_cache_dir = NULL;     /* Defaults to ~/.cache/cream, WebKit adds "WebKitCache" */
+static gint disk_cache_budget_mb = 256;  // 0: WebKit's own limit only
+
+/* Page Load Statistics */
+#define PAGELOAD_COMPACT_MIN 4096        // Never compact a file with fewer records
+static gchar *pageload_file = "";        /* "": none, see CREAM_PAGELOAD_FILE */
+
+/* Statistics Page */
+#define STATS_LATENCY_PROBES 20          // Main loop dispatches timed for each cream:stats,
+#define STATS_LATENCY_INTERVAL_MS 50     // this far apart
+#define STATS_HOSTS_PER_BATCH 50         // Page load table rows made per main loop iteration
+
+/* Memory Pressure */
+#define PRESSURE_TRIGGER "some 150000 2000000"  // PSI trigger: 150 ms stalled within 2 s
+#define PRESSURE_POLL_S 2                // Check this often while there is pressure
+#define PRESSURE_POLL_IDLE_S 10          // and otherwise, for cgroup usage or if no trigger could be set up
+#define PRESSURE_CLEAR_CACHE_PCT 10.0    // Time stalled on memory ("some avg10") to clear caches at,
+#define PRESSURE_FREEZE_PCT 25.0         // to stop background tabs from loading at,
+#define PRESSURE_DISCARD_PCT 50.0        // and to start hibernating tabs at
+#define PRESSURE_CGROUP_FREEZE_PCT 90    // Same, by memory.current in % of memory.max
+#define PRESSURE_CGROUP_DISCARD_PCT 95
+static gint memory_limit_mb = 0;         // Per web process, WebKit's own pressure handling. 0: WebKit's default
 
 /* UI Settings */
 static GtkPositionType tab_pos = GTK_POS_TOP;
@@ -158,9 +231,16 @@ struct Client {
     GtkWidget *location;
     GtkWidget *tabicon;
     GtkWidget *tablabel;
+    GtkWidget *tab;      // Event box around tabicon and tablabel
     GtkWidget *vbox;
     GtkWidget *web_view;
+    gchar *pending_uri;  // Background tab that hasn't been loaded yet
+    GBytes *session;     // Session state of a hibernated tab
+    gint64 last_active;  // Monotonic time the tab was last looked at
+    guint32 tab_id;      // Identifies the tab in the session journal
+    gboolean journal_dirty;
     gboolean focus_new_tab;
+    gint trace_phase;    // Navigation span open in the trace, if any
 };
 
 #endif // CONFIG_H
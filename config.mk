@@ -15,6 +15,9 @@ INSTALL = install
 INSTALL_PROGRAM = $(INSTALL)
 INSTALL_DATA = $(INSTALL) -m 644
 
+# Runs the benchmarks of "make bench" on a display of their own
+XVFB_RUN = xvfb-run -a -s "-screen 0 1280x1024x24"
+
 prefix = /usr/local
 exec_prefix = $(prefix)
 bindir = $(exec_prefix)/bin
@@ -25,3 +28,4 @@ man1dir = $(mandir)/man1
 datadir = $(prefix)/share
 applicationsdir = $(datadir)/applications
 iconsdir = $(datadir)/icons/hicolor/128x128/apps
+webextdir = $(libdir)/$(NAME)/web_extensions
@@ -0,0 +1,162 @@
+/* See LICENSE file for copyright and license details. */
+
+/* cream-history: prints the binary history log written by cream as
+ * plain text, one URI per line, least recently visited first.
+ *
+ *     cream-history [-v] [FILE]
+ *
+ * FILE defaults to $CREAM_HISTORY_FILE. With -v, each line also has the
+ * time of the last visit, the number of visits and the title, separated
+ * by tabs. Text files written by older versions are printed as they
+ * are. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+
+struct entry {
+    uint32_t id;
+    uint32_t visits;
+    int64_t last;
+    const char *uri, *title;
+    size_t uri_len, title_len;
+};
+
+static void
+die(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    if (x->last != y->last)
+        return x->last < y->last ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct history_record r;
+    struct entry *entries = NULL, *e;
+    const char *path, *data, *p, *next, *end;
+    size_t count = 0, cap = 0, magic = strlen(HISTORY_MAGIC), i;
+    struct stat st;
+    char when[32];
+    time_t t;
+    int opt, verbose = 0, fd;
+
+    while ((opt = getopt(argc, argv, "v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: "NAME"-history [-v] [FILE]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc)
+        path = argv[optind];
+    else if ((path = getenv(NAME_UPPERCASE"_HISTORY_FILE")) == NULL)
+    {
+        fprintf(stderr, NAME"-history: No file given and $"NAME_UPPERCASE
+                "_HISTORY_FILE not set\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        die(path);
+    if (st.st_size == 0)
+        return EXIT_SUCCESS;
+    if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        die(path);
+    close(fd);
+    end = data + st.st_size;
+
+    if ((size_t)st.st_size < magic || memcmp(data, HISTORY_MAGIC, magic) != 0)
+    {
+        if (fwrite(data, 1, st.st_size, stdout) != (size_t)st.st_size)
+            die(NAME"-history: stdout");
+        return EXIT_SUCCESS;
+    }
+
+    for (p = data + magic; p < end && (next = history_record_next(p, end, &r)) != NULL;
+         p = next)
+    {
+        if (r.type == HISTORY_RECORD_URI && r.id == count)
+        {
+            if (count == cap)
+            {
+                cap = cap == 0 ? 1024 : cap * 2;
+                if ((entries = realloc(entries, cap * sizeof *entries)) == NULL)
+                    die(NAME"-history: realloc");
+            }
+            e = &entries[count++];
+            memset(e, 0, sizeof *e);
+            e->id = r.id;
+            e->visits = r.visits;
+            e->last = r.time;
+            e->uri = r.text;
+            e->uri_len = r.len;
+        }
+        else if (r.id >= count)
+            continue;
+        else if (r.type == HISTORY_RECORD_VISIT)
+        {
+            entries[r.id].visits++;
+            if (r.time > entries[r.id].last)
+                entries[r.id].last = r.time;
+        }
+        else if (r.type == HISTORY_RECORD_TITLE)
+        {
+            entries[r.id].title = r.text;
+            entries[r.id].title_len = r.len;
+        }
+    }
+    if (p < end)
+        fprintf(stderr, NAME"-history: %s: Damaged at offset %lu\n", path,
+                (unsigned long)(p - data));
+
+    qsort(entries, count, sizeof *entries, compare_entries);
+
+    for (i = 0; i < count; i++)
+    {
+        e = &entries[i];
+        if (e->visits == 0)
+            continue;
+
+        if (verbose)
+        {
+            t = e->last;
+            strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("%s\t%u\t%.*s\t%.*s\n", when, e->visits, (int)e->uri_len, e->uri,
+                   (int)e->title_len, e->title == NULL ? "" : e->title);
+        }
+        else
+            printf("%.*s\n", (int)e->uri_len, e->uri);
+    }
+
+    free(entries);
+
+    if (fflush(stdout) != 0)
+        die(NAME"-history: stdout");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Binary history log, written by cream and read by cream-history.
+ *
+ *     magic | record | record | ...
+ *
+ * A record is a header followed by len bytes of payload. The header
+ * names the URI the record is about. Each URI is defined once by a URI
+ * record, all other records refer to it by its ID. IDs are handed out
+ * in order of definition, starting at 0.
+ *
+ *     URI record:    header | visits | pad | last visit | URI
+ *     Visit record:  header | time
+ *     Title record:  header | title
+ *
+ * Times are seconds since the epoch, all numbers are in host byte order.
+ * A URI record carries the visits that were folded into it by
+ * compaction, which rewrites the log as one URI and one title record
+ * per URI. Strings are not NUL terminated. */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTORY_MAGIC "CRMHST01"
+#define HISTORY_URI_MAX 4096    // Longer URIs (data:, mostly) are not recorded
+#define HISTORY_TITLE_MAX 1024  // Longer titles are truncated
+
+enum {
+    HISTORY_RECORD_URI = 'U',
+    HISTORY_RECORD_VISIT = 'V',
+    HISTORY_RECORD_TITLE = 'T',
+};
+
+struct history_header {
+    uint32_t id;
+    uint8_t type;
+    uint8_t pad;
+    uint16_t len;       // Length of the payload
+};
+
+struct history_uri {
+    uint32_t visits;
+    uint32_t pad;
+    int64_t last;
+};
+
+struct history_record {
+    uint32_t id;
+    int type;
+    uint32_t visits;    // URI records only
+    int64_t time;       // Last visit of URI records, time of visit records
+    const char *text;   // URI or title
+    size_t len;
+};
+
+/* Parses the record at p. Returns the start of the next record, or NULL
+ * if the record is incomplete or broken, which is what a crash while
+ * appending leaves behind. */
+static inline const char *
+history_record_next(const char *p, const char *end, struct history_record *r)
+{
+    struct history_header hdr;
+    struct history_uri uri;
+
+    if ((size_t)(end - p) < sizeof hdr)
+        return NULL;
+    memcpy(&hdr, p, sizeof hdr);
+    p += sizeof hdr;
+    if ((size_t)(end - p) < hdr.len)
+        return NULL;
+
+    memset(r, 0, sizeof *r);
+    r->id = hdr.id;
+    r->type = hdr.type;
+
+    switch (hdr.type)
+    {
+        case HISTORY_RECORD_URI:
+            if (hdr.len < sizeof uri)
+                return NULL;
+            memcpy(&uri, p, sizeof uri);
+            r->visits = uri.visits;
+            r->time = uri.last;
+            r->text = p + sizeof uri;
+            r->len = hdr.len - sizeof uri;
+            break;
+        case HISTORY_RECORD_VISIT:
+            if (hdr.len != sizeof r->time)
+                return NULL;
+            memcpy(&r->time, p, sizeof r->time);
+            break;
+        case HISTORY_RECORD_TITLE:
+            r->text = p;
+            r->len = hdr.len;
+            break;
+        default:
+            return NULL;
+    }
+
+    return p + hdr.len;
+}
+
+#endif // HISTORY_H
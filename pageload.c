@@ -0,0 +1,183 @@
+/* See LICENSE file for copyright and license details. */
+
+/* cream-pageload: prints the page load statistics written by cream, one
+ * host per line, in alphabetical order.
+ *
+ *     cream-pageload [-r] [FILE]
+ *
+ * FILE defaults to $CREAM_PAGELOAD_FILE, which cream records to. Each
+ * line has the host, the number of navigations counted and the median
+ * and 90th percentile of each phase in milliseconds, and of the KiB
+ * loaded. With -r, the records are printed as they are, one
+ * navigation per line, oldest first. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pageload.h"
+
+struct entry {
+    struct pageload_record r;
+    const char *host;
+    size_t index;       // Position in the file
+};
+
+static void
+die(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+    int c;
+
+    c = strncmp(x->host, y->host, x->r.host_len < y->r.host_len ?
+                                  x->r.host_len : y->r.host_len);
+    if (c == 0 && x->r.host_len != y->r.host_len)
+        c = x->r.host_len < y->r.host_len ? -1 : 1;
+    if (c == 0)
+        c = x->index < y->index ? -1 : x->index > y->index;
+    return c;
+}
+
+static void
+print_percentiles(const struct entry *e, size_t n, int metric)
+{
+    uint64_t values[PAGELOAD_SAMPLES];
+    size_t i, count = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (metric == PAGELOAD_METRICS)
+            values[count++] = e[i].r.bytes >> 10;
+        else if (e[i].r.ms[metric] != PAGELOAD_NONE)
+            values[count++] = e[i].r.ms[metric];
+    }
+
+    if (count == 0)
+        printf("\t-");
+    else
+        printf("\t%llu/%llu",
+               (unsigned long long)pageload_percentile(values, count, 50),
+               (unsigned long long)pageload_percentile(values, count, 90));
+}
+
+int
+main(int argc, char **argv)
+{
+    struct entry *entries = NULL, *e;
+    const char *path, *data, *p, *next, *end, *host;
+    size_t count = 0, cap = 0, magic = strlen(PAGELOAD_MAGIC), i, j, first;
+    struct pageload_record r;
+    struct stat st;
+    char when[32];
+    time_t t;
+    int opt, raw = 0, fd, m;
+
+    while ((opt = getopt(argc, argv, "r")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                raw = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: "NAME"-pageload [-r] [FILE]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc)
+        path = argv[optind];
+    else if ((path = getenv(NAME_UPPERCASE"_PAGELOAD_FILE")) == NULL || path[0] == 0)
+    {
+        fprintf(stderr, NAME"-pageload: No file given and $"NAME_UPPERCASE"_PAGELOAD_FILE not set\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        die(path);
+    if (st.st_size == 0)
+        return EXIT_SUCCESS;
+    if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        die(path);
+    close(fd);
+    end = data + st.st_size;
+
+    if ((size_t)st.st_size < magic || memcmp(data, PAGELOAD_MAGIC, magic) != 0)
+    {
+        fprintf(stderr, NAME"-pageload: %s: Not a page load file\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (p = data + magic; p < end && (next = pageload_record_next(p, end, &r, &host)) != NULL;
+         p = next)
+    {
+        if (raw)
+        {
+            t = r.time;
+            strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("%s\t%.*s", when, (int)r.host_len, host);
+            for (m = 0; m < PAGELOAD_METRICS; m++)
+            {
+                if (r.ms[m] == PAGELOAD_NONE)
+                    printf("\t-");
+                else
+                    printf("\t%u", r.ms[m]);
+            }
+            printf("\t%llu\n", (unsigned long long)r.bytes);
+            continue;
+        }
+
+        if (count == cap)
+        {
+            cap = cap == 0 ? 1024 : cap * 2;
+            if ((entries = realloc(entries, cap * sizeof *entries)) == NULL)
+                die(NAME"-pageload: realloc");
+        }
+        e = &entries[count];
+        e->r = r;
+        e->host = host;
+        e->index = count++;
+    }
+    if (p < end)
+        fprintf(stderr, NAME"-pageload: %s: Damaged at offset %lu\n", path,
+                (unsigned long)(p - data));
+
+    qsort(entries, count, sizeof *entries, compare_entries);
+
+    if (!raw)
+        printf("HOST\tN\tREDIRECT\tCOMMIT\tPAINT\tFINISH\tKIB\n");
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && entries[j].r.host_len == entries[i].r.host_len &&
+             memcmp(entries[j].host, entries[i].host, entries[i].r.host_len) == 0; j++)
+            ;
+
+        /* Only the most recent navigations count. */
+        first = j - i > PAGELOAD_SAMPLES ? j - PAGELOAD_SAMPLES : i;
+        printf("%.*s\t%lu", (int)entries[i].r.host_len, entries[i].host,
+               (unsigned long)(j - first));
+        for (m = 0; m <= PAGELOAD_METRICS; m++)
+            print_percentiles(&entries[first], j - first, m);
+        putchar('\n');
+    }
+
+    free(entries);
+
+    if (fflush(stdout) != 0)
+        die(NAME"-pageload: stdout");
+
+    return EXIT_SUCCESS;
+}
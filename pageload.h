@@ -0,0 +1,82 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Page load statistics, written by cream and read by cream-pageload.
+ *
+ *     magic | record | host | record | host | ...
+ *
+ * One record per navigation that finished, appended as it happens. Times
+ * are milliseconds since the navigation started, all numbers are in
+ * host byte order. Only the last PAGELOAD_SAMPLES records of each host
+ * count, compaction rewrites the file with just those. The host is not
+ * NUL terminated. */
+
+#ifndef PAGELOAD_H
+#define PAGELOAD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGELOAD_MAGIC "CRMPLD01"
+#define PAGELOAD_SAMPLES 100   // Navigations per host the percentiles are taken over
+#define PAGELOAD_HOST_MAX 255
+#define PAGELOAD_NONE UINT32_MAX  // The navigation had no such phase
+
+enum {
+    PAGELOAD_REDIRECT,  // Last redirect
+    PAGELOAD_COMMIT,    // First data of the final response
+    PAGELOAD_PAINT,     // First time the page was drawn after committing
+    PAGELOAD_FINISH,    // Load event, all resources loaded
+    PAGELOAD_METRICS,
+};
+
+struct pageload_record {
+    int64_t time;       // Seconds since the epoch, when the navigation started
+    uint64_t bytes;     // Content length of all resources the page loaded
+    uint32_t ms[PAGELOAD_METRICS];
+    uint16_t host_len;
+    uint16_t pad[3];
+};
+
+/* Parses the record at p. Returns the start of the next record, or NULL
+ * if the record is incomplete or broken. */
+static inline const char *
+pageload_record_next(const char *p, const char *end, struct pageload_record *r,
+                     const char **host)
+{
+    if ((size_t)(end - p) < sizeof *r)
+        return NULL;
+    memcpy(r, p, sizeof *r);
+    p += sizeof *r;
+    if (r->host_len == 0 || r->host_len > PAGELOAD_HOST_MAX ||
+        (size_t)(end - p) < r->host_len)
+        return NULL;
+
+    *host = p;
+    return p + r->host_len;
+}
+
+static inline int
+pageload_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The pct-th percentile (nearest rank) of n values, which are sorted in
+ * place. */
+static inline uint64_t
+pageload_percentile(uint64_t *values, size_t n, int pct)
+{
+    size_t rank;
+
+    if (n == 0)
+        return 0;
+
+    qsort(values, n, sizeof *values, pageload_compare);
+    rank = (n * pct + 99) / 100;
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+#endif // PAGELOAD_H
@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Web extension that cancels every request to a host found in the
+ * domain blocklist built by cream-blocklist. "send-request" is emitted
+ * before WebKit resolves or connects to anything, so blocked hosts
+ * never cause any network traffic.
+ *
+ * The path of the table is handed over by the browser as part of the
+ * initialization user data. */
+
+#include <webkit2/webkit-web-extension.h>
+
+#include "blocklist.h"
+
+static struct blocklist bl;
+
+static gboolean
+send_request(WebKitWebPage *page, WebKitURIRequest *request,
+             WebKitURIResponse *redirected_response, gpointer data)
+{
+    /* Returning TRUE cancels the request. */
+    return blocklist_match_uri(&bl, webkit_uri_request_get_uri(request));
+}
+
+static void
+page_created(WebKitWebExtension *extension, WebKitWebPage *page, gpointer data)
+{
+    g_signal_connect(G_OBJECT(page), "send-request",
+                     G_CALLBACK(send_request), NULL);
+}
+
+G_MODULE_EXPORT void
+webkit_web_extension_initialize_with_user_data(WebKitWebExtension *extension,
+                                               const GVariant *user_data)
+{
+    GVariant *ud = (GVariant *)user_data;
+    const gchar *path = NULL;
+
+    if (ud == NULL || !g_variant_is_of_type(ud, G_VARIANT_TYPE_VARDICT) ||
+        !g_variant_lookup(ud, "blocklist", "&s", &path))
+        return;
+
+    if (blocklist_open(&bl, path) == -1)
+    {
+        fprintf(stderr, "we_blocklist: Could not load blocklist '%s'\n", path);
+        return;
+    }
+
+    g_signal_connect(G_OBJECT(extension), "page-created",
+                     G_CALLBACK(page_created), NULL);
+}